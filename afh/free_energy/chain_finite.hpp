@@ -19,7 +19,7 @@
 #pragma once
 
 #include <Eigen/Dense>
-#include "standards/exp_number.hpp"
+#include "exact/log_sum_exp.hpp"
 #include "chain.hpp"
 
 namespace afh { namespace free_energy { namespace chain {
@@ -49,12 +49,11 @@ public:
     // calculate free energy and intternal energy
     uint_t dim = 1 << L_;
     double beta = 1 / t;
-    standards::exp_double z = 0;
-    standards::exp_double w = 0;
+    exact::log_sum_exp<double> z, w;
     for (uint_t i = 0; i < dim; ++i) {
       uint_t j = dim - i - 1;
-      z += standards::exp_double::exp(-beta * eigenvalues_(j));
-      w += eigenvalues_(j) * standards::exp_double::exp(-beta * eigenvalues_(j));
+      z.add(-beta * eigenvalues_(j));
+      w.add(-beta * eigenvalues_(j), eigenvalues_(j));
     }
     double f = - log(z) / (beta * L_);
     double e = w / z / L_;
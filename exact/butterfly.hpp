@@ -0,0 +1,77 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Cache-blocked, thread-parallel schedule of the two-point updates over the
+// bits of a state index shared by the transfer matrices
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include "exact/parallel.hpp"
+
+namespace exact {
+namespace butterfly {
+
+// Number of index bits of a tile of elements of elem_bytes each that fits in
+// a 256 KiB cache
+inline std::size_t tile_bits(std::size_t elem_bytes) {
+  std::size_t bits = 1;
+  while (bits < 16 && (std::size_t(2) << bits) * elem_bytes <= (std::size_t(1) << 18))
+    ++bits;
+  return bits;
+}
+
+// Calls f(s, c, n) to update the pairs (c + i, c + i + 2^s), i = 0, ..., n - 1,
+// in place, for all pairs of each level s = 0, ..., bits - 1.  Every element
+// sees the levels in increasing order, so that the result is identical to
+//   for (s = 0; s < bits; ++s)
+//     for (c = 0; c < 2^bits; ++c) if bit s of c is 0: f(s, c, 1)
+// The first pass runs the lowest t levels on contiguous tiles of 2^t elements.
+// Each later pass runs t / 2 levels on tiles made of 2^(t/2) rows of up to
+// 2^(t - t/2) consecutive elements.  The tiles of a pass run in parallel.
+template <typename F>
+inline void apply(std::size_t bits, F f, std::size_t t = 12, unsigned threads = 0) {
+  t = std::max(std::min(t, bits), std::size_t(1));
+  std::size_t l = 0;
+  while (l < bits) {
+    std::size_t g = (l == 0) ? t : std::min(std::max(t / 2, std::size_t(1)), bits - l);
+    std::size_t run = (l == 0) ? 1 : std::min(std::size_t(1) << l, std::size_t(1) << (t - g));
+    std::size_t runs = (std::size_t(1) << l) / run;
+    std::size_t tiles = (std::size_t(1) << (bits - l - g)) * runs;
+    auto pass = [&](std::size_t tile) {
+      std::size_t base = (tile / runs) << (l + g) | (tile % runs) * run;
+      for (std::size_t s = l; s < l + g; ++s) {
+        std::size_t step = std::size_t(1) << s;
+        if (l == 0) {
+          for (std::size_t c = base; c < base + (std::size_t(1) << g); c += 2 * step)
+            f(s, c, step);
+        } else {
+          for (std::size_t m = 0; m < (std::size_t(1) << g); ++m)
+            if (((m >> (s - l)) & 1) == 0) f(s, base + (m << l), run);
+        }
+      }
+    };
+    if (tiles == 1)
+      pass(0);
+    else
+      parallel::for_each(tiles, pass, threads);
+    l += g;
+  }
+}
+
+}  // end namespace butterfly
+}  // end namespace exact
@@ -0,0 +1,57 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <cstdint>
+#include <vector>
+#include <gtest/gtest.h>
+#include "exact/butterfly.hpp"
+
+namespace {
+
+// an update that does not commute between levels
+void update(std::vector<std::uint64_t>& v, std::size_t s, std::size_t c0) {
+  std::size_t c1 = c0 + (std::size_t(1) << s);
+  std::uint64_t a = v[c0], b = v[c1];
+  v[c0] = 3 * a + b + s;
+  v[c1] = a + 5 * b + 7 * s;
+}
+
+}  // namespace
+
+TEST(ButterflyTest, Schedule) {
+  for (std::size_t bits = 0; bits <= 13; ++bits) {
+    for (std::size_t t = 1; t <= 6; ++t) {
+      std::size_t dim = std::size_t(1) << bits;
+      std::vector<std::uint64_t> v(dim), w(dim);
+      for (std::size_t c = 0; c < dim; ++c) v[c] = w[c] = c * c + 1;
+      for (std::size_t s = 0; s < bits; ++s)
+        for (std::size_t c = 0; c < dim; ++c)
+          if (((c >> s) & 1) == 0) update(v, s, c);
+      exact::butterfly::apply(
+          bits,
+          [&](std::size_t s, std::size_t c, std::size_t n) {
+            for (std::size_t i = 0; i < n; ++i) update(w, s, c + i);
+          },
+          t, 4);
+      EXPECT_EQ(v, w) << "bits = " << bits << ", t = " << t;
+    }
+  }
+}
+
+TEST(ButterflyTest, TileBits) {
+  EXPECT_EQ(15, exact::butterfly::tile_bits(8));
+  EXPECT_EQ(12, exact::butterfly::tile_bits(64));
+}
@@ -0,0 +1,129 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Sum of exponentially large or small terms, accumulated in blocks
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <standards/exp_number.hpp>
+
+namespace exact {
+
+// Accumulates sum_i a_i exp(x_i) for terms far outside the range of T.  The
+// terms are buffered as (x_i, a_i) and reduced a block at a time: one pass
+// for the largest exponent, one for sum_i a_i exp(x_i - max), both without
+// branches, and the result is kept as (max, sum) with the running maximum
+// shared by all blocks.  Replaces a sum of standards::exp_number, where each
+// addition takes a comparison, an exp, and a log1p.  The coefficients may
+// have either sign; log() and the conversion to exp_number need a positive
+// sum.
+template <typename T, std::size_t N = 256>
+class log_sum_exp {
+public:
+  typedef T value_type;
+  static constexpr std::size_t block_size = N;
+
+  log_sum_exp() : max_(-std::numeric_limits<T>::infinity()), sum_(0), size_(0) {}
+
+  // adds a exp(x)
+  void add(T x, T a = 1) {
+    if (size_ == N)
+      flush();
+    x_[size_] = x;
+    a_[size_] = a;
+    ++size_;
+  }
+  // adds a nonnegative exp_number
+  log_sum_exp& operator+=(const standards::exp_number<T>& v) {
+    using standards::log;
+    add(log(v));
+    return *this;
+  }
+
+  // reduces the buffered terms
+  void flush() {
+    reduce(x_, a_, size_, max_, sum_);
+    size_ = 0;
+  }
+
+  // the sum is sum() * exp(max()), with sum() of order one unless the terms
+  // cancel
+  T max() const {
+    T m, s;
+    reduced(m, s);
+    return m;
+  }
+  T sum() const {
+    T m, s;
+    reduced(m, s);
+    return s;
+  }
+  T log() const {
+    using std::log;
+    T m, s;
+    reduced(m, s);
+    return m + log(s);
+  }
+  operator standards::exp_number<T>() const {
+    return standards::exp_number<T>::exp(log());
+  }
+
+  // ratio of two sums, which may have either sign
+  friend T operator/(const log_sum_exp& a, const log_sum_exp& b) {
+    using std::exp;
+    T ma, sa, mb, sb;
+    a.reduced(ma, sa);
+    b.reduced(mb, sb);
+    return sa / sb * exp(ma - mb);
+  }
+
+private:
+  void reduced(T& max, T& sum) const {
+    max = max_;
+    sum = sum_;
+    reduce(x_, a_, size_, max, sum);
+  }
+  static void reduce(const T* x, const T* a, std::size_t n, T& max, T& sum) {
+    using std::exp;
+    if (n == 0)
+      return;
+    T m = max;
+    for (std::size_t i = 0; i < n; ++i)
+      m = std::max(m, x[i]);
+    if (m == -std::numeric_limits<T>::infinity())
+      return;
+    T s = (max == -std::numeric_limits<T>::infinity()) ? T(0) : sum * exp(max - m);
+    for (std::size_t i = 0; i < n; ++i)
+      s += a[i] * exp(x[i] - m);
+    max = m;
+    sum = s;
+  }
+
+  T max_, sum_;
+  T x_[N], a_[N];
+  std::size_t size_;
+};
+
+template <typename T, std::size_t N>
+inline T log(const log_sum_exp<T, N>& s) {
+  return s.log();
+}
+
+}  // namespace exact
@@ -0,0 +1,70 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <cmath>
+#include <gtest/gtest.h>
+#include "exact/log_sum_exp.hpp"
+
+TEST(LogSumExpTest, Sum) {
+  // sum_{i=0}^{n-1} exp(-i) over several blocks, shifted far below the
+  // range of double
+  std::size_t n = 1000;
+  double shift = -2000;
+  exact::log_sum_exp<double, 64> s;
+  for (std::size_t i = 0; i < n; ++i)
+    s.add(shift - double(i));
+  double expected = shift - std::log1p(-std::exp(-1.0)) +
+                    std::log1p(-std::exp(-double(n)));
+  EXPECT_NEAR(expected, log(s), 1e-12);
+  EXPECT_NEAR(expected, s.max() + std::log(s.sum()), 1e-12);
+  s.flush();
+  EXPECT_NEAR(expected, log(s), 1e-12);
+}
+
+TEST(LogSumExpTest, Increasing) {
+  // the running maximum grows with every block
+  exact::log_sum_exp<double, 4> s;
+  for (int i = 0; i < 100; ++i)
+    s.add(10.0 * i);
+  EXPECT_NEAR(990 - std::log1p(-std::exp(-10.0)), log(s), 1e-12);
+}
+
+TEST(LogSumExpTest, Ratio) {
+  // <E> = sum_i E_i exp(-beta E_i) / sum_i exp(-beta E_i) with E_i of both
+  // signs
+  double beta = 100;
+  exact::log_sum_exp<double, 8> z, w;
+  double zr = 0, wr = 0;
+  for (int i = 0; i < 37; ++i) {
+    double e = std::sin(0.3 * i) - 0.5;
+    z.add(-beta * e);
+    w.add(-beta * e, e);
+    zr += std::exp(-beta * e - 150);
+    wr += e * std::exp(-beta * e - 150);
+  }
+  EXPECT_NEAR(wr / zr, w / z, 1e-13);
+  EXPECT_NEAR(std::log(zr) + 150, log(z), 1e-12);
+}
+
+TEST(LogSumExpTest, Empty) {
+  exact::log_sum_exp<double> s;
+  EXPECT_EQ(0, s.sum());
+  EXPECT_TRUE(std::isinf(log(s)));
+  s.add(-std::numeric_limits<double>::infinity());
+  EXPECT_EQ(0, s.sum());
+  s.add(1.0, 2.0);
+  EXPECT_NEAR(1 + std::log(2.0), log(s), 1e-15);
+}
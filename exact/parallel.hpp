@@ -0,0 +1,194 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Thread-parallel loops shared by the solvers
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace exact {
+namespace parallel {
+
+inline unsigned& requested_threads() {
+  static unsigned n = 0;
+  return n;
+}
+
+// 0 restores the default (EXACT_NUM_THREADS or hardware concurrency)
+inline void set_num_threads(unsigned n) {
+  requested_threads() = n;
+}
+
+inline unsigned num_threads() {
+  unsigned n = requested_threads();
+  if (n == 0) {
+    const char* env = std::getenv("EXACT_NUM_THREADS");
+    if (env)
+      n = std::atoi(env);
+  }
+  if (n == 0) {
+    // queried once, as it may read the system configuration on every call
+    static const unsigned hardware = std::thread::hardware_concurrency();
+    n = hardware;
+  }
+  return (n > 0) ? n : 1;
+}
+
+// true while the current thread is running a for_each task
+inline bool& in_parallel() {
+  thread_local bool flag = false;
+  return flag;
+}
+
+// Worker threads kept for the lifetime of the process.  run() hands a job to
+// the requested number of them, runs it on the calling thread as well, and
+// returns once every copy has finished.  The pool grows to the largest
+// number of helpers ever requested and never shrinks.  Jobs from different
+// calling threads are run one after another.
+class thread_pool {
+public:
+  static thread_pool& instance() {
+    static thread_pool pool;
+    return pool;
+  }
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& th : threads_)
+      th.join();
+  }
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return threads_.size();
+  }
+  // job must not throw, and must leave no work behind for the helpers once
+  // the copy on the calling thread returns
+  void run(unsigned helpers, std::function<void()> const& job) {
+    std::lock_guard<std::mutex> busy(run_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      while (threads_.size() < helpers)
+        threads_.emplace_back([this]() { work(); });
+      job_ = &job;
+      pending_ = helpers;
+    }
+    wake_.notify_all();
+    job();
+    std::unique_lock<std::mutex> lock(mutex_);
+    // helpers that have not picked up the job yet would find nothing to do
+    pending_ = 0;
+    done_.wait(lock, [this]() { return active_ == 0; });
+    job_ = nullptr;
+  }
+
+private:
+  thread_pool() : job_(nullptr), pending_(0), active_(0), stop_(false) {}
+  thread_pool(thread_pool const&) = delete;
+  thread_pool& operator=(thread_pool const&) = delete;
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      wake_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+      if (stop_)
+        return;
+      --pending_;
+      ++active_;
+      std::function<void()> const* job = job_;
+      lock.unlock();
+      (*job)();
+      lock.lock();
+      if (--active_ == 0)
+        done_.notify_all();
+    }
+  }
+  mutable std::mutex mutex_;
+  std::mutex run_mutex_;
+  std::condition_variable wake_, done_;
+  std::vector<std::thread> threads_;
+  std::function<void()> const* job_;
+  unsigned pending_, active_;
+  bool stop_;
+};
+
+// Calls f(i) for i = 0, ..., n - 1 on the threads of thread_pool.  Indices
+// are handed out one at a time from a shared counter, so that a thread that
+// finishes early takes over the remaining work.  Nested calls run serially
+// on the calling thread.  The first exception thrown by f is rethrown.
+template <typename F>
+inline void for_each(std::size_t n, F f, unsigned threads = 0) {
+  if (n <= 1)
+    threads = 1;
+  if (threads == 0)
+    threads = num_threads();
+  if (threads > n)
+    threads = n;
+  if (threads <= 1 || in_parallel()) {
+    for (std::size_t i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+  std::atomic<std::size_t> next(0);
+  std::exception_ptr error;
+  std::mutex mutex;
+  auto worker = [&]() {
+    in_parallel() = true;
+    try {
+      for (std::size_t i = next++; i < n; i = next++)
+        f(i);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error)
+        error = std::current_exception();
+      next = n;
+    }
+    in_parallel() = false;
+  };
+  thread_pool::instance().run(threads - 1, worker);
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// Returns init combined by op with f(0), ..., f(n - 1).  The f(i) are
+// evaluated in parallel by for_each and then combined pairwise in a fixed
+// binary tree, so that the result is bitwise identical for any number of
+// threads.
+template <typename T, typename F, typename Op>
+inline T reduce(std::size_t n, T init, F f, Op op, unsigned threads = 0) {
+  if (n == 0)
+    return init;
+  std::vector<T> v(n, init);
+  for_each(
+      n, [&](std::size_t i) { v[i] = f(i); }, threads);
+  for (std::size_t w = 1; w < n; w *= 2)
+    for (std::size_t i = 0; i + w < n; i += 2 * w)
+      v[i] = op(v[i], v[i + w]);
+  return op(init, v[0]);
+}
+
+}  // end namespace parallel
+}  // end namespace exact
@@ -0,0 +1,66 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+#include <gtest/gtest.h>
+#include "exact/parallel.hpp"
+
+TEST(ParallelTest, ForEach) {
+  std::size_t n = 1000;
+  std::vector<int> hits(n, 0);
+  exact::parallel::for_each(n, [&](std::size_t i) { hits[i] += 1; }, 4);
+  for (std::size_t i = 0; i < n; ++i)
+    EXPECT_EQ(1, hits[i]);
+}
+
+TEST(ParallelTest, Nested) {
+  std::atomic<int> count(0);
+  exact::parallel::for_each(
+      8,
+      [&](std::size_t) {
+        EXPECT_TRUE(exact::parallel::in_parallel());
+        exact::parallel::for_each(8, [&](std::size_t) { ++count; }, 4);
+      },
+      4);
+  EXPECT_EQ(64, count);
+  EXPECT_FALSE(exact::parallel::in_parallel());
+}
+
+TEST(ParallelTest, Exception) {
+  EXPECT_THROW(exact::parallel::for_each(
+                   100,
+                   [](std::size_t i) {
+                     if (i == 42)
+                       throw std::runtime_error("error");
+                   },
+                   4),
+               std::runtime_error);
+}
+
+TEST(ParallelTest, Pool) {
+  // the helper threads are started once and reused by later calls
+  std::atomic<int> count(0);
+  for (int k = 0; k < 100; ++k)
+    exact::parallel::for_each(16, [&](std::size_t) { ++count; }, 4);
+  EXPECT_EQ(1600, count);
+  std::size_t size = exact::parallel::thread_pool::instance().size();
+  EXPECT_GE(size, 3u);
+  exact::parallel::for_each(16, [&](std::size_t) { ++count; }, 2);
+  exact::parallel::for_each(16, [&](std::size_t) { ++count; }, 4);
+  EXPECT_EQ(size, exact::parallel::thread_pool::instance().size());
+}
@@ -0,0 +1,284 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Process-wide tanh-sinh integrators whose tables can be kept on disk
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <ios>
+#include <istream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/math/constants/constants.hpp>
+
+namespace exact {
+namespace tanh_sinh_cache {
+
+// Tanh-sinh quadrature on a finite interval.  The substitution
+// x = tanh(pi/2 sinh t) is sampled at t = j h, and level k of the tables
+// holds the nodes that h = 2^-k adds to the coarser levels.  A node is stored
+// as its distance 1 - |x| from the end points, so that no node is rounded
+// onto an end point, together with its weight pi/2 cosh t / cosh^2(pi/2
+// sinh t).  Each level stops where that distance falls below eps^2.  Levels
+// are computed on first use, and integrate() may be called from several
+// threads at once.  save() and load() write and restore the computed levels
+// as text with max_digits10 digits, which round-trips bit for bit.
+template <typename Real>
+class tanh_sinh {
+public:
+  explicit tanh_sinh(std::size_t max_refinements = 15)
+      : max_refinements_(max_refinements),
+        complements_(max_refinements + 1),
+        weights_(max_refinements + 1),
+        levels_(0) {}
+
+  std::size_t max_refinements() const { return max_refinements_; }
+  // number of levels computed or loaded so far
+  std::size_t levels() const { return levels_.load(std::memory_order_acquire); }
+
+  // Refines until two successive levels agree to tolerance relative to the
+  // integral of |f|.  The error of the returned level is then about the
+  // square of that, as the error of tanh-sinh falls off exponentially in 1/h.
+  template <typename F>
+  auto integrate(F const& f, Real a, Real b,
+                 Real tolerance = default_tolerance()) const
+      -> decltype(f(std::declval<Real>())) {
+    using std::abs;
+    typedef decltype(f(std::declval<Real>())) result_type;
+    Real half = (b - a) / 2;
+    require(0);
+    result_type sum = weights_[0][0] * f(a + half);
+    result_type l1 = abs(sum);
+    add_level(f, a, b, half, 0, 1, sum, l1);
+    result_type prev = half * sum;
+    for (std::size_t k = 1; k <= max_refinements_; ++k) {
+      require(k);
+      add_level(f, a, b, half, k, 0, sum, l1);
+      Real h = Real(1) / Real(std::size_t(1) << k);
+      result_type res = half * h * sum;
+      if (k >= 2 && abs(res - prev) <= tolerance * abs(half) * h * l1)
+        return res;
+      prev = res;
+    }
+    throw(std::runtime_error("tanh-sinh quadrature did not converge"));
+  }
+
+  void save(std::ostream& os) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t n = levels_.load(std::memory_order_relaxed);
+    std::ios_base::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision(std::numeric_limits<Real>::max_digits10);
+    os.unsetf(std::ios_base::floatfield);
+    os << "tanh_sinh " << std::numeric_limits<Real>::radix << ' '
+       << std::numeric_limits<Real>::digits << ' ' << n << '\n';
+    for (std::size_t k = 0; k < n; ++k) {
+      os << complements_[k].size() << '\n';
+      for (std::size_t j = 0; j < complements_[k].size(); ++j)
+        os << complements_[k][j] << ' ' << weights_[k][j] << '\n';
+    }
+    os.precision(precision);
+    os.flags(flags);
+  }
+
+  // Restores the levels written by save() for a type of the same radix and
+  // digits, as far as max_refinements reaches.  Returns the number of levels
+  // in the image, or 0 if the stream does not hold a valid one.
+  std::size_t load(std::istream& is) {
+    std::string tag;
+    int radix, digits;
+    std::size_t n;
+    if (!(is >> tag >> radix >> digits >> n) || tag != "tanh_sinh" ||
+        radix != std::numeric_limits<Real>::radix ||
+        digits != std::numeric_limits<Real>::digits)
+      return 0;
+    std::size_t m = std::min(n, max_refinements_ + 1);
+    std::vector<std::vector<Real>> xc(m), w(m);
+    for (std::size_t k = 0; k < m; ++k) {
+      std::size_t size;
+      if (!(is >> size)) return 0;
+      xc[k].resize(size);
+      w[k].resize(size);
+      for (std::size_t j = 0; j < size; ++j)
+        if (!(is >> xc[k][j] >> w[k][j])) return 0;
+    }
+    // the levels present already are identical and may be in use
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t k = levels_.load(std::memory_order_relaxed);
+    if (k < m) {
+      for (; k < m; ++k) {
+        complements_[k].swap(xc[k]);
+        weights_[k].swap(w[k]);
+      }
+      levels_.store(m, std::memory_order_release);
+    }
+    return n;
+  }
+
+private:
+  static Real default_tolerance() {
+    using std::sqrt;
+    return sqrt(std::numeric_limits<Real>::epsilon());
+  }
+
+  template <typename F, typename R>
+  void add_level(F const& f, Real const& a, Real const& b, Real const& half,
+                 std::size_t k, std::size_t first, R& sum, R& l1) const {
+    using std::abs;
+    std::vector<Real> const& xc = complements_[k];
+    std::vector<Real> const& w = weights_[k];
+    for (std::size_t j = first; j < xc.size(); ++j) {
+      Real d = half * xc[j];
+      Real xa = a + d, xb = b - d;
+      if (xa != a) {
+        R v = f(xa);
+        sum += w[j] * v;
+        l1 += w[j] * abs(v);
+      }
+      if (xb != b) {
+        R v = f(xb);
+        sum += w[j] * v;
+        l1 += w[j] * abs(v);
+      }
+    }
+  }
+
+  // computes the levels up to k unless done already
+  void require(std::size_t k) const {
+    if (levels() > k) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t n = levels_.load(std::memory_order_relaxed);
+    for (; n <= k; ++n) compute(n);
+    levels_.store(n, std::memory_order_release);
+  }
+
+  void compute(std::size_t k) const {
+    using std::cosh;
+    using std::exp;
+    using std::sinh;
+    Real half_pi = boost::math::constants::pi<Real>() / 2;
+    Real eps = std::numeric_limits<Real>::epsilon();
+    Real min_complement = eps * eps;
+    Real h = Real(1) / Real(std::size_t(1) << k);
+    complements_[k].clear();
+    weights_[k].clear();
+    std::size_t step = (k == 0) ? 1 : 2;
+    for (std::size_t j = (k == 0) ? 0 : 1;; j += step) {
+      Real t = h * Real(j);
+      Real e = exp(half_pi * sinh(t));
+      Real c = (e + 1 / e) / 2;  // cosh(pi/2 sinh t)
+      Real xc = 1 / (e * c);
+      if (!(xc > min_complement)) break;
+      complements_[k].push_back(xc);
+      weights_[k].push_back(half_pi * cosh(t) / (c * c));
+    }
+  }
+
+  std::size_t max_refinements_;
+  mutable std::vector<std::vector<Real>> complements_, weights_;
+  mutable std::atomic<std::size_t> levels_;
+  mutable std::mutex mutex_;
+};
+
+// Directory named by EXACT_TANH_SINH_CACHE, empty if unset
+inline std::string directory() {
+  const char* env = std::getenv("EXACT_TANH_SINH_CACHE");
+  return env ? std::string(env) : std::string();
+}
+
+// The tables of types wider than long double, whose computation dominates a
+// short run, are kept in directory() if it is set: one file per radix and
+// number of digits, read when the first integrator for Real is created and
+// rewritten at exit if more levels have been computed since.
+template <typename Real>
+inline std::string file_name() {
+  if (std::numeric_limits<Real>::digits10 <=
+      std::numeric_limits<long double>::digits10)
+    return std::string();
+  std::string dir = directory();
+  if (dir.empty()) return dir;
+  return dir + "/tanh_sinh_" + std::to_string(std::numeric_limits<Real>::radix) +
+         "_" + std::to_string(std::numeric_limits<Real>::digits) + ".txt";
+}
+
+template <typename Real>
+struct registry {
+  typedef tanh_sinh<Real> integrator_type;
+  registry() : file(file_name<Real>()), stored(0) {}
+  ~registry() {
+    if (file.empty()) return;
+    integrator_type const* best = nullptr;
+    for (auto const& p : integrators)
+      if (!best || p.second->levels() > best->levels()) best = p.second.get();
+    if (!best || best->levels() <= stored) return;
+    // written under a unique name and renamed, so that a concurrent reader
+    // sees either the old or the new file
+    std::string tmp = file + ".tmp" + std::to_string(
+        std::chrono::system_clock::now().time_since_epoch().count());
+    try {
+      {
+        std::ofstream os(tmp);
+        best->save(os);
+        if (!os) {
+          std::remove(tmp.c_str());
+          return;
+        }
+      }
+      if (std::rename(tmp.c_str(), file.c_str()) != 0) std::remove(tmp.c_str());
+    } catch (...) {
+      std::remove(tmp.c_str());
+    }
+  }
+  std::mutex mutex;
+  std::map<std::size_t, std::unique_ptr<integrator_type>> integrators;
+  std::string file;
+  std::size_t stored;  // levels in the file
+};
+
+// Returns the integrator for Real shared by the whole process, one per
+// number of refinement levels.  The tables depend only on Real; the error
+// tolerance is an argument of integrate().  The registry is a function-local
+// static guarded by a mutex.
+template <typename Real>
+inline tanh_sinh<Real>& shared(std::size_t max_refinements = 15) {
+  typedef tanh_sinh<Real> integrator_type;
+  static registry<Real> reg;
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  std::unique_ptr<integrator_type>& p = reg.integrators[max_refinements];
+  if (!p) {
+    p.reset(new integrator_type(max_refinements));
+    if (!reg.file.empty()) {
+      std::ifstream is(reg.file);
+      if (is) reg.stored = std::max(reg.stored, p->load(is));
+    }
+  }
+  return *p;
+}
+
+}  // namespace tanh_sinh_cache
+}  // namespace exact
@@ -0,0 +1,86 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <cmath>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+#include <boost/multiprecision/cpp_bin_float.hpp>
+#include <boost/multiprecision/cpp_dec_float.hpp>
+#include "exact/tanh_sinh_cache.hpp"
+
+TEST(TanhSinhCacheTest, Shared) {
+  typedef double real_t;
+  auto* p = &exact::tanh_sinh_cache::shared<real_t>();
+  std::vector<const void*> q(4);
+  std::vector<real_t> v(4);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([&, t]() {
+      auto& integrator = exact::tanh_sinh_cache::shared<real_t>();
+      q[t] = &integrator;
+      v[t] = integrator.integrate(
+          [](real_t x) -> real_t { return std::exp(x); }, real_t(0), real_t(1));
+    });
+  for (auto& t : threads) t.join();
+  for (int t = 0; t < 4; ++t) {
+    EXPECT_EQ(p, q[t]);
+    EXPECT_NEAR(std::exp(real_t(1)) - 1, v[t], 1e-14);
+  }
+  EXPECT_NE(static_cast<const void*>(p),
+            &exact::tanh_sinh_cache::shared<real_t>(10));
+}
+
+TEST(TanhSinhCacheTest, Integrate) {
+  typedef boost::multiprecision::cpp_bin_float_50 real_t;
+  exact::tanh_sinh_cache::tanh_sinh<real_t> integrator;
+  real_t eps = std::numeric_limits<real_t>::epsilon();
+  EXPECT_LT(abs(integrator.integrate([](real_t x) -> real_t { return exp(x); }, real_t(0), real_t(1)) -
+                (exp(real_t(1)) - 1)),
+            10 * eps);
+  // end point singularities
+  EXPECT_LT(abs(integrator.integrate([](real_t x) -> real_t { return 1 / sqrt(x); }, real_t(0), real_t(1)) -
+                2),
+            100 * eps);
+  EXPECT_LT(abs(integrator.integrate([](real_t x) -> real_t { return log(x); }, real_t(0), real_t(1)) + 1),
+            100 * eps);
+}
+
+TEST(TanhSinhCacheTest, SaveLoad) {
+  typedef boost::multiprecision::cpp_dec_float_50 real_t;
+  auto f = [](real_t x) -> real_t { return cos(x) / (1 + x * x); };
+  exact::tanh_sinh_cache::tanh_sinh<real_t> computed;
+  real_t v = computed.integrate(f, real_t(0), real_t(3));
+  std::stringstream image;
+  computed.save(image);
+
+  exact::tanh_sinh_cache::tanh_sinh<real_t> loaded;
+  EXPECT_EQ(computed.levels(), loaded.load(image));
+  EXPECT_EQ(computed.levels(), loaded.levels());
+  EXPECT_EQ(v, loaded.integrate(f, real_t(0), real_t(3)));
+  EXPECT_EQ(computed.levels(), loaded.levels());
+
+  // fewer levels than the image holds, and a type of another radix
+  exact::tanh_sinh_cache::tanh_sinh<real_t> small(2);
+  image.seekg(0);
+  EXPECT_EQ(computed.levels(), small.load(image));
+  EXPECT_EQ(3u, small.levels());
+  exact::tanh_sinh_cache::tanh_sinh<boost::multiprecision::cpp_bin_float_50> other;
+  image.seekg(0);
+  EXPECT_EQ(0u, other.load(image));
+  EXPECT_EQ(0u, other.levels());
+}
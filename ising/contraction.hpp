@@ -0,0 +1,293 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Calculating free energy of Ising model on arbitrary lattice by contracting
+// the network of Boltzmann-weight tensors
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <set>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <boost/math/differentiation/autodiff.hpp>
+#include "exact/parallel.hpp"
+
+namespace ising {
+
+struct contraction {
+public:
+  // Order in which the sites are summed over, and the largest number of sites
+  // an intermediate tensor depends on (the induced width of the order).  The
+  // cost of the contraction is O(N 2^width) and its memory O(2^width).
+  struct plan {
+    std::vector<std::size_t> order;
+    std::size_t width;
+  };
+
+  // upper limit in bytes of the largest intermediate tensor
+  static std::size_t& memory_budget() {
+    static std::size_t budget = std::size_t(1) << 30;
+    return budget;
+  }
+
+  // Greedy elimination order: the site with the fewest neighbors in the
+  // interaction graph is summed over first, ties broken by the number of
+  // edges its elimination adds among its neighbors (min-degree, min-fill)
+  template<typename LATTICE>
+  static plan make_plan(LATTICE const& lat) {
+    std::size_t n = lat.num_sites();
+    std::vector<std::set<std::size_t>> adj(n);
+    for (std::size_t b = 0; b < lat.num_bonds(); ++b) {
+      std::size_t i = lat.source(b), j = lat.target(b);
+      if (i == j) continue;
+      adj[i].insert(j);
+      adj[j].insert(i);
+    }
+    plan p;
+    p.width = 0;
+    std::vector<bool> done(n, false);
+    for (std::size_t step = 0; step < n; ++step) {
+      std::size_t best = n, best_deg = 0, best_fill = 0;
+      for (std::size_t v = 0; v < n; ++v) {
+        if (done[v] || (best < n && adj[v].size() > best_deg)) continue;
+        std::size_t fill = 0;
+        for (auto i : adj[v])
+          for (auto j : adj[v])
+            if (i < j && adj[i].count(j) == 0) ++fill;
+        if (best == n || adj[v].size() < best_deg || fill < best_fill) {
+          best = v;
+          best_deg = adj[v].size();
+          best_fill = fill;
+        }
+      }
+      for (auto i : adj[best]) {
+        adj[i].erase(best);
+        for (auto j : adj[best])
+          if (i != j) adj[i].insert(j);
+      }
+      adj[best].clear();
+      done[best] = true;
+      p.order.push_back(best);
+      p.width = std::max(p.width, best_deg);
+    }
+    return p;
+  }
+
+  // log Z of the weights exp(beta (sum_b J_b s_i s_j + sum_s h_s s_s) + h M)
+  // with M = sum_s s_s.  beta and h may be a multiprecision type or carry
+  // derivatives (autodiff fvar).  Every bond and every field is a tensor of
+  // the sites it acts on; summing over a site multiplies the tensors that
+  // depend on it into one over their other sites.  The tensors are kept
+  // normalized to a largest entry of one, with the logarithms of the
+  // factors taken out accumulated separately, so that log Z does not
+  // overflow for any size or temperature.
+  template<typename U, typename LATTICE>
+  static U log_partition_function(U const& beta, LATTICE const& lat,
+                                  std::vector<double> const& inter,
+                                  std::vector<double> const& field = std::vector<double>(0),
+                                  U const& h = U(0)) {
+    return log_partition_function(beta, lat, inter, field, h, make_plan(lat));
+  }
+
+  template<typename U, typename LATTICE>
+  static U log_partition_function(U const& beta, LATTICE const& lat,
+                                  std::vector<double> const& inter,
+                                  std::vector<double> const& field, U const& h,
+                                  plan const& p) {
+    using std::abs; using std::exp; using std::log;
+    if (inter.size() != lat.num_bonds())
+      throw(std::invalid_argument("inconsitent table size of interaction"));
+    if (field.size() > 0 && field.size() != lat.num_sites())
+      throw(std::invalid_argument("inconsitent table size of external field"));
+    if (p.order.size() != lat.num_sites())
+      throw(std::invalid_argument("inconsitent contraction plan"));
+    if (p.width >= std::numeric_limits<std::size_t>::digits ||
+        (std::size_t(1) << p.width) > memory_budget() / sizeof(U))
+      throw(std::invalid_argument("contraction exceeds memory budget"));
+    U logz = U(0);
+    std::vector<tensor<U>> ts;
+    for (std::size_t b = 0; b < lat.num_bonds(); ++b) {
+      std::size_t i = lat.source(b), j = lat.target(b);
+      U k = beta * inter[b];
+      if (i == j) {
+        logz += k;
+        continue;
+      }
+      U m = abs(k);
+      tensor<U> t;
+      t.sites = {std::min(i, j), std::max(i, j)};
+      t.value = {exp(k - m), exp(-k - m), exp(-k - m), exp(k - m)};
+      t.logscale = m;
+      ts.push_back(t);
+    }
+    for (std::size_t s = 0; s < lat.num_sites(); ++s) {
+      U a = h + beta * (field.size() ? field[s] : 0.0);
+      U m = abs(a);
+      tensor<U> t;
+      t.sites = {s};
+      t.value = {exp(a - m), exp(-a - m)};
+      t.logscale = m;
+      ts.push_back(t);
+    }
+    for (auto v : p.order) {
+      std::vector<tensor<U>> rest, with;
+      for (auto& t : ts)
+        (std::binary_search(t.sites.begin(), t.sites.end(), v) ? with : rest)
+            .push_back(std::move(t));
+      rest.push_back(sum_over(with, v));
+      std::swap(ts, rest);
+    }
+    U z = U(1);
+    for (auto const& t : ts) {
+      logz += t.logscale;
+      z *= t.value[0];
+    }
+    return logz + log(z);
+  }
+
+  template<typename T, typename LATTICE>
+  static T free_energy(T const& beta, LATTICE const& lat, std::vector<double> const& inter,
+                       std::vector<double> const& field = std::vector<double>(0)) {
+    if (!(beta > 0))
+      throw(std::invalid_argument("beta should be positive"));
+    return -log_partition_function(beta, lat, inter, field) / beta;
+  }
+
+  template<typename T, typename LATTICE>
+  static T free_energy_density(T const& beta, LATTICE const& lat, std::vector<double> const& inter,
+                               std::vector<double> const& field = std::vector<double>(0)) {
+    return free_energy(beta, lat, inter, field) / lat.num_sites();
+  }
+
+  // free energy, energy, and specific heat per site
+  template<typename T, typename LATTICE>
+  static std::tuple<T, T, T> thermodynamics(T const& beta, LATTICE const& lat,
+                                            std::vector<double> const& inter,
+                                            std::vector<double> const& field = std::vector<double>(0)) {
+    using namespace boost::math::differentiation;
+    if (!(beta > 0))
+      throw(std::invalid_argument("beta should be positive"));
+    auto b = make_fvar<T, 2>(beta);
+    auto logz = log_partition_function(b, lat, inter, field, decltype(b)(0));
+    T n = T(lat.num_sites());
+    return std::make_tuple(-logz.derivative(0) / beta / n, -logz.derivative(1) / n,
+                           beta * beta * logz.derivative(2) / n);
+  }
+
+  // <M>, <M^2>, <M^3>, <M^4> as derivatives of Z(h) / Z(0) at h = 0
+  template<typename T, typename LATTICE>
+  static std::tuple<T, T, T, T> magnetization(T const& beta, LATTICE const& lat,
+                                              std::vector<double> const& inter,
+                                              std::vector<double> const& field = std::vector<double>(0)) {
+    using namespace boost::math::differentiation;
+    using std::exp;
+    if (!(beta > 0))
+      throw(std::invalid_argument("beta should be positive"));
+    auto h = make_fvar<T, 4>(T(0));
+    auto logz = log_partition_function(decltype(h)(beta), lat, inter, field, h);
+    auto z = exp(logz - logz.derivative(0));
+    return std::make_tuple(z.derivative(1), z.derivative(2), z.derivative(3), z.derivative(4));
+  }
+
+private:
+  // value[c] for the states c of sites (ascending), bit k of c being 1 for
+  // s = -1 at sites[k], times exp(logscale)
+  template<typename U>
+  struct tensor {
+    std::vector<std::size_t> sites;
+    std::vector<U> value;
+    U logscale;
+  };
+
+  // Sums the product of the tensors ts over the state of site v.  The states
+  // of the result are split into blocks of 2^block_bits over its lowest
+  // sites; within a block the entry of each tensor is a fixed base plus an
+  // offset from a table shared by all blocks.  Blocks run in parallel.
+  template<typename U>
+  static tensor<U> sum_over(std::vector<tensor<U>> const& ts, std::size_t v) {
+    using std::abs; using std::log;
+    const std::size_t block_bits = 8;
+    tensor<U> res;
+    res.logscale = U(0);
+    for (auto const& t : ts) {
+      res.logscale += t.logscale;
+      for (auto s : t.sites)
+        if (s != v) res.sites.push_back(s);
+    }
+    std::sort(res.sites.begin(), res.sites.end());
+    res.sites.erase(std::unique(res.sites.begin(), res.sites.end()), res.sites.end());
+    std::size_t w = res.sites.size(), bits = std::min(w, block_bits);
+    std::size_t nt = ts.size(), dim = std::size_t(1) << w, bdim = std::size_t(1) << bits;
+    // strides[i][k]: offset in tensor i of state bit k of the result
+    std::vector<std::vector<std::size_t>> strides(nt, std::vector<std::size_t>(w, 0));
+    std::vector<std::size_t> vstride(nt, 0);
+    for (std::size_t i = 0; i < nt; ++i)
+      for (std::size_t j = 0; j < ts[i].sites.size(); ++j) {
+        if (ts[i].sites[j] == v) {
+          vstride[i] = std::size_t(1) << j;
+        } else {
+          std::size_t k = std::lower_bound(res.sites.begin(), res.sites.end(), ts[i].sites[j]) -
+                          res.sites.begin();
+          strides[i][k] = std::size_t(1) << j;
+        }
+      }
+    std::vector<std::vector<std::size_t>> offset(nt, std::vector<std::size_t>(bdim, 0));
+    for (std::size_t i = 0; i < nt; ++i)
+      for (std::size_t l = 1; l < bdim; ++l) {
+        std::size_t k = 0;
+        while (((l >> k) & 1) == 0) ++k;
+        offset[i][l] = offset[i][l & (l - 1)] + strides[i][k];
+      }
+    res.value.assign(dim, U(0));
+    std::size_t nblocks = dim / bdim;
+    auto block = [&](std::size_t hb) {
+      std::vector<std::size_t> base(nt, 0);
+      for (std::size_t i = 0; i < nt; ++i)
+        for (std::size_t k = bits; k < w; ++k)
+          if ((hb >> (k - bits)) & 1) base[i] += strides[i][k];
+      std::vector<U> tmp(bdim);
+      U* r = &res.value[hb * bdim];
+      for (std::size_t c = 0; c < 2; ++c) {
+        for (std::size_t l = 0; l < bdim; ++l) tmp[l] = U(1);
+        for (std::size_t i = 0; i < nt; ++i) {
+          U const* t = &ts[i].value[base[i] + c * vstride[i]];
+          std::size_t const* off = &offset[i][0];
+          for (std::size_t l = 0; l < bdim; ++l) tmp[l] *= t[off[l]];
+        }
+        for (std::size_t l = 0; l < bdim; ++l) r[l] += tmp[l];
+      }
+    };
+    if (nblocks > 1)
+      exact::parallel::for_each(nblocks, block);
+    else
+      block(0);
+    std::size_t imax = 0;
+    for (std::size_t c = 1; c < dim; ++c)
+      if (abs(res.value[c]) > abs(res.value[imax])) imax = c;
+    U m = abs(res.value[imax]);
+    for (auto& x : res.value) x /= m;
+    res.logscale += log(m);
+    return res;
+  }
+};
+
+} // end namespace ising
@@ -16,10 +16,18 @@
 
 // Calculating free energy density of Ising model by exact counting
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
 #include <stdexcept>
 #include <tuple>
+#include <utility>
 #include <vector>
-#include <standards/exp_number.hpp>
+#include "exact/log_sum_exp.hpp"
+#include "exact/parallel.hpp"
+#include "ising/counting_kernel.hpp"
 
 #ifndef ISING_COUNTING_HPP
 #define ISING_COUNTING_HPP
@@ -28,33 +36,483 @@ namespace ising {
 
 struct counting {
 public:
+  // Histogram of all states in (E, M), where E = sum_b k_b s_i s_j for integer
+  // couplings k_b and M = sum_i s_i.  The states are visited in Gray-code
+  // order; flipping site s changes the energy by the number of its unsatisfied
+  // bonds, a popcount of the state word XORed with the spin of s and masked by
+  // the neighbors of s, one mask per distinct coupling.  Any temperature,
+  // coupling unit J, and uniform field H is then a reweighting of the
+  // histogram.  For translation-invariant couplings on a periodic Lx x Ly
+  // lattice (Lx, Ly >= 3), only one representative of each orbit under
+  // translations and global spin flip is visited (see enumerate_orbits).
+  // Other square lattices from 2 x 2 to 6 x 6 with uniform couplings along x
+  // and y, periodic or open, are walked by counting_kernel.
+  class histogram {
+  public:
+    // With with_pairs = true, the histogram also counts, for each displacement r,
+    // the pairs (i, i + r) of opposite spins (see pair_correlation); this
+    // needs the translation-invariant case.
+    template<typename LATTICE>
+    histogram(LATTICE const& lat, std::vector<int> const& k, bool with_pairs = false)
+      : num_sites_(lat.num_sites()), length_x_(0), length_y_(0) {
+      if (lat.num_sites() > max_sites)
+        throw(std::invalid_argument("too large lattice"));
+      if (k.size() != lat.num_bonds())
+        throw(std::invalid_argument("inconsitent table size of interaction"));
+      int kx, ky;
+      unsigned Lx, Ly;
+      if ((use_symmetry() || with_pairs) && square_symmetry(lat, k, Lx, Ly, kx, ky)) {
+        length_x_ = Lx;
+        length_y_ = Ly;
+        enumerate_orbits(Lx, Ly, kx, ky, with_pairs);
+        return;
+      }
+      if (with_pairs)
+        throw(std::invalid_argument("pair counts need a translation-invariant lattice"));
+      boundary bc;
+      if (use_kernels() && square_grid(lat, k, Lx, Ly, bc, kx, ky)) {
+        enumerate_grid(Lx, Ly, bc, kx, ky);
+        return;
+      }
+      // merge multiple bonds between the same pair of sites; self loops are constant
+      int e = 0;
+      std::map<std::pair<unsigned, unsigned>, int> pairs;
+      for (unsigned int b = 0; b < lat.num_bonds(); ++b) {
+        unsigned i = lat.source(b), j = lat.target(b);
+        if (i == j)
+          e += k[b];
+        else
+          pairs[std::make_pair(std::min(i, j), std::max(i, j))] += k[b];
+      }
+      // masks[c][s]: neighbors of site s connected with coupling kc[c]
+      std::vector<int> kc;
+      std::vector<std::vector<std::uint64_t>> masks;
+      int emax = std::abs(e);
+      for (auto const& p : pairs) {
+        if (p.second == 0) continue;
+        std::size_t c = 0;
+        while (c < kc.size() && kc[c] != p.second) ++c;
+        if (c == kc.size()) {
+          kc.push_back(p.second);
+          masks.push_back(std::vector<std::uint64_t>(num_sites_, 0));
+        }
+        masks[c][p.first.first] |= std::uint64_t(1) << p.first.second;
+        masks[c][p.first.second] |= std::uint64_t(1) << p.first.first;
+        e += p.second;  // all spins up
+        emax += std::abs(p.second);
+      }
+      emin_ = -emax;
+      std::size_t dim = num_sites_ + 1;
+      count_.assign((2 * emax + 1) * dim, 0);
+      std::uint64_t num_states = std::uint64_t(1) << num_sites_;
+      std::uint64_t c = 0;
+      int up = num_sites_;
+      ++count_[(e - emin_) * dim + (num_sites_ - up)];
+      for (std::uint64_t i = 1; i < num_states; ++i) {
+        unsigned s = trailing_zeros(i);
+        std::uint64_t spin = std::uint64_t(0) - ((c >> s) & 1);
+        for (std::size_t cl = 0; cl < kc.size(); ++cl) {
+          int unsat = popcount((c ^ spin) & masks[cl][s]);
+          e -= 2 * kc[cl] * (popcount(masks[cl][s]) - 2 * unsat);
+        }
+        up += spin ? 1 : -1;
+        c ^= std::uint64_t(1) << s;
+        ++count_[(e - emin_) * dim + (num_sites_ - up)];
+      }
+    }
+    double free_energy(double beta, double J, double H = 0.0) const {
+      return -log(moment(beta, J, H, 0)) / beta;
+    }
+    // <M^n> for n > 0
+    double magnetization(double beta, double J, double H, unsigned n) const {
+      return moment(beta, J, H, n) / moment(beta, J, H, 0);
+    }
+    // sum over states of M^n exp(beta (J E + H M))
+    exact::log_sum_exp<double> moment(double beta, double J, double H, unsigned n) const {
+      std::size_t dim = num_sites_ + 1;
+      exact::log_sum_exp<double> sum;
+      for (std::size_t i = 0; i < count_.size(); ++i) {
+        if (count_[i] == 0) continue;
+        double e = emin_ + int(i / dim);
+        double m = double(num_sites_) - 2 * double(i % dim);  // i % dim: down spins
+        sum.add(beta * (J * e + H * m), double(count_[i]) * std::pow(m, double(n)));
+      }
+      return sum;
+    }
+    // <E M^n>, where E = -J e is the interaction energy
+    double energy_magnetization(double beta, double J, double H, unsigned n) const {
+      return average(beta, J, H, [&](double e, double m, std::size_t) {
+        return -J * e * std::pow(m, double(n));
+      });
+    }
+    // <s_i s_{i+r}> for the displacements r = a + Lx b, (a, b) in [0, Lx) x
+    // [0, Ly)
+    std::vector<double> pair_correlation(double beta, double J, double H) const {
+      if (pairs_.empty())
+        throw(std::invalid_argument("histogram without pair counts"));
+      std::size_t n = num_sites_;
+      std::vector<double> corr(n);
+      for (std::size_t r = 0; r < n; ++r)
+        corr[r] = 1 - 2 * average(beta, J, H, [&](double, double, std::size_t i) {
+          return double(pairs_[i * n + r]) / double(count_[i]) / n;
+        });
+      return corr;
+    }
+    // linear sizes of the translation-invariant case, 0 otherwise
+    unsigned length_x() const { return length_x_; }
+    unsigned length_y() const { return length_y_; }
+    static const unsigned max_sites = 40;
+
+    // Whether the histogram enumerates the orbits of translation-invariant
+    // lattices; otherwise all lattices take the Gray-code walk
+    static bool& use_symmetry() {
+      static bool flag = true;
+      return flag;
+    }
+
+    // Whether the histogram of the lattices recognized by square_grid is
+    // counted by counting_kernel; otherwise they take the generic walk
+    static bool& use_kernels() {
+      static bool flag = true;
+      return flag;
+    }
+
+    // true if the sites are numbered x + Lx y on a periodic Lx x Ly lattice
+    // (Lx, Ly >= 3) and the couplings are kx on all x bonds and ky on all y
+    // bonds
+    template<typename LATTICE>
+    static bool square_symmetry(LATTICE const& lat, std::vector<int> const& k, unsigned& Lx,
+                                unsigned& Ly, int& kx, int& ky) {
+      unsigned n = lat.num_sites();
+      if (lat.num_bonds() != 2 * n) return false;
+      for (Lx = 3; Lx <= n / 3; ++Lx) {
+        if (n % Lx) continue;
+        Ly = n / Lx;
+        if (square_bonds(lat, k, Lx, Ly, true, kx, ky)) return true;
+      }
+      return false;
+    }
+
+    // true if the sites are numbered x + Lx y on an Lx x Ly lattice
+    // (2 <= Lx, Ly <= 6) with periodic or open boundaries bc, and the
+    // couplings are kx on all x bonds and ky on all y bonds
+    template<typename LATTICE>
+    static bool square_grid(LATTICE const& lat, std::vector<int> const& k, unsigned& Lx,
+                            unsigned& Ly, boundary& bc, int& kx, int& ky) {
+      unsigned n = lat.num_sites();
+      for (Lx = 2; Lx <= 6; ++Lx) {
+        if (n % Lx || n / Lx < 2 || n / Lx > 6) continue;
+        Ly = n / Lx;
+        if (lat.num_bonds() == 2 * n && square_bonds(lat, k, Lx, Ly, true, kx, ky)) {
+          bc = boundary::periodic;
+          return true;
+        }
+        if (lat.num_bonds() == 2 * n - Lx - Ly && square_bonds(lat, k, Lx, Ly, false, kx, ky)) {
+          bc = boundary::open;
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+    template<typename LATTICE>
+    static bool square_bonds(LATTICE const& lat, std::vector<int> const& k, unsigned Lx,
+                             unsigned Ly, bool periodic, int& kx, int& ky) {
+      unsigned n = Lx * Ly;
+      // x bond from s to tx(s) and y bond from s to ty(s); with open
+      // boundaries, none leaves the last column or row
+      auto hx = [Lx, periodic](unsigned s) { return periodic || s % Lx + 1 < Lx; };
+      auto hy = [Lx, Ly, periodic](unsigned s) { return periodic || s / Lx + 1 < Ly; };
+      auto tx = [Lx](unsigned s) { return (s / Lx) * Lx + (s + 1) % Lx; };
+      auto ty = [n, Lx](unsigned s) { return (s + Lx) % n; };
+      std::vector<int> nx(n, 0), ny(n, 0);
+      std::size_t bx = lat.num_bonds(), by = lat.num_bonds();
+      for (unsigned int b = 0; b < lat.num_bonds(); ++b) {
+        unsigned i = lat.source(b), j = lat.target(b);
+        if ((j == tx(i) && hx(i)) || (i == tx(j) && hx(j))) {
+          ++nx[(j == tx(i) && hx(i)) ? i : j];
+          if (bx == lat.num_bonds()) bx = b;
+          if (k[b] != k[bx]) return false;
+        } else if ((j == ty(i) && hy(i)) || (i == ty(j) && hy(j))) {
+          ++ny[(j == ty(i) && hy(i)) ? i : j];
+          if (by == lat.num_bonds()) by = b;
+          if (k[b] != k[by]) return false;
+        } else {
+          return false;
+        }
+      }
+      for (unsigned s = 0; s < n; ++s)
+        if (nx[s] != int(hx(s)) || ny[s] != int(hy(s))) return false;
+      if (bx == lat.num_bonds() || by == lat.num_bonds()) return false;
+      kx = k[bx];
+      ky = k[by];
+      return true;
+    }
+
+    // Gray-code walk of a lattice recognized by square_grid with
+    // counting_kernel, into the same (e, down) layout as the generic walk
+    void enumerate_grid(unsigned Lx, unsigned Ly, boundary bc, int kx, int ky) {
+      std::int64_t nbx = 0, nby = 0;  // bonds, counted per site
+      for (unsigned s = 0; s < num_sites_; ++s) {
+        unsigned x = s % Lx, y = s / Lx;
+        nbx += (bc == boundary::periodic || x + 1 < Lx);
+        nby += (bc == boundary::periodic || y + 1 < Ly);
+      }
+      int emax = std::abs(kx) * nbx + std::abs(ky) * nby;
+      emin_ = -emax;
+      std::int64_t dim = num_sites_ + 1;
+      count_.assign((2 * emax + 1) * dim, 0);
+      // e = kx (nbx - 2 ux) + ky (nby - 2 uy)
+      counting_layout layout = {(kx * nbx + ky * nby - emin_) * dim, -2 * kx * dim,
+                                -2 * ky * dim, 1};
+      counting_dispatch<1>::find(Lx, Ly, bc)(0, std::uint64_t(1) << num_sites_, layout,
+                                             count_.data());
+    }
+
+    // average over states of f(e, m, i) with weights exp(beta (J e + H m)),
+    // i being the index of the class (e, m)
+    template<typename F>
+    double average(double beta, double J, double H, F f) const {
+      std::size_t dim = num_sites_ + 1;
+      exact::log_sum_exp<double> z, sum;
+      for (std::size_t i = 0; i < count_.size(); ++i) {
+        if (count_[i] == 0) continue;
+        double e = emin_ + int(i / dim);
+        double m = double(num_sites_) - 2 * double(i % dim);
+        z.add(beta * (J * e + H * m), double(count_[i]));
+        sum.add(beta * (J * e + H * m), double(count_[i]) * f(e, m, i));
+      }
+      return sum / z;
+    }
+
+    // Visits the states that are smallest in their orbit under the 2 Lx Ly
+    // translations and spin flips, each with the size of its orbit.  Rows
+    // are Lx-bit words with row Ly - 1 most significant, and the states are
+    // built row by row from the top.  A representative's top row is the
+    // smallest value that any of its rows takes under rotations and flip, so
+    // only rows not below it are placed underneath.  Once k rows are placed,
+    // the images that bring row Ly - 1 - b (b < k) to the top have their top
+    // k - b rows fixed.
+    // An image whose fixed rows are smaller than those of the state cuts the
+    // branch, one whose rows are larger can be forgotten, and only the images
+    // that are still tied are carried to the next row.  The subtrees of the
+    // first two rows run in parallel.  The number of opposite pairs at
+    // displacement r, popcount(c ^ T_r c), is the same for all states of an
+    // orbit.
+    void enumerate_orbits(unsigned Lx, unsigned Ly, int kx, int ky, bool pairs) {
+      unsigned n = Lx * Ly;
+      std::uint64_t rmask = (std::uint64_t(1) << Lx) - 1;
+      std::uint64_t full = (n == 64) ? ~std::uint64_t(0) : (std::uint64_t(1) << n) - 1;
+      // low[a]: the columns x < a
+      std::vector<std::uint64_t> low(Lx + 1, 0);
+      for (unsigned a = 1; a <= Lx; ++a) {
+        low[a] = low[a - 1];
+        for (unsigned y = 0; y < Ly; ++y) low[a] |= std::uint64_t(1) << (a - 1 + Lx * y);
+      }
+      // image of c translated by (a, b) and flipped for f = 1, the image
+      // being coded as (b Lx + a) 2 + f
+      struct transform { unsigned a, b; std::uint64_t flip; };
+      std::vector<transform> tr(2 * n);
+      for (unsigned code = 0; code < 2 * n; ++code)
+        tr[code] = transform{(code >> 1) % Lx, (code >> 1) / Lx, (code & 1) ? full : 0};
+      auto image = [&](std::uint64_t c, unsigned code) {
+        transform const& t = tr[code];
+        if (t.b > 0) c = ((c << (Lx * t.b)) | (c >> (n - Lx * t.b))) & full;
+        if (t.a > 0) c = ((c << t.a) & ~low[t.a] & full) | ((c >> (Lx - t.a)) & low[t.a]);
+        return c ^ t.flip;
+      };
+      // head[k]: the top k rows
+      std::vector<std::uint64_t> head(Ly + 1, full);
+      for (unsigned k = 1; k < Ly; ++k) head[k] = full & ~((std::uint64_t(1) << (Lx * (Ly - k))) - 1);
+      std::vector<std::uint64_t> rmin(rmask + 1);
+      for (std::uint64_t r = 0; r <= rmask; ++r) {
+        std::uint64_t m = r, t = r;
+        for (unsigned a = 0; a < Lx; ++a) {
+          m = std::min(m, std::min(t, t ^ rmask));
+          t = ((t << 1) | (t >> (Lx - 1))) & rmask;
+        }
+        rmin[r] = m;
+      }
+      emin_ = -(std::abs(kx) + std::abs(ky)) * int(n);
+      std::size_t dim = n + 1;
+      count_.assign((2 * (std::abs(kx) + std::abs(ky)) * n + 1) * dim, 0);
+      if (pairs) pairs_.assign(count_.size() * n, 0);
+
+      // adds the orbit of the representative c with stab translations
+      // leaving it invariant
+      auto record = [&](std::uint64_t c, unsigned stab, bool self_flip,
+                        std::vector<std::uint64_t>& count, std::vector<std::uint64_t>& pair) {
+        int e = kx * (int(n) - 2 * popcount(c ^ image(c, 2))) +
+                ky * (int(n) - 2 * popcount(c ^ image(c, 2 * Lx)));
+        std::size_t i = (e - emin_) * dim;
+        int down = popcount(c);
+        count[i + down] += n / stab;
+        if (!self_flip) count[i + n - down] += n / stab;
+        if (pairs) {
+          std::uint64_t* p = &pair[(i + down) * n];
+          std::uint64_t* q = &pair[(i + n - down) * n];
+          for (unsigned r = 0; r < n; ++r) {
+            std::uint64_t np = (n / stab) * popcount(c ^ image(c, 2 * r));
+            p[r] += np;
+            if (!self_flip) q[r] += np;
+          }
+        }
+      };
+      // Places row Ly - 1 - k of c, whose value is row, and updates the
+      // images tied with c in the rows above (tied[k]) to those tied in the
+      // rows down to this one (tied[k + 1]).  The images that bring this row
+      // to the top start with row, rotated and flipped, which is never
+      // smaller than the top row and equals it only if rmin[row] is the top
+      // row.
+      // false if an image is smaller than c.
+      auto place = [&](std::uint64_t c, unsigned k, std::uint64_t row,
+                       std::vector<std::vector<unsigned>>& tied) {
+        std::vector<unsigned>& next = tied[k + 1];
+        next.clear();
+        auto compare = [&](unsigned code) {
+          std::uint64_t m = head[k + 1 - tr[code].b];
+          std::uint64_t e = image(c, code) & m, cm = c & m;
+          if (e < cm) return false;
+          if (e == cm) next.push_back(code);
+          return true;
+        };
+        for (unsigned code : tied[k])
+          if (!compare(code)) return false;
+        if (rmin[row] == (c >> (Lx * (Ly - 1))))
+          for (unsigned code = 2 * Lx * k; code < 2 * Lx * (k + 1); ++code)
+            if (code > 0 && !compare(code)) return false;
+        return true;
+      };
+
+      // tasks: the top row and the row below it
+      std::vector<std::vector<std::uint64_t>> rows(rmask + 1);
+      std::vector<std::pair<std::uint64_t, std::size_t>> tasks;
+      for (std::uint64_t top = 0; top <= rmask; ++top) {
+        if (rmin[top] != top) continue;
+        for (std::uint64_t r = 0; r <= rmask; ++r)
+          if (rmin[r] >= top) rows[top].push_back(r);
+        for (std::size_t j = 0; j < rows[top].size(); ++j) tasks.push_back(std::make_pair(top, j));
+      }
+      std::mutex mutex;
+      exact::parallel::for_each(tasks.size(), [&](std::size_t t) {
+        std::vector<std::uint64_t> const& cand = rows[tasks[t].first];
+        std::vector<std::uint64_t> count(count_.size(), 0), pair(pairs_.size(), 0);
+        std::vector<std::vector<unsigned>> tied(Ly + 1);
+        for (auto& v : tied) v.reserve(2 * n);
+        // state[k]: rows above k; idx[k]: candidate for row Ly - 1 - k
+        std::vector<std::uint64_t> state(Ly + 1, 0);
+        std::vector<std::size_t> idx(Ly, 0);
+        state[1] = tasks[t].first << (Lx * (Ly - 1));
+        state[2] = state[1] | (cand[tasks[t].second] << (Lx * (Ly - 2)));
+        if (!place(state[1], 0, tasks[t].first, tied) ||
+            !place(state[2], 1, cand[tasks[t].second], tied))
+          return;
+        unsigned k = 2;
+        while (true) {
+          if (k == Ly) {
+            // images tied in all the rows above their wrap-around
+            std::uint64_t c = state[Ly];
+            unsigned stab = 1;
+            bool self_flip = false, smallest = true;
+            for (unsigned code : tied[Ly]) {
+              std::uint64_t e = image(c, code);
+              if (e < c) { smallest = false; break; }
+              if (e == c) {
+                if (code & 1) self_flip = true;
+                else ++stab;
+              }
+            }
+            if (smallest) record(c, stab, self_flip, count, pair);
+            ++idx[--k];
+            continue;
+          }
+          if (idx[k] == cand.size()) {
+            idx[k] = 0;
+            if (k == 2) break;
+            ++idx[--k];
+            continue;
+          }
+          std::uint64_t c = state[k] | (cand[idx[k]] << (Lx * (Ly - 1 - k)));
+          if (place(c, k, cand[idx[k]], tied)) {
+            state[++k] = c;
+          } else {
+            ++idx[k];
+          }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::size_t i = 0; i < count.size(); ++i) {
+          if (count[i] == 0) continue;
+          count_[i] += count[i];
+          if (pairs)
+            for (unsigned r = 0; r < n; ++r) pairs_[i * n + r] += pair[i * n + r];
+        }
+      });
+    }
+
+    unsigned num_sites_;
+    unsigned length_x_, length_y_;
+    int emin_;
+    std::vector<std::uint64_t> count_;
+    std::vector<std::uint64_t> pairs_;  // [class][r]
+  };
+
+  // Integer couplings k_b with inter[b] = unit * k_b, if any, and uniform
+  // field, for the histogram path
+  template<typename LATTICE>
+  static bool integer_couplings(LATTICE const& lat, std::vector<double> const& inter,
+                                std::vector<double> const& field, std::vector<int>& k,
+                                double& unit, double& H) {
+    const int kmax = 64;
+    unit = 0;
+    for (auto J : inter)
+      if (J != 0) { unit = std::abs(J); break; }
+    if (unit == 0) unit = 1;
+    k.resize(inter.size());
+    for (std::size_t b = 0; b < inter.size(); ++b) {
+      double r = inter[b] / unit;
+      if (std::abs(r) > kmax || r != std::round(r)) return false;
+      k[b] = int(std::round(r));
+    }
+    H = field.size() ? field[0] : 0.0;
+    for (auto h : field)
+      if (h != H) return false;
+    return lat.num_sites() <= histogram::max_sites;
+  }
+
   template<typename LATTICE>
   static double free_energy(double beta, LATTICE const& lat, std::vector<double> const& inter,
                             std::vector<double> const& field = std::vector<double>(0)) {
     if (beta <= 0)
       throw(std::invalid_argument("beta should be positive"));
-    if (lat.num_sites() > 30)
+    if (lat.num_sites() > histogram::max_sites)
       throw(std::invalid_argument("too large lattice"));
     if (inter.size() != lat.num_bonds())
       throw(std::invalid_argument("inconsitent table size of interaction"));
     if (field.size() > 0 && field.size() != lat.num_sites())
       throw(std::invalid_argument("inconsitent table size of external field"));
+    std::vector<int> k;
+    double unit, H;
+    if (integer_couplings(lat, inter, field, k, unit, H))
+      return histogram(lat, k).free_energy(beta, unit, H);
+    if (lat.num_sites() > 30)
+      throw(std::invalid_argument("too large lattice"));
     unsigned long num_states = 1 << lat.num_sites();
-    standards::exp_double sum = 0;
+    exact::log_sum_exp<double> sum;
     for (unsigned long c = 0; c < num_states; ++c) {
-      standards::exp_double weight = 1;
+      double weight = 0;  // logarithm
       for (unsigned int b = 0; b < lat.num_bonds(); ++b) {
         int ci = (c >> lat.source(b)) & 1;
         int cj = (c >> lat.target(b)) & 1;
-        weight *= standards::exp_number<double>(beta * inter[b] * (1 - 2 * (ci ^ cj)));
+        weight += beta * inter[b] * (1 - 2 * (ci ^ cj));
       }
       if (field.size()) {
         for (unsigned int s = 0; s < lat.num_sites(); ++s) {
           int c0 = (c >> s) & 1;
-          weight *= standards::exp_number<double>(beta * field[s] * (1 - 2 * c0));
+          weight += beta * field[s] * (1 - 2 * c0);
         }
       }
-      sum += weight;
+      sum.add(weight);
     }
     return -log(sum) / beta;
   }
@@ -65,44 +523,190 @@ public:
                  std::vector<double> const& field = std::vector<double>(0)) {
     if (beta <= 0)
       throw(std::invalid_argument("beta should be positive"));
-    if (lat.num_sites() > 30)
+    if (lat.num_sites() > histogram::max_sites)
       throw(std::invalid_argument("too large lattice"));
     if (inter.size() != lat.num_bonds())
       throw(std::invalid_argument("inconsitent table size of interaction"));
     if (field.size() > 0 && field.size() != lat.num_sites())
       throw(std::invalid_argument("inconsitent table size of external field"));
+    std::vector<int> k;
+    double unit, H;
+    if (integer_couplings(lat, inter, field, k, unit, H)) {
+      histogram hist(lat, k);
+      return std::make_tuple(hist.magnetization(beta, unit, H, 1), hist.magnetization(beta, unit, H, 2),
+                             hist.magnetization(beta, unit, H, 3), hist.magnetization(beta, unit, H, 4));
+    }
+    if (lat.num_sites() > 30)
+      throw(std::invalid_argument("too large lattice"));
     unsigned long num_states = 1 << lat.num_sites();
-    standards::exp_double sum = 0;
-    standards::exp_double sum_m1 = 0;
-    standards::exp_double sum_m2 = 0;
-    standards::exp_double sum_m3 = 0;
-    standards::exp_double sum_m4 = 0;
+    exact::log_sum_exp<double> sum, sum_m1, sum_m2, sum_m3, sum_m4;
     for (unsigned long c = 0; c < num_states; ++c) {
       double m = 0;
       for (unsigned int s = 0; s < lat.num_sites(); ++s) {
         m += 1.0- 2 * ((c >> s) & 1);
       }
-      standards::exp_double weight = 1;
+      double weight = 0;  // logarithm
       for (unsigned int b = 0; b < lat.num_bonds(); ++b) {
         int ci = (c >> lat.source(b)) & 1;
         int cj = (c >> lat.target(b)) & 1;
-        weight *= standards::exp_number<double>(beta * inter[b] * (1 - 2 * (ci ^ cj)));
+        weight += beta * inter[b] * (1 - 2 * (ci ^ cj));
       }
       if (field.size()) {
         for (unsigned int s = 0; s < lat.num_sites(); ++s) {
           int c0 = (c >> s) & 1;
-          weight *= standards::exp_number<double>(beta * field[s] * (1 - 2 * c0));
+          weight += beta * field[s] * (1 - 2 * c0);
         }
       }
-      sum += weight;
-      sum_m1 += std::pow(m, 1.0) * weight;
-      sum_m2 += std::pow(m, 2.0) * weight;
-      sum_m3 += std::pow(m, 3.0) * weight;
-      sum_m4 += std::pow(m, 4.0) * weight;
+      sum.add(weight);
+      sum_m1.add(weight, std::pow(m, 1.0));
+      sum_m2.add(weight, std::pow(m, 2.0));
+      sum_m3.add(weight, std::pow(m, 3.0));
+      sum_m4.add(weight, std::pow(m, 4.0));
     }
     return std::make_tuple(sum_m1 / sum, sum_m2 / sum, sum_m3 / sum, sum_m4 / sum);
   }
 
+  // Spin-spin correlations and cross moments of the interaction energy
+  // E = -sum_b J_b s_i s_j and the magnetization M = sum_i s_i
+  struct correlation {
+    std::vector<std::vector<double>> spin;    // <s_i s_j>
+    std::vector<double> energy_magnetization;  // <E M^n>, n = 0, ..., 4
+  };
+
+  // All correlations in one enumeration.  On a translation-invariant square
+  // lattice the pair counts are taken from the orbit histogram.  Otherwise the
+  // states are visited in Gray-code order, and the sums over the subcube of
+  // states that differ only in sites 0, ..., k-1 (a run of 2^k consecutive
+  // Gray codes) are combined from its two halves: sum w s_i s_{k-1} is the
+  // difference of the halves' sum w s_i, so all pairs cost O(1) per state.
+  template<typename LATTICE>
+  static correlation correlations(double beta, LATTICE const& lat, std::vector<double> const& inter,
+                                  std::vector<double> const& field = std::vector<double>(0)) {
+    if (beta <= 0)
+      throw(std::invalid_argument("beta should be positive"));
+    if (lat.num_sites() > histogram::max_sites)
+      throw(std::invalid_argument("too large lattice"));
+    if (inter.size() != lat.num_bonds())
+      throw(std::invalid_argument("inconsitent table size of interaction"));
+    if (field.size() > 0 && field.size() != lat.num_sites())
+      throw(std::invalid_argument("inconsitent table size of external field"));
+    unsigned n = lat.num_sites();
+    correlation res;
+    res.spin.assign(n, std::vector<double>(n, 1));
+    res.energy_magnetization.resize(5);
+    std::vector<int> k;
+    double unit, H;
+    int kx, ky;
+    unsigned Lx, Ly;
+    if (integer_couplings(lat, inter, field, k, unit, H) &&
+        histogram::square_symmetry(lat, k, Lx, Ly, kx, ky)) {
+      histogram hist(lat, k, true);
+      auto corr = hist.pair_correlation(beta, unit, H);
+      for (unsigned i = 0; i < n; ++i)
+        for (unsigned j = 0; j < n; ++j)
+          res.spin[i][j] = corr[(j % Lx + Lx - i % Lx) % Lx + Lx * ((j / Lx + Ly - i / Lx) % Ly)];
+      for (unsigned p = 0; p < 5; ++p)
+        res.energy_magnetization[p] = hist.energy_magnetization(beta, unit, H, p);
+      return res;
+    }
+
+    // bonds around each site; self loops add a constant
+    std::vector<std::vector<std::pair<unsigned, double>>> neighbors(n);
+    for (unsigned b = 0; b < lat.num_bonds(); ++b) {
+      unsigned i = lat.source(b), j = lat.target(b);
+      if (i == j) continue;
+      neighbors[i].push_back(std::make_pair(j, inter[b]));
+      neighbors[j].push_back(std::make_pair(i, inter[b]));
+    }
+    std::vector<double> h(field);
+    h.resize(n, 0);
+    // v = sum_b J_b s_i s_j, x = sum_i h_i s_i, m = sum_i s_i of the state c,
+    // updated by flip() and recomputed every 256 flips to avoid drift
+    std::uint64_t c;
+    double v, x;
+    int m;
+    auto reset = [&](std::uint64_t state) {
+      c = state;
+      v = x = 0;
+      m = n;
+      for (unsigned b = 0; b < lat.num_bonds(); ++b)
+        v += inter[b] * (1 - 2 * int(((c >> lat.source(b)) ^ (c >> lat.target(b))) & 1));
+      for (unsigned s = 0; s < n; ++s) {
+        x += h[s] * (1 - 2 * int((c >> s) & 1));
+        m -= 2 * int((c >> s) & 1);
+      }
+    };
+    auto flip = [&](std::uint64_t i) {
+      unsigned s = trailing_zeros(i);
+      if ((i & 255) == 0) {
+        reset(i ^ (i >> 1));
+        return;
+      }
+      double spin = 1 - 2 * int((c >> s) & 1), local = 0;
+      for (auto const& nb : neighbors[s])
+        local += nb.second * (1 - 2 * int((c >> nb.first) & 1));
+      v -= 2 * spin * local;
+      x -= 2 * spin * h[s];
+      m -= 2 * int(spin);
+      c ^= std::uint64_t(1) << s;
+    };
+    std::uint64_t num_states = std::uint64_t(1) << n;
+
+    // node of level k: W, W E M^p (p = 0, ..., 4), then for j = 0, ..., k-1
+    // the block sum W s_j, sum W s_j s_l (l < j)
+    const std::size_t base = 6;
+    auto block = [&](std::size_t j) { return base + j * (j + 1) / 2; };
+    std::vector<std::vector<double>> pending(n), merged(n + 1);
+    for (unsigned l = 0; l <= n; ++l) {
+      if (l < n) pending[l].resize(block(l));
+      merged[l].resize(block(l));
+    }
+    // weights are taken relative to the largest exponent so far, and the
+    // pending sums are rescaled whenever it grows, so nothing overflows
+    reset(0);
+    double xmax = v + x;
+    for (std::uint64_t i = 0; i < num_states; ++i) {
+      if (i > 0) flip(i);
+      if (v + x > xmax) {
+        double r = std::exp(beta * (xmax - v - x));
+        for (auto& node : pending)
+          for (auto& q : node) q *= r;
+        xmax = v + x;
+      }
+      std::vector<double>* cur = &merged[0];
+      double w = std::exp(beta * (v + x - xmax));
+      double t = -w * v;
+      (*cur)[0] = w;
+      for (unsigned p = 0; p < 5; ++p, t *= m) (*cur)[1 + p] = t;
+      unsigned l = 0;
+      for (; l < n && ((i >> l) & 1); ++l) {
+        // the earlier half has site l down iff bit l + 1 of i is set
+        bool first_up = ((i >> (l + 1)) & 1) == 0;
+        std::vector<double> const& up = first_up ? pending[l] : *cur;
+        std::vector<double> const& down = first_up ? *cur : pending[l];
+        std::vector<double>& out = merged[l + 1];
+        for (std::size_t q = 0; q < block(l); ++q) out[q] = up[q] + down[q];
+        out[block(l)] = up[0] - down[0];
+        for (unsigned j = 0; j < l; ++j) out[block(l) + 1 + j] = up[block(j)] - down[block(j)];
+        cur = &out;
+      }
+      if (l < n) std::copy(cur->begin(), cur->end(), pending[l].begin());
+    }
+    std::vector<double> const& root = merged[n];
+    for (unsigned p = 0; p < 5; ++p) res.energy_magnetization[p] = root[1 + p] / root[0];
+    for (unsigned j = 0; j < n; ++j)
+      for (unsigned l = 0; l < j; ++l)
+        res.spin[j][l] = res.spin[l][j] = root[block(j) + 1 + l] / root[0];
+    return res;
+  }
+
+  template<typename LATTICE>
+  static correlation correlations(double beta, LATTICE const& lat, double J, double H = 0.0) {
+    std::vector<double> inter(lat.num_bonds(), J);
+    std::vector<double> field((H != 0.0) ? lat.num_sites() : 0, H);
+    return correlations(beta, lat, inter, field);
+  }
+
   template<typename LATTICE>
   static double free_energy(double beta, LATTICE const& lat, double J, double H = 0.0) {
     std::vector<double> inter(lat.num_bonds(), J);
@@ -151,6 +755,26 @@ public:
                              m3 / std::pow(lat.num_sites(), 3.0),
                              m4 / std::pow(lat.num_sites(), 4.0));
   }
+
+  static unsigned trailing_zeros(std::uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    unsigned n = 0;
+    for (; (x & 1) == 0; x >>= 1) ++n;
+    return n;
+#endif
+  }
+
+  static int popcount(std::uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1) ++n;
+    return n;
+#endif
+  }
 };
 
 } // end namespace ising
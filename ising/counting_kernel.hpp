@@ -0,0 +1,207 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Gray-code state walks of fixed small square lattices with the bond masks as
+// compile-time tables
+
+#pragma once
+
+#include <cstdint>
+
+namespace ising {
+
+enum class boundary { periodic, open };
+
+// Index of a histogram of the states by ux, uy, and d, the numbers of
+// unsatisfied x bonds, unsatisfied y bonds, and down spins (set bits):
+// base + x ux / Unit + y uy / Unit + down d, Unit being the template argument
+// of counting_kernel::enumerate.
+struct counting_layout {
+  std::int64_t base, x, y, down;
+};
+
+// Gray-code walk over the states of the Lx x Ly square lattice (Lx, Ly >= 2)
+// with sites x + Lx y and the given boundary condition.  The neighbors of
+// each site along x and along y are bit masks in a constexpr table, and the
+// flips of the lowest block_bits sites, which repeat in a fixed pattern within
+// each block of 2^block_bits states, are unrolled with the site as a
+// constant, so that their masks are immediate operands.  On a periodic ring
+// of length 2, the two bonds between the same sites are counted twice.
+template <unsigned Lx, unsigned Ly, boundary Boundary>
+struct counting_kernel {
+  static_assert(Lx >= 2 && Ly >= 2 && Lx * Ly <= 64, "unsupported lattice size");
+  static constexpr unsigned num_sites = Lx * Ly;
+  static constexpr unsigned block_bits = 4;
+  static constexpr bool periodic = (Boundary == boundary::periodic);
+  static constexpr std::int64_t weight_x = (periodic && Lx == 2) ? 2 : 1;
+  static constexpr std::int64_t weight_y = (periodic && Ly == 2) ? 2 : 1;
+
+  struct table {
+    std::uint64_t x[num_sites];  // neighbors along x
+    std::uint64_t y[num_sites];  // neighbors along y
+    int degree_x[num_sites];
+    int degree_y[num_sites];
+  };
+  static constexpr table masks() {
+    table t{};
+    for (unsigned s = 0; s < num_sites; ++s) {
+      unsigned x = s % Lx, y = s / Lx;
+      if (periodic || x > 0) t.x[s] |= std::uint64_t(1) << ((x + Lx - 1) % Lx + Lx * y);
+      if (periodic || x + 1 < Lx) t.x[s] |= std::uint64_t(1) << ((x + 1) % Lx + Lx * y);
+      if (periodic || y > 0) t.y[s] |= std::uint64_t(1) << (x + Lx * ((y + Ly - 1) % Ly));
+      if (periodic || y + 1 < Ly) t.y[s] |= std::uint64_t(1) << (x + Lx * ((y + 1) % Ly));
+      for (unsigned r = 0; r < num_sites; ++r) {
+        t.degree_x[s] += (t.x[s] >> r) & 1;
+        t.degree_y[s] += (t.y[s] >> r) & 1;
+      }
+    }
+    return t;
+  }
+
+  // Adds the states first <= i < last of the Gray-code sequence to hist.  The
+  // numbers of unsatisfied bonds are divided by Unit, which must divide them
+  // (Unit = 2 on a periodic lattice, where they are even).
+  template <unsigned Unit>
+  static void enumerate(std::uint64_t first, std::uint64_t last,
+                        counting_layout const& layout, std::uint64_t* hist) {
+    const std::uint64_t len = std::uint64_t(1) << block_bits;
+    std::uint64_t c = first ^ (first >> 1);
+    std::int64_t idx = index<Unit>(c, layout);
+    ++hist[idx];
+    if (first % len == 0 && last % len == 0) {
+      block<Unit, block_bits>::run(c, idx, layout, hist);
+      for (std::uint64_t i = first + len; i < last; i += len) {
+        flip<Unit>(trailing_zeros(i), c, idx, layout, hist);
+        block<Unit, block_bits>::run(c, idx, layout, hist);
+      }
+    } else {
+      for (std::uint64_t i = first + 1; i < last; ++i)
+        flip<Unit>(trailing_zeros(i), c, idx, layout, hist);
+    }
+  }
+
+private:
+  template <unsigned Unit>
+  static std::int64_t index(std::uint64_t c, counting_layout const& layout) {
+    static constexpr table t = masks();
+    std::int64_t ux = 0, uy = 0;
+    for (unsigned s = 0; s < num_sites; ++s) {
+      std::uint64_t spin = std::uint64_t(0) - ((c >> s) & 1);
+      ux += popcount((c ^ spin) & t.x[s]);
+      uy += popcount((c ^ spin) & t.y[s]);
+    }
+    // each pair of neighbors is seen from both ends
+    ux = weight_x * ux / 2;
+    uy = weight_y * uy / 2;
+    return layout.base + layout.x * (ux / Unit) + layout.y * (uy / Unit) +
+           layout.down * popcount(c);
+  }
+
+  // flips site s and counts the new state; the unsatisfied bonds of s become
+  // satisfied and vice versa
+  template <unsigned Unit>
+  static void flip(std::uint64_t mx, std::uint64_t my, int dx, int dy, unsigned s,
+                   std::uint64_t& c, std::int64_t& idx, counting_layout const& layout,
+                   std::uint64_t* hist) {
+    std::uint64_t spin = std::uint64_t(0) - ((c >> s) & 1);
+    std::int64_t ux = weight_x * (dx - 2 * count2((c ^ spin) & mx));
+    std::int64_t uy = weight_y * (dy - 2 * count2((c ^ spin) & my));
+    idx += layout.x * (ux / Unit) + layout.y * (uy / Unit) +
+           (spin ? -layout.down : layout.down);
+    c ^= std::uint64_t(1) << s;
+    ++hist[idx];
+  }
+  template <unsigned Unit>
+  static void flip(unsigned s, std::uint64_t& c, std::int64_t& idx,
+                   counting_layout const& layout, std::uint64_t* hist) {
+    static constexpr table t = masks();
+    flip<Unit>(t.x[s], t.y[s], t.degree_x[s], t.degree_y[s], s, c, idx, layout, hist);
+  }
+
+  // the 2^B - 1 flips following a state whose lowest B Gray-code bits are
+  // zero
+  template <unsigned Unit, unsigned B, typename = void>
+  struct block {
+    static void run(std::uint64_t& c, std::int64_t& idx, counting_layout const& layout,
+                    std::uint64_t* hist) {
+      constexpr table t = masks();
+      block<Unit, B - 1>::run(c, idx, layout, hist);
+      flip<Unit>(t.x[B - 1], t.y[B - 1], t.degree_x[B - 1], t.degree_y[B - 1], B - 1, c,
+                 idx, layout, hist);
+      block<Unit, B - 1>::run(c, idx, layout, hist);
+    }
+  };
+  template <unsigned Unit, typename D>
+  struct block<Unit, 0, D> {
+    static void run(std::uint64_t&, std::int64_t&, counting_layout const&, std::uint64_t*) {}
+  };
+
+  static unsigned trailing_zeros(std::uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    unsigned n = 0;
+    for (; (x & 1) == 0; x >>= 1) ++n;
+    return n;
+#endif
+  }
+
+  // number of set bits of x, which has at most two; two tests are cheaper
+  // than popcount where that is not an instruction
+  static int count2(std::uint64_t x) {
+#if defined(__POPCNT__)
+    return popcount(x);
+#else
+    return int(x != 0) + int((x & (x - 1)) != 0);
+#endif
+  }
+
+  static int popcount(std::uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1) ++n;
+    return n;
+#endif
+  }
+};
+
+typedef void (*counting_walk)(std::uint64_t, std::uint64_t, counting_layout const&,
+                              std::uint64_t*);
+
+// counting_kernel<Lx, Ly, Boundary>::enumerate<Unit> for 2 <= Lx, Ly <= 6,
+// found by stepping through the boundaries, then Ly, then Lx
+template <unsigned Unit, unsigned Lx = 2, unsigned Ly = 2,
+          boundary Boundary = boundary::periodic>
+struct counting_dispatch {
+  static constexpr bool last_boundary = (Boundary == boundary::open);
+  static counting_walk find(unsigned lx, unsigned ly, boundary bc) {
+    if (lx == Lx && ly == Ly && bc == Boundary)
+      return &counting_kernel<Lx, Ly, Boundary>::template enumerate<Unit>;
+    return counting_dispatch<
+        Unit, (last_boundary && Ly == 6) ? Lx + 1 : Lx,
+        last_boundary ? (Ly == 6 ? 2 : Ly + 1) : Ly,
+        last_boundary ? boundary::periodic : boundary::open>::find(lx, ly, bc);
+  }
+};
+
+template <unsigned Unit, unsigned Ly, boundary Boundary>
+struct counting_dispatch<Unit, 7, Ly, Boundary> {
+  static counting_walk find(unsigned, unsigned, boundary) { return nullptr; }
+};
+
+} // end namespace ising
@@ -21,7 +21,10 @@
 struct options {
   bool valid;
   unsigned Lx, Ly;
-  options(unsigned argc, char *argv[]) : valid(true) {
+  bool open_x;
+  // allow_open: accepts "Lx Ly open" for open boundaries along x
+  options(unsigned argc, char *argv[], bool allow_open = false) :
+    valid(true), open_x(false), allow_open_(allow_open) {
     switch (argc) {
     case 2:
       if (std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help")
@@ -33,6 +36,15 @@ struct options {
       Lx = std::atol(argv[1]);
       Ly = std::atol(argv[2]);
       return;
+    case 4:
+      if (allow_open_ && std::string(argv[3]) == "open") {
+        Lx = std::atol(argv[1]);
+        Ly = std::atol(argv[2]);
+        open_x = true;
+      } else {
+        std::cerr << help(argv[0]);
+      }
+      return;
     default:
       std::cerr << help(argv[0]);
       return;
@@ -42,6 +54,14 @@ struct options {
     valid = false;
     return std::string("Density of state of square lattice Ising model\n") +
       "Usage: " + prog + " L\n" +
-      "       " + prog + " Lx Ly\n";
+      "       " + prog + " Lx Ly\n" +
+      (allow_open_ ? "       " + std::string(prog) + " Lx Ly open\n" +
+       "Periodic along y; periodic along x unless open is given\n" +
+       "Memory is 8 2^Ly (Lx Ly + 1)^2 bytes.  The time grows as 4^Ly on the torus\n" +
+       "(half a minute for Lx = 12, Ly = 9 on one core, an hour for Lx = Ly = 12) but\n" +
+       "only as 2^Ly on the strip, so that the torus is limited to Ly of about 12\n" :
+       "Periodic boundary conditions\n");
   }
+private:
+  bool allow_open_;
 };
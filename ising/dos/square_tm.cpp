@@ -0,0 +1,33 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Joint density of states of square lattice Ising model: line e lists the
+// number of states with e unsatisfied bonds and m = 0, 1, ..., N down spins.
+// With "open", the lattice is a strip with open boundaries along x.
+
+#include <iostream>
+#include "options.hpp"
+#include "square_tm.hpp"
+
+int main(int argc, char **argv) {
+  options opt(argc, argv, true);
+  if (!opt.valid) return 127;
+  auto dos = ising::dos::square::joint(opt.Lx, opt.Ly, opt.open_x);
+  for (auto const& row : dos) {
+    for (auto v : row) std::cout << v << ' ';
+    std::cout << std::endl;
+  }
+}
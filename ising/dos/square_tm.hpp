@@ -0,0 +1,294 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Joint density of states g(E, M) of square lattice Ising model using the
+// transfer matrix method with exact polynomial entries
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include <boost/multiprecision/cpp_int.hpp>
+#include <boost/multiprecision/miller_rabin.hpp>
+#include "exact/log_sum_exp.hpp"
+#include "exact/parallel.hpp"
+
+namespace ising {
+namespace dos {
+namespace square {
+
+typedef unsigned long uint_t;
+typedef boost::multiprecision::cpp_int int_type;
+
+namespace tm_detail {
+
+typedef std::uint64_t word_t;
+
+// primes below 2^62, so that the sum of two residues does not overflow
+inline std::vector<word_t> primes(std::size_t n) {
+  std::vector<word_t> res;
+  for (word_t p = (word_t(1) << 62) - 1; res.size() < n; p -= 2)
+    if (boost::multiprecision::miller_rabin_test(int_type(p), 25)) res.push_back(p);
+  return res;
+}
+
+inline uint_t rotate(uint_t c, uint_t r, uint_t Ly) {
+  uint_t mask = (uint_t(1) << Ly) - 1;
+  return r == 0 ? c : (((c << r) | (c >> (Ly - r))) & mask);
+}
+
+inline uint_t reflect(uint_t c, uint_t Ly) {
+  uint_t res = 0;
+  for (uint_t s = 0; s < Ly; ++s) res |= ((c >> s) & 1) << (Ly - 1 - s);
+  return res;
+}
+
+// Columns are Ly spins, bit s of the state being 1 for a down spin at row s.
+// The entry of state c is a polynomial sum_{e,m} a_{e,m} x^e y^m with
+// coefficients modulo p; x marks an unsatisfied bond and y a down spin.
+// Starting from column c0, each column has an even number of unsatisfied
+// vertical bonds and each bond between two columns changes one spin, so that
+// only the powers e = pc(c) + pc(c0) mod 2 occur in the entry of c.  The
+// entry keeps just those, as a[(e / 2) * nm + m], in half the space of all
+// (e, m).
+class polynomial_tm {
+public:
+  polynomial_tm(uint_t Lx, uint_t Ly, word_t p) :
+    Lx_(Lx), Ly_(Ly), p_(p), dim_(uint_t(1) << Ly), ne_(2 * Lx * Ly + 1), nh_(Lx * Ly + 1),
+    nm_(Lx * Ly + 1), block_(nh_ * nm_), ey_(dim_), pc_(dim_) {
+    for (uint_t c = 0; c < dim_; ++c) {
+      ey_[c] = 0;
+      pc_[c] = 0;
+      for (uint_t s = 0; s < Ly_; ++s) {
+        ey_[c] += ((c >> s) & 1) ^ ((c >> ((s + 1) % Ly_)) & 1);
+        pc_[c] += (c >> s) & 1;
+      }
+    }
+  }
+
+  // <c0| T^Lx |c0> with T = U D; D multiplies by the vertical bonds and the
+  // down spins of a column, U joins neighboring columns one row at a time
+  std::vector<word_t> diagonal(uint_t c0) const {
+    std::vector<word_t> v(dim_ * block_, 0);
+    v[c0 * block_ + ey_[c0] / 2 * nm_ + pc_[c0]] = 1;
+    uint_t q0 = pc_[c0] & 1;
+    uint_t emax = ey_[c0], mmax = pc_[c0];
+    propagate(q0, emax, mmax, v);
+    // bonds between the last and the first column
+    std::vector<word_t> res(ne_ * nm_, 0);
+    for (uint_t c = 0; c < dim_; ++c) {
+      uint_t de = 0;
+      for (uint_t s = 0; s < Ly_; ++s) de += ((c ^ c0) >> s) & 1;
+      uint_t q = (pc_[c] + q0) & 1;
+      word_t const* a = &v[c * block_];
+      for (uint_t e = q; e + de < ne_ && e <= emax; e += 2)
+        for (uint_t m = 0; m <= mmax; ++m)
+          res[(e + de) * nm_ + m] = add(res[(e + de) * nm_ + m], a[e / 2 * nm_ + m]);
+    }
+    return res;
+  }
+
+  // sum_{c0, c} <c| (U D)^(Lx - 1) D |c0>: the strip with open boundaries
+  // along x, whose first columns are traced in two passes, one for each
+  // parity of pc(c0)
+  std::vector<word_t> strip() const {
+    std::vector<word_t> res(ne_ * nm_, 0);
+    for (uint_t q0 = 0; q0 < 2; ++q0) {
+      std::vector<word_t> v(dim_ * block_, 0);
+      uint_t emax = 0, mmax = 0;
+      for (uint_t c = 0; c < dim_; ++c) {
+        if ((pc_[c] & 1) != q0) continue;
+        v[c * block_ + ey_[c] / 2 * nm_ + pc_[c]] = 1;
+        emax = std::max(emax, ey_[c]);
+        mmax = std::max(mmax, pc_[c]);
+      }
+      propagate(q0, emax, mmax, v);
+      for (uint_t c = 0; c < dim_; ++c) {
+        uint_t q = (pc_[c] + q0) & 1;
+        word_t const* a = &v[c * block_];
+        for (uint_t e = q; e <= emax; e += 2)
+          for (uint_t m = 0; m <= mmax; ++m)
+            res[e * nm_ + m] = add(res[e * nm_ + m], a[e / 2 * nm_ + m]);
+      }
+    }
+    return res;
+  }
+
+  word_t add(word_t a, word_t b) const {
+    word_t r = a + b;
+    return r >= p_ ? r - p_ : r;
+  }
+
+private:
+  // applies (U D)^(Lx - 1); emax and mmax bound the nonzero powers, and the
+  // entry of c holds the powers e = pc(c) + q0 mod 2
+  void propagate(uint_t q0, uint_t& emax, uint_t& mmax, std::vector<word_t>& v) const {
+    for (uint_t x = 1; x < Lx_; ++x) {
+      for (uint_t s = 0; s < Ly_; ++s)
+        product_U(s, q0, std::min(emax + s + 1, ne_ - 1), mmax, v);
+      emax += Ly_;
+      product_D(emax + 1, mmax + 1, v);
+      emax = std::min(emax + Ly_, ne_ - 1);
+      mmax = std::min(mmax + Ly_, nm_ - 1);
+    }
+  }
+
+  // a(c) += x a(c'), a(c') += x a(c) for the pairs c, c' = c ^ (1 << s)
+  void product_U(uint_t s, uint_t q0, uint_t emax, uint_t mmax, std::vector<word_t>& v) const {
+    uint_t bit = uint_t(1) << s;
+    exact::parallel::for_each(dim_ / 2, [&](std::size_t i) {
+      uint_t c = ((i >> s) << (s + 1)) | (i & (bit - 1));
+      // a holds the even powers e = 2 h, b the odd ones e = 2 h + 1
+      word_t* a = &v[c * block_];
+      word_t* b = &v[(c | bit) * block_];
+      if ((pc_[c] + q0) & 1) std::swap(a, b);
+      for (uint_t h = std::min(emax / 2, nh_ - 1) + 1; h-- > 0;)
+        for (uint_t m = 0; m <= mmax; ++m) {
+          word_t ah = a[h * nm_ + m];
+          b[h * nm_ + m] = add(b[h * nm_ + m], ah);
+          if (h > 0) a[h * nm_ + m] = add(ah, b[(h - 1) * nm_ + m]);
+        }
+    });
+  }
+
+  // a(c) *= x^{ey(c)} y^{pc(c)}, ey(c) being even
+  void product_D(uint_t ne, uint_t nm, std::vector<word_t>& v) const {
+    exact::parallel::for_each(dim_, [&](std::size_t c) {
+      word_t* a = &v[c * block_];
+      uint_t dh = ey_[c] / 2, dm = pc_[c];
+      for (uint_t h = std::min(ne / 2 + 1 + dh, nh_); h-- > 0;)
+        for (uint_t m = std::min(nm + dm, nm_); m-- > 0;)
+          a[h * nm_ + m] = (h >= dh && m >= dm) ? a[(h - dh) * nm_ + m - dm] : 0;
+    });
+  }
+
+  uint_t Lx_, Ly_;
+  word_t p_;
+  uint_t dim_, ne_, nh_, nm_, block_;
+  std::vector<uint_t> ey_, pc_;
+};
+
+} // end namespace tm_detail
+
+// Joint density of states of Lx x Ly lattice, periodic along y and periodic
+// (torus) or open (strip) along x: g[e][m] is the number of states with e
+// unsatisfied bonds and m down spins, i.e. the coefficients of Z = exp(beta J
+// N_b + beta h N) sum_{e,m} g[e][m] x^e y^m with x = exp(-2 beta J) and y =
+// exp(-2 beta h), where N_b = g.size() - 1 is the number of bonds.  The
+// polynomial transfer matrix is run modulo as many primes near 2^62 as 2^N
+// needs and the counts are reconstructed by the Chinese remainder theorem.
+// On the torus only one starting column per orbit of the rotations, the
+// reflection, and the spin flip of a column is traced over; the strip needs
+// two passes.  Memory is 8 2^Ly (N + 1)^2 bytes, and time O(2^(2 Ly) Lx N^2 /
+// Ly) per prime on the torus and O(2^Ly Lx N^2) on the strip.
+inline std::vector<std::vector<int_type>> joint(uint_t Lx, uint_t Ly, bool open_x = false) {
+  using tm_detail::word_t;
+  if (Lx == 0 || Ly == 0)
+    throw(std::invalid_argument("system size should be positive"));
+  if (Ly >= std::numeric_limits<uint_t>::digits / 2)
+    throw(std::invalid_argument("Ly is too large"));
+  uint_t n = Lx * Ly, ne = 2 * n + 1, nm = n + 1, dim = uint_t(1) << Ly;
+  auto primes = tm_detail::primes(n / 61 + 1);
+  std::vector<std::vector<word_t>> residue;
+  for (auto p : primes) {
+    tm_detail::polynomial_tm tm(Lx, Ly, p);
+    if (open_x) {
+      residue.push_back(tm.strip());
+      continue;
+    }
+    std::vector<word_t> sum(ne * nm, 0);
+    for (uint_t c0 = 0; c0 < dim; ++c0) {
+      // c0 is the smallest of its orbit.  The w columns equivalent to c0
+      // without the flip give d(e, m), and unless the flip of c0 is one of
+      // them, as many give d(e, N - m).
+      std::vector<uint_t> orbit;
+      bool smallest = true, self_dual = false;
+      uint_t flip = dim - 1;
+      for (uint_t r = 0; r < Ly && smallest; ++r)
+        for (auto c : {tm_detail::rotate(c0, r, Ly),
+                       tm_detail::reflect(tm_detail::rotate(c0, r, Ly), Ly)}) {
+          if (c < c0 || (c ^ flip) < c0) smallest = false;
+          if ((c ^ flip) == c0) self_dual = true;
+          orbit.push_back(c);
+        }
+      if (!smallest) continue;
+      std::sort(orbit.begin(), orbit.end());
+      uint_t w = std::unique(orbit.begin(), orbit.end()) - orbit.begin();
+      auto d = tm.diagonal(c0);
+      for (uint_t e = 0; e < ne; ++e)
+        for (uint_t m = 0; m < nm; ++m) {
+          word_t& r = sum[e * nm + m];
+          for (uint_t k = 0; k < w; ++k) {
+            r = tm.add(r, d[e * nm + m]);
+            if (!self_dual) r = tm.add(r, d[e * nm + n - m]);
+          }
+        }
+    }
+    residue.push_back(sum);
+  }
+
+  // x = sum_k r_k u_k mod P with u_k = 1 mod p_k and 0 mod the others
+  int_type prod = 1;
+  for (auto p : primes) prod *= p;
+  std::vector<int_type> u;
+  for (auto p : primes) {
+    int_type q = prod / p, r = q % p;
+    int_type inv = boost::multiprecision::powm(r, int_type(p - 2), int_type(p));
+    u.push_back(q * inv);
+  }
+  std::vector<std::vector<int_type>> g(ne, std::vector<int_type>(nm, 0));
+  int_type total = 0;
+  for (uint_t e = 0; e < ne; ++e)
+    for (uint_t m = 0; m < nm; ++m) {
+      int_type x = 0;
+      for (std::size_t k = 0; k < primes.size(); ++k) x += residue[k][e * nm + m] * u[k];
+      g[e][m] = x % prod;
+      total += g[e][m];
+    }
+  if (total != int_type(1) << n)
+    throw(std::runtime_error("result check failed"));
+  // the strip lacks the Ly bonds between the last and the first column
+  if (open_x) g.resize(ne - Ly);
+  return g;
+}
+
+// log Z at inverse temperature beta from the joint density of states
+template<typename T>
+T log_partition_function(std::vector<std::vector<int_type>> const& g, T beta, T J, T h) {
+  using std::log;
+  if (g.empty())
+    throw(std::invalid_argument("empty density of states"));
+  std::size_t nb = g.size() - 1, n = g[0].size() - 1;
+  exact::log_sum_exp<T> z;
+  for (std::size_t e = 0; e < g.size(); ++e)
+    for (std::size_t m = 0; m < g[e].size(); ++m) {
+      if (g[e][m] == 0) continue;
+      // log g without converting g itself, which may exceed the range of T
+      std::size_t shift = msb(g[e][m]);
+      shift = shift > 52 ? shift - 52 : 0;
+      T logg = log(static_cast<T>(int_type(g[e][m] >> shift))) + T(shift) * log(T(2));
+      z.add(logg - 2 * beta * J * T(e) - 2 * beta * h * T(m));
+    }
+  return beta * J * T(nb) + beta * h * T(n) + z.log();
+}
+
+} // end namespace square
+} // end namespace dos
+} // end namespace ising
@@ -0,0 +1,136 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Joint density of states of square lattice Ising model
+
+#include <cmath>
+#include <gtest/gtest.h>
+#include "square.hpp"
+#include "square_tm.hpp"
+
+using namespace ising::dos::square;
+
+TEST(ising_dos_square_tm, marginal) {
+  auto g = joint(4, 4);
+  auto dos = count(4, 4);
+  ASSERT_EQ(33, g.size());
+  for (std::size_t e = 0; e < g.size(); ++e) {
+    ASSERT_EQ(17, g[e].size());
+    int_type sum = 0;
+    for (std::size_t m = 0; m < g[e].size(); ++m) {
+      EXPECT_EQ(g[e][m], g[e][16 - m]);
+      sum += g[e][m];
+    }
+    EXPECT_EQ(dos[e], sum);
+  }
+  EXPECT_EQ(1, g[0][0]);
+  EXPECT_EQ(1, g[0][16]);
+  EXPECT_EQ(16, g[4][1]);
+}
+
+TEST(ising_dos_square_tm, enumeration) {
+  for (uint_t Lx = 1; Lx <= 5; ++Lx) {
+    for (uint_t Ly = 1; Ly <= 4; ++Ly) {
+      uint_t n = Lx * Ly;
+      std::vector<std::vector<int_type>> dos(2 * n + 1, std::vector<int_type>(n + 1, 0));
+      for (uint_t c = 0; c < (uint_t(1) << n); ++c) {
+        uint_t e = 0, m = 0;
+        for (uint_t x = 0; x < Lx; ++x) {
+          for (uint_t y = 0; y < Ly; ++y) {
+            uint_t s = x + Lx * y;
+            e += ((c >> s) ^ (c >> ((x + 1) % Lx + Lx * y))) & 1;
+            e += ((c >> s) ^ (c >> (x + Lx * ((y + 1) % Ly)))) & 1;
+            m += (c >> s) & 1;
+          }
+        }
+        dos[e][m] += 1;
+      }
+      EXPECT_EQ(dos, joint(Lx, Ly));
+    }
+  }
+}
+
+TEST(ising_dos_square_tm, finite) {
+  // 2^64 states need two moduli
+  auto g = joint(8, 8);
+  auto dos = finite<128, 100>(8, 8);
+  for (std::size_t e = 0; e < g.size(); ++e) {
+    int_type sum = 0;
+    for (auto const& v : g[e]) sum += v;
+    EXPECT_EQ(dos[e], sum);
+  }
+}
+
+TEST(ising_dos_square_tm, log_partition_function) {
+  uint_t Lx = 3, Ly = 4, n = Lx * Ly;
+  double beta = 0.7, J = 1.0, h = 0.3;
+  auto g = joint(Lx, Ly);
+  double z = 0;
+  for (uint_t c = 0; c < (uint_t(1) << n); ++c) {
+    double energy = 0;
+    for (uint_t x = 0; x < Lx; ++x) {
+      for (uint_t y = 0; y < Ly; ++y) {
+        uint_t s = x + Lx * y;
+        double sz = 1 - 2.0 * ((c >> s) & 1);
+        energy -= J * sz * (1 - 2.0 * ((c >> ((x + 1) % Lx + Lx * y)) & 1));
+        energy -= J * sz * (1 - 2.0 * ((c >> (x + Lx * ((y + 1) % Ly))) & 1));
+        energy -= h * sz;
+      }
+    }
+    z += std::exp(-beta * energy);
+  }
+  EXPECT_NEAR(std::log(z), log_partition_function(g, beta, J, h), 1e-12);
+}
+
+TEST(ising_dos_square_tm, strip) {
+  for (uint_t Lx = 1; Lx <= 5; ++Lx) {
+    for (uint_t Ly = 1; Ly <= 4; ++Ly) {
+      uint_t n = Lx * Ly;
+      std::vector<std::vector<int_type>> dos(2 * n - Ly + 1, std::vector<int_type>(n + 1, 0));
+      for (uint_t c = 0; c < (uint_t(1) << n); ++c) {
+        uint_t e = 0, m = 0;
+        for (uint_t x = 0; x < Lx; ++x) {
+          for (uint_t y = 0; y < Ly; ++y) {
+            uint_t s = x + Lx * y;
+            if (x + 1 < Lx) e += ((c >> s) ^ (c >> (s + 1))) & 1;
+            e += ((c >> s) ^ (c >> (x + Lx * ((y + 1) % Ly)))) & 1;
+            m += (c >> s) & 1;
+          }
+        }
+        dos[e][m] += 1;
+      }
+      EXPECT_EQ(dos, joint(Lx, Ly, true));
+    }
+  }
+
+  uint_t Lx = 4, Ly = 3, n = Lx * Ly;
+  double beta = 0.7, J = 1.0, h = 0.3;
+  double z = 0;
+  for (uint_t c = 0; c < (uint_t(1) << n); ++c) {
+    double energy = 0;
+    for (uint_t x = 0; x < Lx; ++x) {
+      for (uint_t y = 0; y < Ly; ++y) {
+        uint_t s = x + Lx * y;
+        double sz = 1 - 2.0 * ((c >> s) & 1);
+        if (x + 1 < Lx) energy -= J * sz * (1 - 2.0 * ((c >> (s + 1)) & 1));
+        energy -= J * sz * (1 - 2.0 * ((c >> (x + Lx * ((y + 1) % Ly))) & 1));
+        energy -= h * sz;
+      }
+    }
+    z += std::exp(-beta * energy);
+  }
+  EXPECT_NEAR(std::log(z), log_partition_function(joint(Lx, Ly, true), beta, J, h), 1e-12);
+}
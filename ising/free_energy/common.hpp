@@ -76,5 +76,39 @@ inline typename T::root_type magnetization2(T f, U beta, W h) {
   return susceptibility(f, beta, h) / b0;
 }
 
+// f given by make_ftuple in (beta, Jx, Jy)
+
+template <typename T, typename U, typename V, typename W>
+inline typename T::root_type free_energy(T f, U, V, W) {
+  return f.derivative(0, 0, 0);
+}
+
+template <typename T, typename U, typename V, typename W>
+inline typename T::root_type energy(T f, U beta, V, W) {
+  auto f000 = f.derivative(0, 0, 0);
+  auto f100 = f.derivative(1, 0, 0);
+  auto b0 = beta.derivative(0);
+  return (f000 + b0 * f100);
+}
+
+template <typename T, typename U, typename V, typename W>
+inline typename T::root_type specific_heat(T f, U beta, V, W) {
+  auto f100 = f.derivative(1, 0, 0);
+  auto f200 = f.derivative(2, 0, 0);
+  auto b0 = beta.derivative(0);
+  return -(b0 * b0 * (2 * f100 + b0 * f200));
+}
+
+// energy of the x and y bonds, Jx dF/dJx and Jy dF/dJy, which add up to E
+template <typename T, typename U, typename V, typename W>
+inline typename T::root_type energy_x(T f, U, V Jx, W) {
+  return static_cast<typename T::root_type>(Jx) * f.derivative(0, 1, 0);
+}
+
+template <typename T, typename U, typename V, typename W>
+inline typename T::root_type energy_y(T f, U, V, W Jy) {
+  return static_cast<typename T::root_type>(Jy) * f.derivative(0, 0, 1);
+}
+
 }  // namespace free_energy
 }  // namespace ising
@@ -16,14 +16,18 @@
 
 #pragma once
 #include <iostream>
+#include <limits>
 #include <string>
+#include <vector>
 
 struct options2 {
   bool valid;
   unsigned int prec;
+  unsigned int threads;
+  bool bonds;
   std::string Jx, Jy, Tmin, Tmax, dT;
   options2(unsigned argc, char *argv[])
-      : valid(true), prec(15), Jx("1"), Jy("1") {
+      : valid(true), prec(15), threads(0), bonds(false), Jx("1"), Jy("1") {
     if (argc == 1) {
       std::cerr << help(argv[0]);
       return;
@@ -43,6 +47,16 @@ struct options2 {
               }
               prec = atoi(argv[i]);
               break;
+            case 'n':
+              if (++i == argc) {
+                std::cerr << help(argv[0]);
+                return;
+              }
+              threads = atoi(argv[i]);
+              break;
+            case 'b':
+              bonds = true;
+              break;
             default:
               std::cerr << help(argv[0]);
               return;
@@ -80,20 +94,32 @@ struct options2 {
   std::string help(char *prog) {
     valid = false;
     return std::string("Free energy of ferromagnetic Ising model\n") +
-           "Usage: " + prog + " [-p prec] T\n" + "       " + prog +
-           " [-p prec] J T\n" + "       " + prog + " [-p prec] Jx Jy T\n" +
-           "       " + prog + " [-p prec] Jx Jy Tmin Tmax dT\n" +
-           "Note: T can be specified as \"tc\" instead of real numbers\n";
+           "Usage: " + prog + " [-p prec] [-n threads] [-b] T\n" +
+           "       " + prog + " [-p prec] [-n threads] [-b] J T\n" +
+           "       " + prog + " [-p prec] [-n threads] [-b] Jx Jy T\n" +
+           "       " + prog +
+           " [-p prec] [-n threads] [-b] Jx Jy Tmin Tmax dT\n" +
+           "Note: T can be specified as \"tc\" instead of real numbers\n" +
+           "      -b prints the energies of the x and y bonds\n" +
+           "      EXACT_TANH_SINH_CACHE=dir keeps the quadrature tables for\n" +
+           "      prec > " + std::to_string(std::numeric_limits<long double>::digits10) +
+           " in dir across runs\n";
   }
 };
 
 struct options2f {
   bool valid;
   unsigned int prec;
+  unsigned int threads;
+  bool peak;
+  bool sectors;
+  bool bonds;
   unsigned long Lx, Ly;
-  std::string Jx, Jy, Tmin, Tmax, dT;
+  std::vector<unsigned long> Ls;
+  std::string Jx, Jy, Tmin, Tmax, dT, tol;
   options2f(unsigned argc, char *argv[])
-      : valid(true), prec(15), Jx("1"), Jy("1") {
+      : valid(true), prec(15), threads(0), peak(false), sectors(false),
+        bonds(false), Jx("1"), Jy("1") {
     if (argc == 1) {
       std::cerr << help(argv[0]);
       return;
@@ -103,6 +129,10 @@ struct options2f {
         std::cerr << help(argv[0]);
         return;
       }
+      if (std::string(argv[i]) == "--peak") {
+        peak = true;
+        continue;
+      }
       switch (argv[i][0]) {
         case '-':
           switch (argv[i][1]) {
@@ -113,12 +143,98 @@ struct options2f {
               }
               prec = atoi(argv[i]);
               break;
+            case 'n':
+              if (++i == argc) {
+                std::cerr << help(argv[0]);
+                return;
+              }
+              threads = atoi(argv[i]);
+              break;
+            case 'l':
+              if (++i == argc || !parse_sizes(argv[i])) {
+                std::cerr << help(argv[0]);
+                return;
+              }
+              break;
+            case 's':
+              sectors = true;
+              break;
+            case 'b':
+              bonds = true;
+              break;
+            case 'a':
+              if (++i == argc) {
+                std::cerr << help(argv[0]);
+                return;
+              }
+              tol = argv[i];
+              break;
             default:
               std::cerr << help(argv[0]);
               return;
           }
           break;
         default:
+          if (peak) {
+            if (!Ls.empty()) {
+              Lx = Ly = Ls.front();
+              switch (argc - i) {
+                case 1:
+                  Jx = Jy = argv[i];
+                  return;
+                case 2:
+                  Jx = argv[i];
+                  Jy = argv[i + 1];
+                  return;
+              }
+            } else {
+              switch (argc - i) {
+                case 1:
+                  Lx = Ly = std::atol(argv[i]);
+                  return;
+                case 2:
+                  Lx = Ly = std::atol(argv[i]);
+                  Jx = Jy = argv[i + 1];
+                  return;
+                case 4:
+                  Lx = std::atol(argv[i]);
+                  Ly = std::atol(argv[i + 1]);
+                  Jx = argv[i + 2];
+                  Jy = argv[i + 3];
+                  return;
+              }
+            }
+            std::cerr << help(argv[0]);
+            return;
+          }
+          if (!Ls.empty()) {
+            Lx = Ly = Ls.front();
+            switch (argc - i) {
+              case 1:
+                Jx = Jy = "1";
+                Tmin = Tmax = dT = argv[i];
+                return;
+              case 2:
+                Jx = Jy = argv[i];
+                Tmin = Tmax = dT = argv[i + 1];
+                return;
+              case 3:
+                Jx = argv[i];
+                Jy = argv[i + 1];
+                Tmin = Tmax = dT = argv[i + 2];
+                return;
+              case 5:
+                Jx = argv[i];
+                Jy = argv[i + 1];
+                Tmin = argv[i + 2];
+                Tmax = argv[i + 3];
+                dT = argv[i + 4];
+                return;
+              default:
+                std::cerr << help(argv[0]);
+                return;
+            }
+          }
           switch (argc - i) {
             case 2:
               Lx = Ly = std::atol(argv[i]);
@@ -152,24 +268,84 @@ struct options2f {
           }
       }
     }
+    // no positional arguments: only "--peak -l sizes" is complete
+    if (peak && !Ls.empty()) {
+      Lx = Ly = Ls.front();
+      return;
+    }
+    std::cerr << help(argv[0]);
+  }
+  // comma-separated list "L1,L2,..." or geometric range "Lmin:Lmax:factor"
+  bool parse_sizes(const std::string& str) {
+    Ls.clear();
+    auto c1 = str.find(':');
+    if (c1 != std::string::npos) {
+      auto c2 = str.find(':', c1 + 1);
+      if (c2 == std::string::npos)
+        return false;
+      unsigned long lmin = std::atol(str.substr(0, c1).c_str());
+      unsigned long lmax = std::atol(str.substr(c1 + 1, c2 - c1 - 1).c_str());
+      unsigned long factor = std::atol(str.substr(c2 + 1).c_str());
+      if (lmin == 0 || lmax < lmin || factor < 2)
+        return false;
+      for (auto L = lmin;; L *= factor) {
+        Ls.push_back(L);
+        if (L > lmax / factor)
+          break;
+      }
+    } else {
+      std::string::size_type pos = 0;
+      while (pos <= str.size()) {
+        auto c = str.find(',', pos);
+        if (c == std::string::npos)
+          c = str.size();
+        unsigned long L = std::atol(str.substr(pos, c - pos).c_str());
+        if (L == 0)
+          return false;
+        Ls.push_back(L);
+        pos = c + 1;
+      }
+    }
+    return !Ls.empty();
   }
   std::string help(char *prog) {
     valid = false;
+    std::string opts =
+        std::string(" [-p prec] [-n threads] [-a tol | -s | -b]");
     return std::string("Free energy of ferromagnetic Ising model\n") +
-           "Usage: " + prog + " [-p prec] L T\n" + "       " + prog +
-           " [-p prec] L J T\n" + "       " + prog +
-           " [-p prec] Lx Ly Jx Jy T\n" + "       " + prog +
-           " [-p prec] Lx Ly Jx Jy Tmin Tmax dT\n" +
-           "Note: T can be specified as \"tc\" instead of real numbers\n";
+           "Usage: " + prog + opts + " L T\n" +
+           "       " + prog + opts + " L J T\n" +
+           "       " + prog + opts + " Lx Ly Jx Jy T\n" +
+           "       " + prog + opts + " Lx Ly Jx Jy Tmin Tmax dT\n" +
+           "       " + prog + opts + " -l sizes T\n" +
+           "       " + prog + opts + " -l sizes J T\n" +
+           "       " + prog + opts + " -l sizes Jx Jy T\n" +
+           "       " + prog + opts + " -l sizes Jx Jy Tmin Tmax dT\n" +
+           "       " + prog + " [-p prec] [-n threads] --peak L [J]\n" +
+           "       " + prog + " [-p prec] [-n threads] --peak Lx Ly Jx Jy\n" +
+           "       " + prog +
+           " [-p prec] [-n threads] --peak -l sizes [J | Jx Jy]\n" +
+           "Note: T can be specified as \"tc\" instead of real numbers\n" +
+           "      sizes of L x L lattices are given as \"L1,L2,...\" or " +
+           "\"Lmin:Lmax:factor\"\n" +
+           "      -a tol uses the bulk free energy away from Tc, where the " +
+           "finite-size\n" +
+           "         corrections are exponentially small and bounded by tol, " +
+           "and the exact\n" +
+           "         sum otherwise (no finite-size expansion around Tc)\n" +
+           "      -s prints the free energies of the four periodic/" +
+           "antiperiodic sectors\n" +
+           "      -b prints the energies of the x and y bonds\n";
   }
 };
 
 struct options3 {
   bool valid;
   unsigned int prec;
+  unsigned int threads;
   std::string Ja, Jb, Jc, Tmin, Tmax, dT;
   options3(unsigned argc, char *argv[])
-      : valid(true), prec(15), Ja("1"), Jb("1"), Jc("1") {
+      : valid(true), prec(15), threads(0), Ja("1"), Jb("1"), Jc("1") {
     if (argc == 1) {
       std::cerr << help(argv[0]);
       return;
@@ -189,6 +365,13 @@ struct options3 {
               }
               prec = atoi(argv[i]);
               break;
+            case 'n':
+              if (++i == argc) {
+                std::cerr << help(argv[0]);
+                return;
+              }
+              threads = atoi(argv[i]);
+              break;
             default:
               std::cerr << help(argv[0]);
               return;
@@ -228,9 +411,10 @@ struct options3 {
   std::string help(char *prog) {
     valid = false;
     return std::string("Free energy of ferromagnetic Ising model\n") +
-           "Usage: " + prog + " [-p prec] T\n" + "       " + prog +
-           " [-p prec] J T\n" + "       " + prog + " [-p prec] Ja Jb Jc T\n" +
-           "       " + prog + " [-p prec] Ja Jb Jc Tmin Tmax dT\n" +
+           "Usage: " + prog + " [-p prec] [-n threads] T\n" + "       " +
+           prog + " [-p prec] [-n threads] J T\n" + "       " + prog +
+           " [-p prec] [-n threads] Ja Jb Jc T\n" + "       " + prog +
+           " [-p prec] [-n threads] Ja Jb Jc Tmin Tmax dT\n" +
            "Note: T can be specified as \"tc\" instead of real numbers\n";
   }
 };
@@ -24,7 +24,9 @@
 #include "ising/tc/square.hpp"
 #include "options.hpp"
 #include "square.hpp"
+#include "sweep.hpp"
 
+// multiprecision: closed form for Jx == Jy, free energy only otherwise
 template <typename T>
 void calc0(const options2& opt) {
   using namespace ising::free_energy;
@@ -50,13 +52,29 @@ void calc0(const options2& opt) {
             << "# lattice: square\n"
             << "# precision: " << std::numeric_limits<real_t>::digits10
             << std::endl
-            << "# Lx Ly Jx Jy T 1/T F/N E/N C/N\n";
-  for (auto t = Tmin; t < Tmax + 1e-4 * dT; t += dT) {
-    real_t beta = 1 / t;
-    auto f = square::infinite(Jx, Jy, beta);
-    std::cout << "inf inf " << Jx << ' ' << Jy << ' ' << t << ' ' << beta << ' '
-              << f << " N/A N/A" << std::endl;
-  }
+            << "# Lx Ly Jx Jy T 1/T F/N E/N C/N"
+            << (opt.bonds ? " Ex/N Ey/N\n" : "\n");
+  sweep(
+      temperatures(Tmin, Tmax, dT),
+      [&](real_t t, std::ostream& os) {
+        if (Jx == Jy) {
+          auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+          auto f = square::infinite_closed(Jx, Jy, beta);
+          os << "inf inf " << Jx << ' ' << Jy << ' ' << t << ' ' << (1 / t)
+             << ' ' << free_energy(f, beta) << ' ' << energy(f, beta) << ' '
+             << specific_heat(f, beta);
+          // x and y bonds are equivalent
+          if (opt.bonds)
+            os << ' ' << energy(f, beta) / 2 << ' ' << energy(f, beta) / 2;
+          os << std::endl;
+        } else {
+          real_t beta = 1 / t;
+          auto f = square::infinite(Jx, Jy, beta);
+          os << "inf inf " << Jx << ' ' << Jy << ' ' << t << ' ' << beta << ' '
+             << f << " N/A N/A" << (opt.bonds ? " N/A N/A" : "") << std::endl;
+        }
+      },
+      std::cout, opt.threads);
 }
 
 template <typename T>
@@ -84,14 +102,33 @@ void calc(const options2& opt) {
             << "# lattice: square\n"
             << "# precision: " << std::numeric_limits<real_t>::digits10
             << std::endl
-            << "# Lx Ly Jx Jy T 1/T F/N E/N C/N\n";
-  for (auto t = Tmin; t < Tmax + 1e-4 * dT; t += dT) {
-    auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
-    auto f = square::infinite(Jx, Jy, beta);
-    std::cout << "inf inf " << Jx << ' ' << Jy << ' ' << t << ' ' << (1 / t)
-              << ' ' << free_energy(f, beta) << ' ' << energy(f, beta) << ' '
-              << specific_heat(f, beta) << std::endl;
-  }
+            << "# Lx Ly Jx Jy T 1/T F/N E/N C/N"
+            << (opt.bonds ? " Ex/N Ey/N\n" : "\n");
+  sweep(
+      temperatures(Tmin, Tmax, dT),
+      [&](real_t t, std::ostream& os) {
+        if (opt.bonds) {
+          auto vars = boost::math::differentiation::make_ftuple<real_t, 2, 1, 1>(
+              1 / t, Jx, Jy);
+          auto& beta = std::get<0>(vars);
+          auto& jx = std::get<1>(vars);
+          auto& jy = std::get<2>(vars);
+          auto f = square::infinite(jx, jy, beta);
+          os << "inf inf " << Jx << ' ' << Jy << ' ' << t << ' ' << (1 / t)
+             << ' ' << free_energy(f, beta, jx, jy) << ' '
+             << energy(f, beta, jx, jy) << ' '
+             << specific_heat(f, beta, jx, jy) << ' '
+             << energy_x(f, beta, jx, jy) << ' ' << energy_y(f, beta, jx, jy)
+             << std::endl;
+          return;
+        }
+        auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+        auto f = square::infinite(Jx, Jy, beta);
+        os << "inf inf " << Jx << ' ' << Jy << ' ' << t << ' ' << (1 / t)
+           << ' ' << free_energy(f, beta) << ' ' << energy(f, beta) << ' '
+           << specific_heat(f, beta) << std::endl;
+      },
+      std::cout, opt.threads);
 }
 
 int main(int argc, char** argv) {
@@ -18,13 +18,23 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 #include <boost/math/constants/constants.hpp>
 #include <boost/math/differentiation/autodiff.hpp>
-#include <boost/math/quadrature/tanh_sinh.hpp>
 #include <standards/simpson.hpp>
 #include <lattice/graph.hpp>
+#include "exact/parallel.hpp"
+#include "exact/tanh_sinh_cache.hpp"
+#include "ising/counting_kernel.hpp"
+#include "ising/tc/square.hpp"
 #include "common.hpp"
 
 namespace ising {
@@ -33,11 +43,14 @@ namespace square {
 
 namespace {
 
+// FVAR is the common type of Jx, Jy, and beta, any of which may carry
+// derivatives
 template <typename T, typename FVAR>
 struct functor {
   typedef T real_t;
   typedef FVAR fvar_t;
-  functor(real_t Jx, real_t Jy, fvar_t beta) {
+  template <typename A, typename B>
+  functor(const A& Jx, const B& Jy, fvar_t beta) {
     using std::cosh;
     using std::sinh;
     c_ = 1 / (2 * boost::math::constants::pi<real_t>());
@@ -54,11 +67,31 @@ struct functor {
   fvar_t chab_, k_;
 };
 
-template <typename T, std::size_t Order>
-struct functor<T, boost::math::differentiation::detail::fvar<T, Order>> {
+// true if x or any of its derivatives is infinite or NaN
+template <typename T>
+bool overflows(const T& x) {
+  using std::abs;
+  return !(abs(x) <= std::numeric_limits<T>::max());
+}
+
+template <typename U, std::size_t Order>
+bool overflows(const boost::math::differentiation::detail::fvar<U, Order>& x) {
+  for (std::size_t i = 0; i <= Order; ++i)
+    if (overflows(x[i]))
+      return true;
+  return false;
+}
+
+// integrand with derivatives, which diverge at t = 0 at the critical point.
+// There they are replaced by a finite first and a huge second derivative in
+// the outermost variable (beta); U is T itself or, for make_ftuple, the
+// nested fvar of the inner variables (Jx, Jy).
+template <typename T, typename U, std::size_t Order>
+struct functor<T, boost::math::differentiation::detail::fvar<U, Order>> {
   typedef T real_t;
-  typedef boost::math::differentiation::detail::fvar<real_t, Order> fvar_t;
-  functor(real_t Jx, real_t Jy, fvar_t beta) {
+  typedef boost::math::differentiation::detail::fvar<U, Order> fvar_t;
+  template <typename A, typename B>
+  functor(const A& Jx, const B& Jy, fvar_t beta) {
     using std::cosh;
     using std::sinh;
     c_ = 1 / (2 * boost::math::constants::pi<real_t>());
@@ -66,14 +99,14 @@ struct functor<T, boost::math::differentiation::detail::fvar<T, Order>> {
     k_ = 1 / (sinh(2 * beta * Jx) * sinh(2 * beta * Jy));
   }
   fvar_t operator()(real_t t) const {
-    using std::abs;
     using std::cos;
     using std::log;
     using std::sqrt;
-    auto r = sqrt(1 + k_ * k_ - 2 * k_ * cos(2 * t)) / k_;
-    if (abs(r.derivative(1)) > std::numeric_limits<real_t>::max()) {
-      auto x = boost::math::differentiation::make_fvar<real_t, 2>(real_t(0));
-      r = fvar_t(r.derivative(0)) + std::numeric_limits<real_t>::max() * x * x;
+    fvar_t r = sqrt(1 + k_ * k_ - 2 * k_ * cos(2 * t)) / k_;
+    if (overflows(r)) {
+      auto x = boost::math::differentiation::make_fvar<real_t, Order>(real_t(0));
+      r = fvar_t(static_cast<real_t>(r)) +
+          fvar_t(std::numeric_limits<real_t>::max() * x * x);
     }
     return c_ * log(chab_ + r);
   }
@@ -81,67 +114,788 @@ struct functor<T, boost::math::differentiation::detail::fvar<T, Order>> {
   fvar_t chab_, k_;
 };
 
-template <typename T, typename FVAR>
-functor<T, FVAR> func(T Jx, T Jy, FVAR beta) {
-  return functor<T, FVAR>(Jx, Jy, beta);
+template <typename T, typename A, typename B, typename FVAR>
+functor<T, boost::math::differentiation::promote<A, B, FVAR>> func(A Jx, B Jy,
+                                                                    FVAR beta) {
+  return functor<T, boost::math::differentiation::promote<A, B, FVAR>>(
+      Jx, Jy, beta);
+}
+
+// common argument check of the finite-size functions
+template <typename I, typename T, typename V>
+void check_finite(I Lx, I Ly, const T& Jx, const V& Jy) {
+  if (Lx <= 0 || Ly <= 0)
+    throw(std::invalid_argument("Lx and Ly should be positive"));
+  if (Jx <= 0 || Jy <= 0)
+    throw(std::invalid_argument("Jx and Jy should be positive"));
+}
+
+// log(2 cosh(x)), analytic across x = 0
+template <typename U>
+U log_2cosh(const U& x) {
+  if (x < 1 && x > -1)
+    return log(2 * cosh(x));
+  U y = (x > 0) ? x : U(-x);
+  return y + log(1 + exp(-2 * y));
+}
+
+// contribution of gamma_k to the four partial sums of finite().  gamma_0
+// changes sign at the bulk critical point and is passed with its sign; its
+// term of lp2 is log(2 cosh(Lx gamma_0 / 2)) and its term of lp3 is left out
+// and added by finite_logz(), both in a form that is analytic across gamma_0
+// = 0.
+template <typename I, typename U>
+void add_gamma(I Lx, I k, const U& gamma, U& lp0, U& lp1, U& lp2, U& lp3) {
+  if ((k & 1) == 1) {
+    lp0 += (Lx * gamma / 2) + log(1 + exp(-(Lx * gamma)));
+    lp1 += (Lx * gamma / 2) + log(1 - exp(-(Lx * gamma)));
+  } else if (k == 0) {
+    lp2 += log_2cosh(Lx * gamma / 2);
+  } else {
+    lp2 += (Lx * gamma / 2) + log(1 + exp(-(Lx * gamma)));
+    lp3 += (Lx * gamma / 2) + log(1 - exp(-(Lx * gamma)));
+  }
+}
+
+// sums of M partial sums over k = 0, ..., n - 1, where add(k, p) adds the
+// terms of momentum k to p.  The momenta are summed in fixed blocks, which
+// are evaluated in parallel and combined pairwise, so that the result does
+// not depend on the number of threads.
+template <std::size_t M, typename I, typename V, typename F>
+std::array<V, M> sum_blocks(I n, F add) {
+  typedef I int_t;
+  typedef std::array<V, M> partial_t;
+  const int_t block = 4096;
+  partial_t zero;
+  zero.fill(V(0));
+  return exact::parallel::reduce(
+      (n + block - 1) / block, zero,
+      [&](std::size_t i) {
+        partial_t p = zero;
+        int_t kmax = std::min(int_t((i + 1) * block), n);
+        for (int_t k = i * block; k < kmax; ++k)
+          add(k, p);
+        return p;
+      },
+      [](const partial_t& x, const partial_t& y) {
+        partial_t z;
+        for (std::size_t j = 0; j < M; ++j)
+          z[j] = x[j] + y[j];
+        return z;
+      });
+}
+
+// sums of add_gamma() over k = 0, ..., n - 1
+template <typename I, typename F>
+auto sum_gamma(I Lx, I n, F gamma) -> std::array<decltype(gamma(I(0))), 4> {
+  typedef decltype(gamma(I(0))) value_t;
+  return sum_blocks<4, I, value_t>(n, [&](I k, std::array<value_t, 4>& p) {
+    add_gamma(Lx, k, gamma(k), p[0], p[1], p[2], p[3]);
+  });
+}
+
+// weights Z_j exp(-lp0) of the four terms of finite() from its partial
+// sums.  The k = 0 factor of the fourth term, -sign(gamma_0) 2 sinh(Lx
+// |gamma_0| / 2), is evaluated as -2 sinh(Lx gamma_0 / 2) so that its
+// derivatives stay accurate near gamma_0 = 0, i.e., around the bulk critical
+// point.
+template <typename I, typename U, typename V>
+std::array<U, 4> term_weights(I Lx, const V& gamma0, const U& lp0,
+                              const U& lp1, const U& lp2, const U& lp3) {
+  U x = Lx * gamma0 / 2;
+  U w3;
+  if (x < 1 && x > -1) {
+    w3 = -2 * sinh(x) * exp(lp3 - lp0);
+  } else {
+    U y = (x > 0) ? x : U(-x);
+    w3 = exp(y + log(1 - exp(-2 * y)) + lp3 - lp0);
+    if (x > 0)
+      w3 = -w3;
+  }
+  return {{U(1), exp(lp1 - lp0), exp(lp2 - lp0), w3}};
+}
+
+// signs of the four terms of finite() in the boundary-condition sectors of
+// finite_sectors()
+inline const std::array<int, 4>& sector_signs(int s) {
+  static const std::array<int, 4> signs[4] = {
+      {{1, 1, 1, 1}}, {{1, -1, 1, -1}}, {{1, 1, -1, -1}}, {{-1, 1, 1, -1}}};
+  return signs[s];
+}
+
+// log Z / (Lx Ly) from the partial sums of finite().  The signs of the four
+// terms select the boundary conditions (see sector_signs()).
+template <typename I, typename U, typename V>
+U finite_logz(I Lx, I Ly, const U& a, const V& gamma0, const U& lp0,
+              const U& lp1, const U& lp2, const U& lp3,
+              const std::array<int, 4>& sign = {{1, 1, 1, 1}}) {
+  typedef typename boost::math::differentiation::detail::get_root_type<U>::type
+      real_t;
+  auto logZ =
+      -log(real_t(2)) / (Lx * Ly) + a + real_t(1) / 2 * log(1 - exp(-4 * a));
+  auto w = term_weights(Lx, gamma0, lp0, lp1, lp2, lp3);
+  logZ += (lp0 + log(sign[0] * w[0] + sign[1] * w[1] + sign[2] * w[2] +
+                     sign[3] * w[3])) /
+          (Lx * Ly);
+  return logZ;
+}
+
+// log(1 + r) for |r| <= 1/2 as 2 atanh(r / (2 + r)) by its power series,
+// which keeps the relative precision of r for any U, including fvar
+template <typename U>
+U log1p_series(const U& r) {
+  using std::abs;
+  typedef typename boost::math::differentiation::detail::get_root_type<U>::type
+      real_t;
+  const real_t eps = std::numeric_limits<real_t>::epsilon();
+  U z = r / (2 + r);
+  U z2 = z * z;
+  U p = z;
+  U sum = z;
+  for (int k = 1; k < 1024; ++k) {
+    p *= z2;
+    U term = p / (2 * k + 1);
+    sum += term;
+    if (abs(term) <= eps * abs(sum))
+      break;
+  }
+  return 2 * sum;
+}
+
+// exp(x) - 1 for |x| <= 1/2 by its power series, for the same reason
+template <typename U>
+U expm1_series(const U& x) {
+  using std::abs;
+  typedef typename boost::math::differentiation::detail::get_root_type<U>::type
+      real_t;
+  const real_t eps = std::numeric_limits<real_t>::epsilon();
+  U term = x;
+  U sum = x;
+  for (int k = 2; k < 1024; ++k) {
+    term *= x / k;
+    sum += term;
+    if (abs(term) <= eps * abs(sum))
+      break;
+  }
+  return sum;
+}
+
+// gamma_0 and the partial sums of finite() for the sector functions,
+// followed by lp0 - lp1 and lp2 - lp3 (without k = 0).  The latter two are
+// summed directly from 2 atanh(exp(-Lx gamma_k)) so that they keep their
+// relative precision where they are exponentially small.
+template <typename I, typename T, typename U>
+std::array<U, 6> sector_sums(I Lx, I Ly, T Jx, T Jy, const U& beta,
+                             U& gamma0) {
+  typedef I int_t;
+  typedef T real_t;
+  real_t pi = boost::math::constants::pi<real_t>();
+  U a = beta * Jx;
+  U b = beta * Jy;
+  gamma0 = log((1 + cosh(2 * a)) / sinh(2 * a)) - 2 * b;
+  U g0 = gamma0;
+  return sum_blocks<6, int_t, U>(2 * Ly, [&](int_t k, std::array<U, 6>& p) {
+    if (k == 0) {
+      add_gamma(Lx, k, g0, p[0], p[1], p[2], p[3]);
+      return;
+    }
+    auto cosh_g = (cosh(2 * a) * cosh(2 * b) - cos(pi * k / Ly) * sinh(2 * b)) /
+                  sinh(2 * a);
+    U gamma = log(cosh_g + sqrt(cosh_g * cosh_g - 1));
+    add_gamma(Lx, k, gamma, p[0], p[1], p[2], p[3]);
+    U q = exp(-(Lx * gamma));
+    U t = 2 * q / (1 - q);
+    p[(k & 1) ? 4 : 5] += (t < 0.5) ? log1p_series(t) : log(1 + t);
+  });
+}
+
+// ratios of the sector sums to Z_0: Z_s / Z_0 for s = 1, 2, 3, followed by
+// Z_2 / Z_0 - 1 and (Z_3 - Z_1) / Z_0 evaluated without cancellation.  Both
+// involve only terms of the same parity of k,
+//   Z_2 - Z_0 = -2 w2 (1 - tanh(x) + tanh(x) (1 - exp(-(lp2 - lp3)))),
+//   Z_3 - Z_1 = -2 (1 - exp(-(lp0 - lp1))),
+// in units of exp(lp0) with x = Lx gamma_0 / 2.
+template <typename I, typename T, typename U>
+std::array<U, 5> sector_ratios(I Lx, I Ly, T Jx, T Jy, const U& beta) {
+  typedef U value_t;
+  value_t gamma0;
+  auto lp = sector_sums(Lx, Ly, Jx, Jy, beta, gamma0);
+  auto w = term_weights(Lx, gamma0, lp[0], lp[1], lp[2], lp[3]);
+  value_t W0 = w[0] + w[1] + w[2] + w[3];
+  std::array<value_t, 5> res;
+  for (int s = 1; s < 4; ++s) {
+    value_t Ws(0);
+    for (int j = 0; j < 4; ++j)
+      Ws += sector_signs(s)[j] * w[j];
+    res[s - 1] = Ws / W0;
+  }
+  value_t x = Lx * gamma0 / 2;
+  value_t th = tanh(x);
+  value_t one_minus_th =
+      (x > 0) ? value_t(2 * exp(-2 * x) / (1 + exp(-2 * x)))
+              : value_t(2 / (1 + exp(2 * x)));
+  value_t e23 = (lp[5] < 0.5) ? expm1_series(value_t(-lp[5]))
+                              : value_t(exp(-lp[5]) - 1);
+  value_t e01 = (lp[4] < 0.5) ? expm1_series(value_t(-lp[4]))
+                              : value_t(exp(-lp[4]) - 1);
+  res[3] = -2 * w[2] * (one_minus_th - th * e23) / W0;
+  res[4] = 2 * e01 / W0;
+  return res;
+}
+
+// complete elliptic integrals of the first and second kinds, K(k) and E(k), by
+// the arithmetic-geometric mean; kp = sqrt(1 - k^2) is passed explicitly to
+// avoid cancellation near k = 1
+template <typename T>
+void elliptic_ke(T k, T kp, T& K, T& E) {
+  using std::abs;
+  using std::sqrt;
+  typedef T real_t;
+  real_t eps = std::numeric_limits<real_t>::epsilon();
+  real_t a(1), b = kp, c = k;
+  real_t sum = c * c / 2, p(1);
+  for (int n = 0; n < 64 && abs(c) > eps * a; ++n) {
+    real_t an = (a + b) / 2;
+    c = (a - b) / 2;
+    b = sqrt(a * b);
+    a = an;
+    p *= 2;
+    sum += p * c * c / 2;
+  }
+  K = boost::math::constants::pi<real_t>() / (2 * a);
+  E = K * (1 - sum);
+}
+
+// G(k) = (1/2pi) int_0^pi log[(1 + sqrt(1 - k^2 sin^2 t)) / 2] dt, the
+// non-trivial part of Onsager's free energy, without quadrature.  Since
+// dG/dk = -((2/pi) K(k) - 1) / 2k, the power series of K(k) in k (for k^2 <=
+// 1/2) or in kp (otherwise, starting from G(1) = 2 C / pi - log 2 with Catalan's
+// constant C) is integrated term by term.  Both converge at least as 2^{-n}.
+template <typename T>
+T onsager_g(T k, T kp) {
+  using std::abs;
+  using std::log;
+  typedef T real_t;
+  const int max_n = 1 << 16;
+  real_t eps = std::numeric_limits<real_t>::epsilon();
+  real_t pi = boost::math::constants::pi<real_t>();
+  real_t h(0);
+  if (k * k <= real_t(1) / 2) {
+    // h(k) = sum_{n>=1} a_n^2 k^{2n} / 2n, a_n = (1/2)_n / n!
+    real_t a(1), x2 = k * k, xp(1);
+    for (int n = 1; n < max_n; ++n) {
+      a *= real_t(2 * n - 1) / (2 * n);
+      xp *= x2;
+      real_t term = a * a * xp / (2 * n);
+      h += term;
+      if (term <= eps * h) break;
+    }
+  } else {
+    // h(k) = h(1) - sum_m X^p / p [P_m (log(1/X) + 1/p) + P_m log 4 - Q_m - 1]
+    // with X = kp, p = 2m + 2, P_m = sum_{n<=m} (2/pi) a_n^2,
+    // Q_m = sum_{n<=m} (2/pi) a_n^2 d_n, d_n = sum_{j<=n} 2 / ((2j-1) 2j)
+    h = 2 * log(real_t(2)) - 4 * boost::math::constants::catalan<real_t>() / pi;
+    if (kp > 0) {
+      real_t lx = -log(kp), l4 = 2 * log(real_t(2));
+      real_t a(1), d(0), P = 2 / pi, Q(0), x2 = kp * kp, xp(1);
+      real_t r(0);
+      for (int m = 0; m < max_n; ++m) {
+        if (m > 0) {
+          a *= real_t(2 * m - 1) / (2 * m);
+          d += real_t(2) / ((2 * m - 1) * (2 * m));
+          P += 2 / pi * a * a;
+          Q += 2 / pi * a * a * d;
+        }
+        xp *= x2;
+        int p = 2 * m + 2;
+        real_t term = xp / p * (P * (lx + real_t(1) / p) + P * l4 - Q - 1);
+        r += term;
+        if (abs(term) <= eps * abs(r)) break;
+      }
+      h -= r;
+    }
+  }
+  return -h / 2;
+}
+
+template <typename T>
+T closed_value(T x) {
+  return x;
+}
+
+template <typename T, std::size_t Order>
+T closed_value(const boost::math::differentiation::detail::fvar<T, Order>& x) {
+  return x.derivative(0);
+}
+
+template <typename T>
+T closed_taylor(T f0, T, T, T) {
+  return f0;
+}
+
+template <typename T, std::size_t Order>
+boost::math::differentiation::detail::fvar<T, Order> closed_taylor(
+    T f0, T f1, T f2,
+    const boost::math::differentiation::detail::fvar<T, Order>& beta) {
+  static_assert(Order <= 2,
+                "infinite_closed provides derivatives up to second order");
+  auto db = beta - beta.derivative(0);
+  return f0 + db * (f1 + db * (f2 / 2));
 }
 
 }  // namespace
 
+// Jx and Jy may be independent variables of make_ftuple together with beta,
+// giving the bond energies by differentiation (see energy_x, energy_y)
+template <typename T, typename V, typename U>
+inline boost::math::differentiation::promote<T, V, U> infinite(T Jx, V Jy,
+                                                               U beta) {
+  typedef boost::math::differentiation::promote<T, V, U> value_t;
+  typedef typename boost::math::differentiation::detail::get_root_type<
+      value_t>::type real_t;
+  if (Jx <= 0 || Jy <= 0)
+    throw(std::invalid_argument("Jx and Jy should be positive"));
+  if (beta <= 0)
+    throw(std::invalid_argument("beta should be positive"));
+  real_t pi = boost::math::constants::pi<real_t>();
+  auto& integrator = exact::tanh_sinh_cache::shared<real_t>();
+  value_t logZ = log(real_t(2)) / 2 +
+                 2 * integrator.integrate(func<real_t>(Jx, Jy, beta),
+                                          real_t(0), pi / 2);
+  return -logZ / beta;
+}
+
+// Onsager's solution in closed form for the isotropic lattice.  Energy and
+// specific heat are given by the complete elliptic integrals K(k) and E(k)
+// with k = 2 sinh(2K) / cosh^2(2K), evaluated by the arithmetic-geometric
+// mean at any precision, and the free energy by the series in onsager_g.  No
+// quadrature is involved.  Derivatives up to second order are supported.
 template <typename T, typename U>
-inline U infinite(T Jx, T Jy, U beta) {
-  const unsigned long max_n = 1 << 16;
+inline U infinite_closed(T Jx, T Jy, U beta) {
   typedef T real_t;
+  using std::abs;
+  using std::cosh;
+  using std::log;
+  using std::sinh;
+  using std::tanh;
   if (Jx <= 0 || Jy <= 0)
     throw(std::invalid_argument("Jx and Jy should be positive"));
+  if (Jx != Jy)
+    throw(std::invalid_argument("infinite_closed requires Jx == Jy"));
   if (beta <= 0)
     throw(std::invalid_argument("beta should be positive"));
   real_t pi = boost::math::constants::pi<real_t>();
-  boost::math::quadrature::tanh_sinh<real_t> integrator;
-  auto logZ = log(real_t(2)) / 2 +
-              2 * integrator.integrate(func(Jx, Jy, beta), 0, pi / 2);
+  real_t J = Jx;
+  real_t b = closed_value(beta);
+  real_t K = b * J;
+  real_t ch = cosh(2 * K);
+  real_t th = tanh(2 * K);
+  real_t k = 2 * sinh(2 * K) / (ch * ch);
+  real_t d = 2 * th * th - 1;  // kp = |d|
+  real_t kp = abs(d);
+
+  real_t logZ = log(2 * ch) + onsager_g(k, kp);
+  real_t f = -logZ / b;
+
+  real_t e, c;
+  if (kp == 0) {
+    e = -J / th;
+    c = std::numeric_limits<real_t>::infinity();
+  } else {
+    real_t Kk, Ek;
+    elliptic_ke(k, kp, Kk, Ek);
+    e = -J / th * (1 + 2 / pi * d * Kk);
+    c = 4 / pi * (K / th) * (K / th) *
+        (Kk - Ek - (1 - th * th) * (pi / 2 + d * Kk));
+  }
+  real_t f1 = (e - f) / b;
+  real_t f2 = (-c / (b * b) - 2 * f1) / b;
+  return closed_taylor(f, f1, f2, beta);
+}
+
+// Jx and Jy may carry derivatives as for infinite()
+template <typename I, typename T, typename V, typename U>
+inline boost::math::differentiation::promote<T, V, U> finite(I Lx, I Ly, T Jx,
+                                                             V Jy, U beta) {
+  typedef I int_t;
+  typedef boost::math::differentiation::promote<T, V, U> value_t;
+  typedef typename boost::math::differentiation::detail::get_root_type<
+      value_t>::type real_t;
+  check_finite(Lx, Ly, Jx, Jy);
+  real_t pi = boost::math::constants::pi<real_t>();
+  value_t a = beta * Jx;
+  value_t b = beta * Jy;
+  auto gamma0 = log((1 + cosh(2 * a)) / sinh(2 * a)) - 2 * b;
+  auto lp = sum_gamma(Lx, 2 * Ly, [&](int_t k) {
+    auto cosh_g = (cosh(2 * a) * cosh(2 * b) - cos(pi * k / Ly) * sinh(2 * b)) /
+                  sinh(2 * a);
+    return value_t((k == 0) ? gamma0
+                            : log(cosh_g + sqrt(cosh_g * cosh_g - 1)));
+  });
+  auto logZ = finite_logz(Lx, Ly, a, gamma0, lp[0], lp[1], lp[2], lp[3]);
   return -logZ / beta;
 }
 
+// Free energies per site of the four boundary-condition sectors of the
+// Lx x Ly torus from a single momentum sum.  Index bit 0 (bit 1) selects
+// antiperiodic boundary conditions for the Jy (Jx) bonds across the seam in
+// y (x) direction, i.e., 0: periodic, 1: antiperiodic in y, 2: antiperiodic
+// in x, 3: antiperiodic in both.  For the interface free energies use
+// finite_interfaces() rather than the differences of these.
+template <typename I, typename T, typename U>
+inline std::array<U, 4> finite_sectors(I Lx, I Ly, T Jx, T Jy, U beta) {
+  typedef U value_t;
+  check_finite(Lx, Ly, Jx, Jy);
+  value_t gamma0;
+  auto lp = sector_sums(Lx, Ly, Jx, Jy, beta, gamma0);
+  value_t a = beta * Jx;
+  std::array<value_t, 4> res;
+  for (int s = 0; s < 4; ++s)
+    res[s] = -finite_logz(Lx, Ly, a, gamma0, lp[0], lp[1], lp[2], lp[3],
+                          sector_signs(s)) /
+             beta;
+  return res;
+}
+
+// Interface free energies -T log(Z_s / Z_0) of the sectors s = 1, 2, 3 of
+// finite_sectors().  They are exponentially small in L above Tc and grow
+// as the interface tension times L below Tc.  They are taken from the ratios
+// of the sector sums, not from the difference of two log Z of order N.
+// Where Z_s / Z_0 is close to one, Z_s / Z_0 - 1 is assembled from sums of
+// a single parity of k (see sector_ratios()), those of sector 1 from sector
+// 2 of the transposed lattice, so that it keeps its relative precision.
+template <typename I, typename T, typename U>
+inline std::array<U, 3> finite_interfaces(I Lx, I Ly, T Jx, T Jy, U beta) {
+  typedef U value_t;
+  check_finite(Lx, Ly, Jx, Jy);
+  auto p = sector_ratios(Lx, Ly, Jx, Jy, beta);
+  auto q = sector_ratios(Ly, Lx, Jy, Jx, beta);
+  std::array<value_t, 3> r = {{q[3], p[3], q[3] + p[4]}};
+  std::array<value_t, 3> res;
+  for (int s = 0; s < 3; ++s)
+    res[s] = -((r[s] < 0.5 && r[s] > -0.5) ? log1p_series(r[s]) : log(p[s])) /
+             beta;
+  return res;
+}
+
+// finite() for large lattices.  Away from the critical point the momentum
+// sums are periodic trapezoidal sums of gamma(theta), analytic in the strip
+// |Im theta| < eta with cosh(eta) = (ch2a ch2b - sh2a) / sh2b, and
+// log(1 +- exp(-Lx gamma)) is bounded by exp(-Lx |gamma_0|).  Then
+//   log Z / N = a + log(1 - exp(-4a)) / 2 + G / 2 + (gamma_0 < 0 ? log 2 / N : 0)
+// up to exponentially small terms, where G is the mean of gamma over theta,
+// evaluated by a trapezoidal rule with O(1/eta) points.  This is used if the
+// estimated error (including that of the beta-derivatives) is below tol;
+// otherwise the exact sum of finite() is returned.  asymptotic reports which
+// of the two was taken.  The power-law corrections of the critical window
+// (Ferdinand-Fisher) are not expanded; the exact sum is used there.
 template <typename I, typename T, typename U>
-inline U finite(I Lx, I Ly, T Jx, T Jy, U beta) {
+inline U finite_asymptotic(I Lx, I Ly, T Jx, T Jy, U beta, T tol,
+                           bool& asymptotic) {
   typedef I int_t;
   typedef T real_t;
   typedef U value_t;
-  if (Lx <= 0 || Ly <= 0)
-    throw(std::invalid_argument("Lx and Ly should be positive"));
-  if (Jx <= 0 || Jy <= 0)
-    throw(std::invalid_argument("Jx and Jy should be positive"));
+  using std::abs;
+  using std::ceil;
+  using std::cosh;
+  using std::exp;
+  using std::log;
+  using std::max;
+  using std::sinh;
+  using std::sqrt;
+  check_finite(Lx, Ly, Jx, Jy);
+  asymptotic = false;
+  real_t pi = boost::math::constants::pi<real_t>();
+  real_t N = real_t(Lx) * Ly;
+  real_t b0 = closed_value(beta);
+  real_t ch2a = cosh(2 * b0 * Jx), sh2a = sinh(2 * b0 * Jx);
+  real_t ch2b = cosh(2 * b0 * Jy), sh2b = sinh(2 * b0 * Jy);
+  real_t g0 = log((1 + ch2a) / sh2a) - 2 * b0 * Jy;
+  real_t g01 = -2 * Jx / sh2a - 2 * Jy;
+  real_t rho = (ch2a * ch2b - sh2a) / sh2b;
+  if (g0 != 0 && rho > 1) {
+    real_t eta = log(rho + sqrt(rho * rho - 1));
+    real_t rho1 = (2 * Jx * (sh2a * ch2b - ch2a) + 2 * Jy * ch2a * sh2b -
+                   2 * Jy * rho * ch2b) /
+                  sh2b;
+    real_t eta1 = rho1 / sqrt(rho * rho - 1);
+    real_t q = 1 + b0 * max(Lx * abs(g01), Ly * abs(eta1));
+    q *= q;
+    real_t xt = exp(-(Ly * eta));
+    real_t err = 4 * xt / (1 - xt) + 8 * exp(-(Lx * abs(g0))) / Lx;
+    if (N * err < 1 && q * err < tol) {
+      // M-point trapezoidal rule for G with error 4 exp(-M eta) < tol / 10
+      real_t m = ceil(log(40 * q / tol) / eta);
+      if (m < Ly) {
+        int_t M = int_t(m);
+        auto a = beta * Jx;
+        auto b = beta * Jy;
+        auto ch2ab = cosh(2 * a) * cosh(2 * b);
+        auto sh2av = sinh(2 * a);
+        auto sh2bv = sinh(2 * b);
+        value_t G(0);
+        for (int_t j = 0; j < M; ++j) {
+          auto cosh_g = (ch2ab - cos(pi * (2 * j + 1) / M) * sh2bv) / sh2av;
+          G += log(cosh_g + sqrt(cosh_g * cosh_g - 1));
+        }
+        G /= M;
+        auto logZ = a + real_t(1) / 2 * log(1 - exp(-4 * a)) + G / 2;
+        if (g0 < 0)
+          logZ += log(real_t(2)) / N;
+        asymptotic = true;
+        return -logZ / beta;
+      }
+    }
+  }
+  return finite(Lx, Ly, Jx, Jy, beta);
+}
+
+// Specific-heat maximum of the Lx x Ly lattice.  dC/dbeta = 0 is solved by
+// Newton's method on the derivatives of finite() up to fourth order,
+// safeguarded by bisection inside a bracket grown from the bulk critical
+// point.  Returns the temperature of the peak; C/N and d^2(C/N)/dT^2 there
+// are stored in c and c2.
+template <typename I, typename T>
+inline T finite_peak(I Lx, I Ly, T Jx, T Jy, T& c, T& c2) {
+  typedef T real_t;
+  using std::abs;
+  check_finite(Lx, Ly, Jx, Jy);
+  const int max_iter = 200;
+  const real_t eps = std::numeric_limits<real_t>::epsilon();
+  // C / N, dC/dbeta, and d^2C/dbeta^2 from phi = log Z / N = -beta f
+  auto eval = [&](real_t b, real_t& cv, real_t& dc, real_t& ddc) {
+    auto beta = boost::math::differentiation::make_fvar<real_t, 4>(b);
+    auto phi = -beta * finite(Lx, Ly, Jx, Jy, beta);
+    real_t p2 = phi.derivative(2);
+    real_t p3 = phi.derivative(3);
+    real_t p4 = phi.derivative(4);
+    cv = b * b * p2;
+    dc = 2 * b * p2 + b * b * p3;
+    ddc = 2 * p2 + 4 * b * p3 + b * b * p4;
+  };
+  real_t lo, hi, glo, ghi, cb, gb, hb;
+  real_t b = 1 / ising::tc::square(Jx, Jy);
+  eval(b, cb, gb, hb);
+  lo = hi = b;
+  glo = ghi = gb;
+  const real_t factor = real_t(21) / 20;
+  for (int i = 0; glo <= 0 || ghi >= 0; ++i) {
+    if (i == max_iter)
+      throw(std::runtime_error("specific heat peak not bracketed"));
+    real_t cx, hx;
+    if (ghi > 0) {
+      lo = hi;
+      glo = ghi;
+      hi *= factor;
+      eval(hi, cx, ghi, hx);
+    } else {
+      hi = lo;
+      ghi = glo;
+      lo /= factor;
+      eval(lo, cx, glo, hx);
+    }
+  }
+  for (int i = 0; i < max_iter; ++i) {
+    if (gb > 0) {
+      lo = b;
+    } else if (gb < 0) {
+      hi = b;
+    } else {
+      break;
+    }
+    real_t next = b - gb / hb;
+    if (!(hb < 0) || !(next > lo && next < hi))
+      next = (lo + hi) / 2;
+    bool done = abs(next - b) <= 4 * eps * b || hi - lo <= 4 * eps * b;
+    b = next;
+    eval(b, cb, gb, hb);
+    if (done)
+      break;
+  }
+  // d^2C/dT^2 = beta^4 d^2C/dbeta^2 + 2 beta^3 dC/dbeta
+  c = cb;
+  c2 = b * b * b * (b * hb + 2 * gb);
+  return 1 / b;
+}
+
+// finite() for a series of L x L lattices at once.  The gamma_k are
+// tabulated on the momentum grid of the largest size and reused for every L
+// that divides it (the grid for L is a subset of that for 2L); the table is
+// rebuilt only when a size does not fit on the current grid.
+template <typename I, typename T, typename U>
+inline std::vector<U> finite_series(const std::vector<I>& Ls, T Jx, T Jy,
+                                    U beta) {
+  typedef I int_t;
+  typedef T real_t;
+  typedef U value_t;
+  for (auto L : Ls)
+    check_finite(L, L, Jx, Jy);
   real_t pi = boost::math::constants::pi<real_t>();
   auto a = beta * Jx;
   auto b = beta * Jy;
-  value_t lp0(0), lp1(0), lp2(0), lp3(0);
   auto gamma0 = log((1 + cosh(2 * a)) / sinh(2 * a)) - 2 * b;
-  for (int_t k = 0; k < 2 * Ly; ++k) {
-    auto cosh_g = (cosh(2 * a) * cosh(2 * b) - cos(pi * k / Ly) * sinh(2 * b)) /
-                  sinh(2 * a);
-    auto gamma =
-        (k == 0) ? abs(gamma0) : (log(cosh_g + sqrt(cosh_g * cosh_g - 1)));
-    if ((k & 1) == 1) {
-      lp0 += (Lx * gamma / 2) + log(1 + exp(-(Lx * gamma)));
-      lp1 += (Lx * gamma / 2) + log(1 - exp(-(Lx * gamma)));
-    } else {
-      lp2 += (Lx * gamma / 2) + log(1 + exp(-(Lx * gamma)));
-      lp3 += (Lx * gamma / 2) + log(1 - exp(-(Lx * gamma)));
+  auto ch2ab = cosh(2 * a) * cosh(2 * b);
+  auto sh2a = sinh(2 * a);
+  auto sh2b = sinh(2 * b);
+
+  std::vector<std::size_t> order(Ls.size());
+  for (std::size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [&](std::size_t i, std::size_t j) { return Ls[i] > Ls[j]; });
+  std::vector<value_t> res(Ls.size());
+  std::vector<value_t> gamma;
+  int_t M = 0;
+  for (auto i : order) {
+    int_t L = Ls[i];
+    if (M == 0 || M % L != 0) {
+      M = L;
+      gamma.resize(2 * M);
+      for (int_t k = 1; k < 2 * M; ++k) {
+        auto cosh_g = (ch2ab - cos(pi * k / M) * sh2b) / sh2a;
+        gamma[k] = log(cosh_g + sqrt(cosh_g * cosh_g - 1));
+      }
     }
+    int_t stride = M / L;
+    auto lp = sum_gamma(L, 2 * L, [&](int_t k) {
+      return (k == 0) ? value_t(gamma0) : gamma[k * stride];
+    });
+    res[i] = -finite_logz(L, L, a, gamma0, lp[0], lp[1], lp[2], lp[3]) / beta;
   }
-  auto logZ =
-      -log(real_t(2)) / (Lx * Ly) + a + real_t(1) / 2 * log(1 - exp(-4 * a));
-  if (gamma0 > 0) {
-    logZ += (lp0 + log(1 + exp(lp1 - lp0) + exp(lp2 - lp0) - exp(lp3 - lp0))) /
-            (Lx * Ly);
-  } else if (gamma0 < 0) {
-    logZ += (lp0 + log(1 + exp(lp1 - lp0) + exp(lp2 - lp0) + exp(lp3 - lp0))) /
-            (Lx * Ly);
-  } else {
-    logZ += (lp0 + log(1 + exp(lp1 - lp0) + exp(lp2 - lp0))) / (Lx * Ly);
+  return res;
+}
+
+// Batched version of finite() for many temperatures at once.  Free energy f,
+// energy e, and specific heat c per site are returned for each beta[i].  The
+// first and second beta-derivatives of gamma_k are evaluated explicitly
+// instead of by automatic differentiation.  As in finite(), the k = 0 terms
+// are log(2 cosh(x)) and -2 sinh(x) with x = Lx gamma_0 / 2, written through
+// exp(-2 |x|) so that they and their derivatives are smooth across gamma_0 =
+// 0 and do not overflow.  The temperatures are processed in groups of
+// batch_lanes, held in local arrays; the inner loops run over the lanes of a
+// group without branches.  They are vectorized where the compiler has vector
+// versions of exp, log, and sqrt (e.g., GCC and glibc with -O3 -ffast-math).
+template <typename I, typename T>
+inline void finite_batch(I Lx, I Ly, T Jx, T Jy, const std::vector<T>& beta,
+                         std::vector<T>& f, std::vector<T>& e,
+                         std::vector<T>& c) {
+  typedef I int_t;
+  typedef T real_t;
+  const std::size_t batch_lanes = 8;
+  check_finite(Lx, Ly, Jx, Jy);
+  for (auto b : beta)
+    if (b <= 0)
+      throw(std::invalid_argument("beta should be positive"));
+  const std::size_t n = beta.size();
+  const real_t pi = boost::math::constants::pi<real_t>();
+  const real_t N = real_t(Lx) * Ly;
+  const real_t hl = real_t(Lx) / 2;
+  f.resize(n);
+  e.resize(n);
+  c.resize(n);
+  for (std::size_t i0 = 0; i0 < n; i0 += batch_lanes) {
+    // the last group is padded with the last temperature
+    real_t bt[batch_lanes], cha[batch_lanes], sha[batch_lanes],
+        chb[batch_lanes], shb[batch_lanes];
+    real_t x0[batch_lanes], x01[batch_lanes], x02[batch_lanes];
+    real_t lp[4][batch_lanes], lp1[4][batch_lanes], lp2[4][batch_lanes];
+    for (std::size_t l = 0; l < batch_lanes; ++l) {
+      bt[l] = beta[std::min(i0 + l, n - 1)];
+      cha[l] = std::cosh(2 * bt[l] * Jx);
+      sha[l] = std::sinh(2 * bt[l] * Jx);
+      chb[l] = std::cosh(2 * bt[l] * Jy);
+      shb[l] = std::sinh(2 * bt[l] * Jy);
+      for (int j = 0; j < 4; ++j)
+        lp[j][l] = lp1[j][l] = lp2[j][l] = 0;
+    }
+
+    // k = 0: x = Lx gamma_0 / 2 with gamma_0 = log(coth(a)) - 2b, which
+    // changes sign at Tc; log(2 cosh(x)) goes to lp2
+    for (std::size_t l = 0; l < batch_lanes; ++l) {
+      real_t g0 = std::log((1 + cha[l]) / sha[l]) - 2 * bt[l] * Jy;
+      real_t g01 = -2 * Jx / sha[l] - 2 * Jy;
+      real_t g02 = 4 * Jx * Jx * cha[l] / (sha[l] * sha[l]);
+      real_t x = hl * g0, x1 = hl * g01, x2 = hl * g02;
+      real_t th = std::tanh(x);
+      x0[l] = x;
+      x01[l] = x1;
+      x02[l] = x2;
+      lp[2][l] = std::abs(x) + std::log1p(std::exp(-2 * std::abs(x)));
+      lp1[2][l] = th * x1;
+      lp2[2][l] = (1 - th * th) * x1 * x1 + th * x2;
+    }
+    // k > 0: cosh(gamma_k) = X = (ch2a ch2b - cos(pi k / Ly) sh2b) / sh2a,
+    // and u(g) = Lx g / 2 + log(1 +- exp(-Lx g)) with gamma_k > 0 goes to
+    // lp[p] and lp[p + 1]
+    for (int_t k = 1; k < 2 * Ly; ++k) {
+      const real_t ck = std::cos(pi * k / Ly);
+      const int p = ((k & 1) == 1) ? 0 : 2;
+      for (std::size_t l = 0; l < batch_lanes; ++l) {
+        real_t nm = cha[l] * chb[l] - ck * shb[l];
+        real_t nm1 = 2 * Jx * sha[l] * chb[l] +
+                     2 * Jy * (cha[l] * shb[l] - ck * chb[l]);
+        real_t nm2 = 4 * (Jx * Jx + Jy * Jy) * cha[l] * chb[l] +
+                     8 * Jx * Jy * sha[l] * shb[l] - 4 * Jy * Jy * ck * shb[l];
+        real_t x = nm / sha[l];
+        real_t x1 = (nm1 - 2 * Jx * cha[l] * x) / sha[l];
+        real_t x2 = (nm2 - 4 * Jx * cha[l] * x1 - 4 * Jx * Jx * sha[l] * x) /
+                    sha[l];
+        real_t sq = std::sqrt(x * x - 1);
+        real_t g = std::log(x + sq);
+        real_t g1 = x1 / sq;
+        real_t g2 = (x2 - x * g1 * g1) / sq;
+        real_t q = std::exp(-(Lx * g));
+        real_t mq = -std::expm1(-(Lx * g));  // 1 - q
+        real_t tp = mq / (1 + q);            // tanh(Lx g / 2)
+        real_t tm = (1 + q) / mq;            // coth(Lx g / 2)
+        lp[p][l] += hl * g + std::log1p(q);
+        lp1[p][l] += hl * tp * g1;
+        lp2[p][l] += hl * hl * (1 - tp * tp) * g1 * g1 + hl * tp * g2;
+        lp[p + 1][l] += hl * g + std::log(mq);
+        lp1[p + 1][l] += hl * tm * g1;
+        lp2[p + 1][l] += hl * hl * (1 - tm * tm) * g1 * g1 + hl * tm * g2;
+      }
+    }
+
+    real_t ft[batch_lanes], et[batch_lanes], ct[batch_lanes];
+    for (std::size_t l = 0; l < batch_lanes; ++l) {
+      // Z_j exp(-lp0) and its first and second derivatives summed over the
+      // sectors; Z_3 carries the k = 0 factor -2 sinh(x) = -exp(|x|) sh with
+      // sh = sign(x) (1 - exp(-2 |x|)) and ch = 1 + exp(-2 |x|)
+      real_t W(0), W1(0), W2(0);
+      for (int j = 0; j < 3; ++j) {
+        real_t w = std::exp(lp[j][l] - lp[0][l]);
+        W += w;
+        W1 += w * lp1[j][l];
+        W2 += w * (lp2[j][l] + lp1[j][l] * lp1[j][l]);
+      }
+      real_t x = x0[l], x1 = x01[l], x2 = x02[l];
+      real_t ax = std::abs(x);
+      real_t sh = std::copysign(-std::expm1(-2 * ax), x);
+      real_t ch = 1 + std::exp(-2 * ax);
+      real_t r = std::exp(lp[3][l] - lp[0][l] + ax);
+      real_t l1 = lp1[3][l], l2 = lp2[3][l];
+      W -= r * sh;
+      W1 -= r * (sh * l1 + ch * x1);
+      W2 -= r * (sh * (l2 + l1 * l1 + x1 * x1) + ch * (2 * x1 * l1 + x2));
+      real_t L1 = W1 / W;
+      real_t L2 = W2 / W - L1 * L1;
+      real_t a = bt[l] * Jx;
+      real_t qa = std::exp(-4 * a);
+      real_t phi = -std::log(real_t(2)) / N + a + std::log1p(-qa) / 2 +
+                   (lp[0][l] + std::log(W)) / N;
+      real_t phi1 = Jx + 2 * Jx * qa / (1 - qa) + L1 / N;
+      real_t phi2 = -8 * Jx * Jx * qa / ((1 - qa) * (1 - qa)) + L2 / N;
+      ft[l] = -phi / bt[l];
+      et[l] = -phi1;
+      ct[l] = bt[l] * bt[l] * phi2;
+    }
+    for (std::size_t l = 0; l < batch_lanes && i0 + l < n; ++l) {
+      f[i0 + l] = ft[l];
+      e[i0 + l] = et[l];
+      c[i0 + l] = ct[l];
+    }
   }
-  return -logZ / beta;
 }
 
 template <typename T, typename I>
@@ -167,43 +921,154 @@ inline T finite_tc(I Lx, I Ly) {
   return -logZ / beta;
 }
 
-template <typename I, typename T, typename U, typename W>
-inline boost::math::differentiation::promote<U, W> finite_count(I Lx, I Ly,
-                                                                T Jx, T Jy,
-                                                                U beta, W h) {
-  typedef I int_t;
-  typedef T real_t;
-  typedef boost::math::differentiation::promote<U, W> value_t;
+// Joint histogram of the number of unsatisfied x bonds, unsatisfied y bonds,
+// and up spins over all 2^N states of the periodic Lx x Ly lattice.  Only
+// the nonzero entries are kept.
+struct count_histogram {
+  struct entry {
+    unsigned nx, ny, up;
+    std::uint64_t count;
+  };
+  unsigned num_sites, num_bonds_x, num_bonds_y;
+  std::vector<entry> entries;
+};
+
+namespace {
+
+inline unsigned trailing_zeros(std::uint64_t i) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(i);
+#else
+  unsigned n = 0;
+  for (; (i & 1) == 0; i >>= 1) ++n;
+  return n;
+#endif
+}
+
+}  // namespace
+
+// Enumerates the states in Gray-code order, so that each step flips one spin
+// and updates the histogram index incrementally.  The sequence is cut into
+// chunks that are enumerated in parallel; their integer histograms are
+// summed, so the result does not depend on the number of threads.  The
+// numbers of unsatisfied x and y bonds are even on a periodic lattice and
+// are stored halved.  Sizes from 2 x 2 to 6 x 6 are walked by
+// counting_kernel.
+template <typename I>
+inline count_histogram make_count_histogram(I Lx, I Ly) {
   if (Lx <= 0 || Ly <= 0)
     throw(std::invalid_argument("Lx and Ly should be positive"));
-
   auto basis = lattice::basis::simple(2);
   auto unitcell = lattice::unitcell(2);
   unitcell.add_site(lattice::coordinate(0, 0), 0);
   unitcell.add_bond(0, 0, lattice::offset(1, 0), 0);
   unitcell.add_bond(0, 0, lattice::offset(0, 1), 1);
   auto graph = lattice::graph(basis, unitcell, lattice::extent(Lx, Ly));
-  if (graph.num_sites() >= 32)
+  if (graph.num_sites() > 40)
     throw(std::invalid_argument("too large system size"));
 
-  std::vector<real_t> J(2);
-  J[0] = Jx;
-  J[1] = Jy;
-  real_t gs_energy = -(Jx + Jy) * (Lx * Ly);
-  int_t num_states = 1 << graph.num_sites();
-  value_t Z(0);
-  for (int_t c = 0; c < num_states; ++c) {
-    real_t energy = 0;
-    for (int_t b = 0; b < graph.num_bonds(); ++b) {
-      real_t ci = real_t(2) * ((c >> graph.source(b)) & 1) - 1;
-      real_t cj = real_t(2) * ((c >> graph.target(b)) & 1) - 1;
-      energy -= J[graph.bond_type(b)] * ci * cj;
-    }
-    real_t mag = 0;
-    for (int_t s = 0; s < graph.num_sites(); ++s) {
-      mag += real_t(2) * ((c >> s) & 1) - 1;
+  unsigned n = graph.num_sites();
+  std::array<unsigned, 2> nb = {{0, 0}};
+  for (std::size_t b = 0; b < graph.num_bonds(); ++b)
+    ++nb[graph.bond_type(b)];
+  // index = (nx / 2 * (nb[1] / 2 + 1) + ny / 2) * (n + 1) + up
+  std::array<std::int64_t, 2> stride = {
+      {std::int64_t(nb[1] / 2 + 1) * (n + 1), std::int64_t(n + 1)}};
+  std::size_t size = (nb[0] / 2 + 1) * stride[0];
+  // bonds around each site as (neighbor, bond type); self loops never change
+  std::vector<std::vector<std::pair<unsigned, unsigned>>> neighbors(n);
+  for (std::size_t b = 0; b < graph.num_bonds(); ++b) {
+    unsigned s = graph.source(b), t = graph.target(b);
+    if (s == t) continue;
+    neighbors[s].emplace_back(t, graph.bond_type(b));
+    neighbors[t].emplace_back(s, graph.bond_type(b));
+  }
+
+  // unsatisfied bonds are halved (Unit = 2); a set bit, the "down" spin of
+  // counting_kernel, is an up spin here
+  counting_walk kernel = counting_dispatch<2>::find(Lx, Ly, boundary::periodic);
+  counting_layout layout = {0, stride[0], stride[1], 1};
+
+  std::uint64_t num_states = std::uint64_t(1) << n;
+  std::size_t chunks = std::min(num_states, std::uint64_t(256));
+  std::vector<std::uint64_t> hist(size, 0);
+  std::mutex mutex;
+  exact::parallel::for_each(chunks, [&](std::size_t k) {
+    std::vector<std::uint64_t> local(size, 0);
+    std::uint64_t first = num_states / chunks * k;
+    std::uint64_t last = (k + 1 == chunks) ? num_states : first + num_states / chunks;
+    if (kernel) {
+      kernel(first, last, layout, local.data());
+    } else {
+      std::uint64_t c = first ^ (first >> 1);
+      std::array<std::int64_t, 2> unsat = {{0, 0}};
+      for (std::size_t b = 0; b < graph.num_bonds(); ++b)
+        unsat[graph.bond_type(b)] +=
+            ((c >> graph.source(b)) ^ (c >> graph.target(b))) & 1;
+      std::int64_t index = unsat[0] / 2 * stride[0] + unsat[1] / 2 * stride[1];
+      for (unsigned s = 0; s < n; ++s)
+        index += (c >> s) & 1;
+      ++local[index];
+      for (std::uint64_t i = first + 1; i < last; ++i) {
+        unsigned s = trailing_zeros(i);
+        std::uint64_t cs = (c >> s) & 1;
+        std::array<std::int64_t, 2> diff = {{0, 0}};
+        for (auto const& nbr : neighbors[s])
+          diff[nbr.second] += (cs ^ ((c >> nbr.first) & 1)) ? -1 : 1;
+        index += diff[0] / 2 * stride[0] + diff[1] / 2 * stride[1];
+        index += cs ? -1 : 1;
+        c ^= std::uint64_t(1) << s;
+        ++local[index];
+      }
     }
-    Z += exp((gs_energy - energy - h * mag) * beta);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::size_t j = 0; j < size; ++j)
+      hist[j] += local[j];
+  });
+
+  count_histogram res;
+  res.num_sites = n;
+  res.num_bonds_x = nb[0];
+  res.num_bonds_y = nb[1];
+  for (std::size_t j = 0; j < size; ++j)
+    if (hist[j] > 0)
+      res.entries.push_back({unsigned(2 * (j / stride[0])),
+                             unsigned(2 * (j % stride[0] / stride[1])),
+                             unsigned(j % stride[1]), hist[j]});
+  return res;
+}
+
+// histogram of make_count_histogram() kept for the lifetime of the process
+template <typename I>
+inline const count_histogram& shared_count_histogram(I Lx, I Ly) {
+  static std::mutex mutex;
+  static std::map<std::pair<unsigned long, unsigned long>, count_histogram>
+      cache;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto key = std::make_pair((unsigned long)Lx, (unsigned long)Ly);
+  auto itr = cache.find(key);
+  if (itr == cache.end())
+    itr = cache.emplace(key, make_count_histogram(Lx, Ly)).first;
+  return itr->second;
+}
+
+// Brute-force free energy by reweighting the state histogram of the lattice,
+// which is enumerated only on the first call for each (Lx, Ly).  Up to 40
+// sites.
+template <typename I, typename T, typename U, typename W>
+inline boost::math::differentiation::promote<U, W> finite_count(I Lx, I Ly,
+                                                                T Jx, T Jy,
+                                                                U beta, W h) {
+  typedef T real_t;
+  typedef boost::math::differentiation::promote<U, W> value_t;
+  auto const& hist = shared_count_histogram(Lx, Ly);
+  real_t gs_energy = -(Jx * hist.num_bonds_x + Jy * hist.num_bonds_y);
+  value_t Z(0);
+  for (auto const& e : hist.entries) {
+    real_t energy = -Jx * (real_t(hist.num_bonds_x) - 2 * real_t(e.nx)) -
+                    Jy * (real_t(hist.num_bonds_y) - 2 * real_t(e.ny));
+    real_t mag = 2 * real_t(e.up) - real_t(hist.num_sites);
+    Z += real_t(e.count) * exp((gs_energy - energy - h * mag) * beta);
   }
   return (-log(Z) / beta + gs_energy) / (Lx * Ly);
 }
@@ -25,6 +25,7 @@
 #include "ising/tc/square.hpp"
 #include "options.hpp"
 #include "square.hpp"
+#include "sweep.hpp"
 
 template <typename T>
 void calc(const options2f& opt) {
@@ -52,17 +53,22 @@ void calc(const options2f& opt) {
             << "# precision: " << std::numeric_limits<real_t>::digits10
             << std::endl
             << "# Lx Ly Jx Jy T 1/T F/N E/N C/N M2/N2\n";
-  for (auto t = Tmin; t < Tmax + 1e-4 * dT; t += dT) {
-    auto vars =
-        boost::math::differentiation::make_ftuple<real_t, 2, 2>(1 / t, 0);
-    auto& beta = std::get<0>(vars);
-    auto& h = std::get<1>(vars);
-    auto f = square::finite_count(opt.Lx, opt.Ly, Jx, Jy, beta, h);
-    std::cout << opt.Lx << ' ' << opt.Ly << ' ' << Jx << ' ' << Jy << ' ' << t
-              << ' ' << (1 / t) << ' ' << free_energy(f, beta, h) << ' '
-              << energy(f, beta, h) << ' ' << specific_heat(f, beta, h) << ' '
-              << magnetization2(f, beta, h) << std::endl;
-  }
+  // enumerate the states once, in parallel, before the sweep reweights them
+  square::shared_count_histogram(opt.Lx, opt.Ly);
+  sweep(
+      temperatures(Tmin, Tmax, dT),
+      [&](real_t t, std::ostream& os) {
+        auto vars =
+            boost::math::differentiation::make_ftuple<real_t, 2, 2>(1 / t, 0);
+        auto& beta = std::get<0>(vars);
+        auto& h = std::get<1>(vars);
+        auto f = square::finite_count(opt.Lx, opt.Ly, Jx, Jy, beta, h);
+        os << opt.Lx << ' ' << opt.Ly << ' ' << Jx << ' ' << Jy << ' ' << t
+           << ' ' << (1 / t) << ' ' << free_energy(f, beta, h) << ' '
+           << energy(f, beta, h) << ' ' << specific_heat(f, beta, h) << ' '
+           << magnetization2(f, beta, h) << std::endl;
+      },
+      std::cout, opt.threads);
 }
 
 int main(int argc, char** argv) {
@@ -70,6 +76,7 @@ int main(int argc, char** argv) {
   options2f opt(argc, argv);
   if (!opt.valid)
     return 127;
+  exact::parallel::set_num_threads(opt.threads);
   if (opt.prec <= std::numeric_limits<float>::digits10) {
     calc<float>(opt);
   } else if (opt.prec <= std::numeric_limits<double>::digits10) {
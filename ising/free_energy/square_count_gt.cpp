@@ -15,6 +15,9 @@
 */
 
 #include <cmath>
+#include <map>
+#include <tuple>
+#include <utility>
 #include <gtest/gtest.h>
 #include <boost/math/differentiation/autodiff.hpp>
 #include <boost/multiprecision/cpp_dec_float.hpp>
@@ -36,8 +39,71 @@ TEST(IsingFreeEnergy, SquareCount0) {
   auto& beta = std::get<0>(vars);
   auto& h = std::get<1>(vars);
   auto f = square::finite_count(Lx, Ly, Jx, Jy, beta, h);
-  EXPECT_DOUBLE_EQ(-4.087359662653047e+00, free_energy(f, beta, h));
-  EXPECT_DOUBLE_EQ(-3.994108759068211e+00, energy(f, beta, h));
-  EXPECT_DOUBLE_EQ(2.452622208849045e-02, specific_heat(f, beta, h));
-  EXPECT_DOUBLE_EQ(1.597700713244840e+01, magnetization2(f, beta, h));
+  // Since the histogram reweighting, these agree with finite_count in
+  // cpp_bin_float_50 to 0, 1, 14, and 5 ulps.  The state-by-state sum that
+  // they replaced was off by 43, 10, 758, and 2516 ulps.
+  EXPECT_DOUBLE_EQ(-4.087359662653009e+00, free_energy(f, beta, h));
+  EXPECT_DOUBLE_EQ(-3.994108759068207e+00, energy(f, beta, h));
+  EXPECT_DOUBLE_EQ(2.452622208848787e-02, specific_heat(f, beta, h));
+  EXPECT_DOUBLE_EQ(1.597700713245286e+01, magnetization2(f, beta, h));
+}
+
+TEST(IsingFreeEnergy, SquareCount1) {
+  typedef double real_t;
+  unsigned Lx = 6;
+  unsigned Ly = 4;
+  exact::parallel::set_num_threads(1);
+  auto h1 = square::make_count_histogram(Lx, Ly);
+  exact::parallel::set_num_threads(3);
+  auto h3 = square::make_count_histogram(Lx, Ly);
+  exact::parallel::set_num_threads(0);
+  std::uint64_t total = 0;
+  ASSERT_EQ(h1.entries.size(), h3.entries.size());
+  for (std::size_t i = 0; i < h1.entries.size(); ++i) {
+    EXPECT_EQ(h1.entries[i].count, h3.entries[i].count);
+    total += h1.entries[i].count;
+  }
+  EXPECT_EQ(std::uint64_t(1) << (Lx * Ly), total);
+
+  real_t Jx = 1.5, Jy = 2.5;
+  for (real_t t : {1.0, 3.0, 4.5, 10.0}) {
+    auto vars =
+        boost::math::differentiation::make_ftuple<real_t, 2, 2>(1 / t, 0);
+    auto& beta = std::get<0>(vars);
+    auto& h = std::get<1>(vars);
+    auto fc = square::finite_count(Lx, Ly, Jx, Jy, beta, h);
+    auto b = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+    auto ff = square::finite(Lx, Ly, Jx, Jy, b);
+    EXPECT_NEAR(free_energy(ff, b), free_energy(fc, beta, h), 1e-12);
+    EXPECT_NEAR(energy(ff, b), energy(fc, beta, h), 1e-12);
+    EXPECT_NEAR(specific_heat(ff, b), specific_heat(fc, beta, h), 1e-10);
+  }
+}
+
+TEST(IsingFreeEnergy, SquareCount2) {
+  // halved histogram of the Gray-code walk against a direct count of the
+  // bonds of every state; 7 x 2 and 1 x 5 take the generic walk, the others
+  // counting_kernel
+  for (auto L : {std::make_pair(2u, 2u), std::make_pair(3u, 4u),
+                 std::make_pair(6u, 2u), std::make_pair(7u, 2u),
+                 std::make_pair(1u, 5u)}) {
+    unsigned Lx = L.first, Ly = L.second, n = Lx * Ly;
+    std::map<std::tuple<unsigned, unsigned, unsigned>, std::uint64_t> direct;
+    for (std::uint64_t c = 0; c < (std::uint64_t(1) << n); ++c) {
+      unsigned nx = 0, ny = 0, up = 0;
+      for (unsigned y = 0; y < Ly; ++y) {
+        for (unsigned x = 0; x < Lx; ++x) {
+          unsigned s = x + Lx * y;
+          nx += ((c >> s) ^ (c >> ((x + 1) % Lx + Lx * y))) & 1;
+          ny += ((c >> s) ^ (c >> (x + Lx * ((y + 1) % Ly)))) & 1;
+          up += (c >> s) & 1;
+        }
+      }
+      ++direct[std::make_tuple(nx, ny, up)];
+    }
+    auto hist = square::make_count_histogram(Lx, Ly);
+    ASSERT_EQ(direct.size(), hist.entries.size());
+    for (auto const& e : hist.entries)
+      EXPECT_EQ(direct[std::make_tuple(e.nx, e.ny, e.up)], e.count);
+  }
 }
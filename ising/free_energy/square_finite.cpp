@@ -19,12 +19,208 @@
 #include <iomanip>
 #include <iostream>
 #include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <boost/math/differentiation/autodiff.hpp>
 #include <boost/multiprecision/cpp_dec_float.hpp>
 #include "ising/mp_wrapper.hpp"
 #include "ising/tc/square.hpp"
 #include "options.hpp"
 #include "square.hpp"
+#include "sweep.hpp"
+
+// multiprecision: automatic differentiation for each temperature
+template <typename T>
+typename std::enable_if<!std::is_floating_point<T>::value>::type evaluate(
+    const options2f& opt, T Jx, T Jy, const std::vector<T>& ts) {
+  using namespace ising::free_energy;
+  typedef T real_t;
+  sweep(
+      ts,
+      [&](real_t t, std::ostream& os) {
+        auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+        auto f = square::finite(opt.Lx, opt.Ly, Jx, Jy, beta);
+        os << opt.Lx << ' ' << opt.Ly << ' ' << Jx << ' ' << Jy << ' ' << t
+           << ' ' << (1 / t) << ' ' << free_energy(f, beta) << ' '
+           << energy(f, beta) << ' ' << specific_heat(f, beta) << std::endl;
+      },
+      std::cout, opt.threads);
+}
+
+// float and double: batched kernel over blocks of temperatures
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type evaluate(
+    const options2f& opt, T Jx, T Jy, const std::vector<T>& ts) {
+  using namespace ising::free_energy;
+  typedef T real_t;
+  typedef typename std::vector<real_t>::const_iterator iterator;
+  const std::size_t block = 256;
+  sweep_blocks(
+      ts, block,
+      [&](iterator first, iterator last, std::ostream& os) {
+        std::vector<real_t> beta, f, e, c;
+        for (auto itr = first; itr != last; ++itr)
+          beta.push_back(1 / *itr);
+        square::finite_batch(opt.Lx, opt.Ly, Jx, Jy, beta, f, e, c);
+        for (std::size_t i = 0; i < beta.size(); ++i)
+          os << opt.Lx << ' ' << opt.Ly << ' ' << Jx << ' ' << Jy << ' '
+             << first[i] << ' ' << beta[i] << ' ' << f[i] << ' ' << e[i]
+             << ' ' << c[i] << std::endl;
+      },
+      std::cout, opt.threads);
+}
+
+// free energy, energy, and specific heat, together with the energies of the
+// x and y bonds by differentiation with respect to Jx and Jy
+template <typename T>
+void evaluate_bonds(const options2f& opt, T Jx, T Jy,
+                    const std::vector<T>& ts) {
+  using namespace ising::free_energy;
+  typedef T real_t;
+  std::vector<std::pair<unsigned long, unsigned long>> sizes;
+  if (opt.Ls.empty())
+    sizes.emplace_back(opt.Lx, opt.Ly);
+  for (auto L : opt.Ls)
+    sizes.emplace_back(L, L);
+  sweep(
+      ts,
+      [&](real_t t, std::ostream& os) {
+        auto vars = boost::math::differentiation::make_ftuple<real_t, 2, 1, 1>(
+            1 / t, Jx, Jy);
+        auto& beta = std::get<0>(vars);
+        auto& jx = std::get<1>(vars);
+        auto& jy = std::get<2>(vars);
+        for (auto s : sizes) {
+          auto f = square::finite(s.first, s.second, jx, jy, beta);
+          os << s.first << ' ' << s.second << ' ' << Jx << ' ' << Jy << ' '
+             << t << ' ' << (1 / t) << ' ' << free_energy(f, beta, jx, jy)
+             << ' ' << energy(f, beta, jx, jy) << ' '
+             << specific_heat(f, beta, jx, jy) << ' '
+             << energy_x(f, beta, jx, jy) << ' ' << energy_y(f, beta, jx, jy)
+             << std::endl;
+        }
+      },
+      std::cout, opt.threads);
+}
+
+// all sizes given by -l at once, sharing the momentum tables
+template <typename T>
+void evaluate_series(const options2f& opt, T Jx, T Jy,
+                     const std::vector<T>& ts) {
+  using namespace ising::free_energy;
+  typedef T real_t;
+  sweep(
+      ts,
+      [&](real_t t, std::ostream& os) {
+        auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+        auto fs = square::finite_series(opt.Ls, Jx, Jy, beta);
+        for (std::size_t i = 0; i < fs.size(); ++i)
+          os << opt.Ls[i] << ' ' << opt.Ls[i] << ' ' << Jx << ' ' << Jy << ' '
+             << t << ' ' << (1 / t) << ' ' << free_energy(fs[i], beta) << ' '
+             << energy(fs[i], beta) << ' ' << specific_heat(fs[i], beta)
+             << std::endl;
+      },
+      std::cout, opt.threads);
+}
+
+// bulk form where the finite-size corrections are below tol, with the path
+// in the last column
+template <typename T>
+void evaluate_asymptotic(const options2f& opt, T Jx, T Jy,
+                         const std::vector<T>& ts) {
+  using namespace ising::free_energy;
+  typedef T real_t;
+  real_t tol = convert<real_t>(opt.tol);
+  std::vector<std::pair<unsigned long, unsigned long>> sizes;
+  if (opt.Ls.empty())
+    sizes.emplace_back(opt.Lx, opt.Ly);
+  for (auto L : opt.Ls)
+    sizes.emplace_back(L, L);
+  sweep(
+      ts,
+      [&](real_t t, std::ostream& os) {
+        auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+        for (auto s : sizes) {
+          bool asymptotic;
+          auto f = square::finite_asymptotic(s.first, s.second, Jx, Jy, beta,
+                                             tol, asymptotic);
+          os << s.first << ' ' << s.second << ' ' << Jx << ' ' << Jy << ' '
+             << t << ' ' << (1 / t) << ' ' << free_energy(f, beta) << ' '
+             << energy(f, beta) << ' ' << specific_heat(f, beta) << ' '
+             << (asymptotic ? "asymptotic" : "exact") << std::endl;
+        }
+      },
+      std::cout, opt.threads);
+}
+
+// specific-heat peak for each size: T*, 1/T*, C_max/N, and d^2(C/N)/dT^2
+template <typename T>
+void evaluate_peak(const options2f& opt, T Jx, T Jy) {
+  using namespace ising::free_energy;
+  typedef T real_t;
+  std::vector<std::pair<unsigned long, unsigned long>> sizes;
+  if (opt.Ls.empty())
+    sizes.emplace_back(opt.Lx, opt.Ly);
+  for (auto L : opt.Ls)
+    sizes.emplace_back(L, L);
+  std::cout << std::scientific
+            << std::setprecision(std::numeric_limits<real_t>::digits10)
+            << "# lattice: square\n"
+            << "# precision: " << std::numeric_limits<real_t>::digits10
+            << std::endl
+            << "# Lx Ly Jx Jy T* 1/T* C_max/N d2C/dT2\n";
+  sweep(
+      sizes,
+      [&](std::pair<unsigned long, unsigned long> s, std::ostream& os) {
+        real_t c, c2;
+        real_t t = square::finite_peak(s.first, s.second, Jx, Jy, c, c2);
+        os << s.first << ' ' << s.second << ' ' << Jx << ' ' << Jy << ' ' << t
+           << ' ' << (1 / t) << ' ' << c << ' ' << c2 << std::endl;
+      },
+      std::cout, opt.threads);
+}
+
+// free energies of the boundary-condition sectors (p: periodic, a:
+// antiperiodic; first letter for x, second for y), their partition function
+// ratios to the periodic one, and the interface free energies
+// -T log(Z_s / Z_pp)
+const char* sectors_header =
+    "# Lx Ly Jx Jy T 1/T F_pp/N F_pa/N F_ap/N F_aa/N Z_pa/Z_pp Z_ap/Z_pp "
+    "Z_aa/Z_pp F_int_pa F_int_ap F_int_aa";
+
+template <typename T>
+void evaluate_sectors(const options2f& opt, T Jx, T Jy,
+                      const std::vector<T>& ts) {
+  using namespace ising::free_energy;
+  using std::exp;
+  typedef T real_t;
+  std::vector<std::pair<unsigned long, unsigned long>> sizes;
+  if (opt.Ls.empty())
+    sizes.emplace_back(opt.Lx, opt.Ly);
+  for (auto L : opt.Ls)
+    sizes.emplace_back(L, L);
+  sweep(
+      ts,
+      [&](real_t t, std::ostream& os) {
+        real_t beta = 1 / t;
+        for (auto s : sizes) {
+          auto f = square::finite_sectors(s.first, s.second, Jx, Jy, beta);
+          auto fi = square::finite_interfaces(s.first, s.second, Jx, Jy, beta);
+          os << s.first << ' ' << s.second << ' ' << Jx << ' ' << Jy << ' '
+             << t << ' ' << beta;
+          for (int i = 0; i < 4; ++i)
+            os << ' ' << f[i];
+          for (int i = 0; i < 3; ++i)
+            os << ' ' << exp(-beta * fi[i]);
+          for (int i = 0; i < 3; ++i)
+            os << ' ' << fi[i];
+          os << std::endl;
+        }
+      },
+      std::cout, opt.threads);
+}
 
 template <typename T>
 void calc(const options2f& opt) {
@@ -32,6 +228,10 @@ void calc(const options2f& opt) {
   typedef T real_t;
   real_t Jx = convert<real_t>(opt.Jx);
   real_t Jy = convert<real_t>(opt.Jy);
+  if (opt.peak) {
+    evaluate_peak(opt, Jx, Jy);
+    return;
+  }
   real_t Tmin, Tmax, dT;
   if (opt.Tmin == "tc" || opt.Tmin == "Tc") {
     Tmin = Tmax = dT = ising::tc::square(Jx, Jy);
@@ -51,14 +251,22 @@ void calc(const options2f& opt) {
             << "# lattice: square\n"
             << "# precision: " << std::numeric_limits<real_t>::digits10
             << std::endl
-            << "# Lx Ly Jx Jy T 1/T F/N E/N C/N\n";
-  for (auto t = Tmin; t < Tmax + 1e-4 * dT; t += dT) {
-    auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
-    auto f = square::finite(opt.Lx, opt.Ly, Jx, Jy, beta);
-    std::cout << opt.Lx << ' ' << opt.Ly << ' ' << Jx << ' ' << Jy << ' ' << t
-              << ' ' << (1 / t) << ' ' << free_energy(f, beta) << ' '
-              << energy(f, beta) << ' ' << specific_heat(f, beta) << std::endl;
-  }
+            << (opt.sectors ? sectors_header
+                            : "# Lx Ly Jx Jy T 1/T F/N E/N C/N")
+            << (opt.sectors  ? "\n"
+                : opt.bonds  ? " Ex/N Ey/N\n"
+                : opt.tol.empty() ? "\n"
+                                  : " path\n");
+  if (opt.sectors)
+    evaluate_sectors(opt, Jx, Jy, temperatures(Tmin, Tmax, dT));
+  else if (opt.bonds)
+    evaluate_bonds(opt, Jx, Jy, temperatures(Tmin, Tmax, dT));
+  else if (!opt.tol.empty())
+    evaluate_asymptotic(opt, Jx, Jy, temperatures(Tmin, Tmax, dT));
+  else if (opt.Ls.empty())
+    evaluate(opt, Jx, Jy, temperatures(Tmin, Tmax, dT));
+  else
+    evaluate_series(opt, Jx, Jy, temperatures(Tmin, Tmax, dT));
 }
 
 int main(int argc, char** argv) {
@@ -66,6 +274,7 @@ int main(int argc, char** argv) {
   options2f opt(argc, argv);
   if (!opt.valid)
     return 127;
+  exact::parallel::set_num_threads(opt.threads);
   if (opt.prec <= std::numeric_limits<float>::digits10) {
     calc<float>(opt);
   } else if (opt.prec <= std::numeric_limits<double>::digits10) {
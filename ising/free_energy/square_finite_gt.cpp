@@ -19,6 +19,7 @@
 #include <boost/math/differentiation/autodiff.hpp>
 #include <boost/multiprecision/cpp_dec_float.hpp>
 #include "ising/mp_wrapper.hpp"
+#include "ising/tc/square.hpp"
 #include "ising/free_energy/common.hpp"
 #include "ising/free_energy/square.hpp"
 
@@ -78,3 +79,243 @@ TEST(IsingFreeEnergy, SquareFinite2) {
   EXPECT_TRUE(abs(energy(fc, beta, h) - energy(ff, beta)) < eps);
   EXPECT_TRUE(abs(specific_heat(fc, beta, h) - specific_heat(ff, beta)) < eps);
 }
+
+TEST(IsingFreeEnergy, SquareFiniteBatch0) {
+  typedef double real_t;
+  for (auto J : {std::make_pair(1.5, 2.5), std::make_pair(1.0, 1.0)}) {
+    for (auto L : {std::make_pair(4u, 4u), std::make_pair(3u, 6u),
+                   std::make_pair(16u, 16u)}) {
+      std::vector<real_t> betas, f, e, c;
+      for (int i = 1; i <= 40; ++i)
+        betas.push_back(0.05 * i);
+      square::finite_batch(L.first, L.second, J.first, J.second, betas, f, e,
+                           c);
+      for (std::size_t i = 0; i < betas.size(); ++i) {
+        auto beta = boost::math::differentiation::make_fvar<real_t, 2>(betas[i]);
+        auto ff = square::finite(L.first, L.second, J.first, J.second, beta);
+        EXPECT_NEAR(free_energy(ff, beta), f[i], 1e-12);
+        EXPECT_NEAR(energy(ff, beta), e[i], 1e-10);
+        EXPECT_NEAR(specific_heat(ff, beta), c[i], 1e-8);
+      }
+    }
+  }
+}
+
+TEST(IsingFreeEnergy, SquareFiniteBatch1) {
+  // around and at Tc, where gamma_0 changes sign and vanishes
+  typedef double real_t;
+  real_t J = 1;
+  real_t bc = 1 / ising::tc::square(J, J);
+  for (unsigned long L : {4, 16}) {
+    std::vector<real_t> betas = {bc * (1 - 1e-3), bc * (1 - 1e-12), bc,
+                                 bc * (1 + 1e-12), bc * (1 + 1e-3)};
+    std::vector<real_t> f, e, c;
+    square::finite_batch(L, L, J, J, betas, f, e, c);
+    for (std::size_t i = 0; i < betas.size(); ++i) {
+      auto beta = boost::math::differentiation::make_fvar<real_t, 2>(betas[i]);
+      auto ff = square::finite(L, L, J, J, beta);
+      EXPECT_NEAR(free_energy(ff, beta), f[i], 1e-12);
+      EXPECT_NEAR(energy(ff, beta), e[i], 1e-10);
+      EXPECT_NEAR(specific_heat(ff, beta), c[i], 1e-8);
+    }
+  }
+}
+
+TEST(IsingFreeEnergy, SquareFiniteSeries0) {
+  typedef double real_t;
+  std::vector<unsigned long> Ls = {3, 16, 4, 6, 8, 12, 2};
+  real_t Jx = 1.5, Jy = 2.5;
+  for (auto t : {1.0, 3.0, 5.0}) {
+    auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+    auto fs = square::finite_series(Ls, Jx, Jy, beta);
+    for (std::size_t i = 0; i < Ls.size(); ++i) {
+      auto ff = square::finite(Ls[i], Ls[i], Jx, Jy, beta);
+      EXPECT_DOUBLE_EQ(free_energy(ff, beta), free_energy(fs[i], beta));
+      EXPECT_DOUBLE_EQ(energy(ff, beta), energy(fs[i], beta));
+      EXPECT_DOUBLE_EQ(specific_heat(ff, beta), specific_heat(fs[i], beta));
+    }
+  }
+}
+
+TEST(IsingFreeEnergy, SquareFiniteParallel0) {
+  typedef double real_t;
+  unsigned long L = 20000;
+  auto beta = boost::math::differentiation::make_fvar<real_t, 2>(0.44);
+  exact::parallel::set_num_threads(1);
+  auto f1 = square::finite(L, L, 1.0, 1.0, beta);
+  exact::parallel::set_num_threads(4);
+  auto f4 = square::finite(L, L, 1.0, 1.0, beta);
+  exact::parallel::set_num_threads(0);
+  EXPECT_EQ(free_energy(f1, beta), free_energy(f4, beta));
+  EXPECT_EQ(energy(f1, beta), energy(f4, beta));
+  EXPECT_EQ(specific_heat(f1, beta), specific_heat(f4, beta));
+}
+
+TEST(IsingFreeEnergy, SquareFiniteAsymptotic0) {
+  typedef double real_t;
+  unsigned long L = 512;
+  real_t Jx = 1.5, Jy = 2.5;
+  for (auto t : {1.0, 2.0, 3.0, 4.0, 4.55, 5.0, 6.0, 10.0}) {
+    auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+    bool asymptotic;
+    auto fa =
+        square::finite_asymptotic(L, L, Jx, Jy, beta, real_t(1e-12), asymptotic);
+    auto ff = square::finite(L, L, Jx, Jy, beta);
+    if (t <= 3.0 || t >= 10.0) {
+      EXPECT_TRUE(asymptotic);
+    }
+    if (t == 4.55) {
+      EXPECT_FALSE(asymptotic);
+    }
+    EXPECT_NEAR(free_energy(ff, beta), free_energy(fa, beta), 1e-12);
+    EXPECT_NEAR(energy(ff, beta), energy(fa, beta), 1e-12);
+    EXPECT_NEAR(specific_heat(ff, beta), specific_heat(fa, beta), 1e-11);
+  }
+  // L = 10^9 costs O(1) away from the critical point
+  unsigned long Lh = 1000000000;
+  auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / 3.0);
+  bool asymptotic;
+  auto fa = square::finite_asymptotic(Lh, Lh, Jx, Jy, beta, real_t(1e-14),
+                                      asymptotic);
+  auto fi = square::infinite(Jx, Jy, beta);
+  EXPECT_TRUE(asymptotic);
+  EXPECT_NEAR(free_energy(fi, beta), free_energy(fa, beta), 1e-12);
+  EXPECT_NEAR(energy(fi, beta), energy(fa, beta), 1e-12);
+}
+
+TEST(IsingFreeEnergy, SquareFinitePeak0) {
+  typedef double real_t;
+  for (unsigned long L : {4, 8, 16}) {
+    real_t c, c2;
+    real_t t = square::finite_peak(L, L, real_t(1.5), real_t(2.5), c, c2);
+    EXPECT_LT(c2, 0);
+    // C(T) around the peak
+    real_t dt = 1e-3;
+    for (auto s : {-1, 1}) {
+      auto beta =
+          boost::math::differentiation::make_fvar<real_t, 2>(1 / (t + s * dt));
+      auto f = square::finite(L, L, real_t(1.5), real_t(2.5), beta);
+      EXPECT_LT(specific_heat(f, beta), c);
+      EXPECT_NEAR(c + c2 * dt * dt / 2, specific_heat(f, beta), 1e-6);
+    }
+  }
+}
+
+TEST(IsingFreeEnergy, SquareFiniteSectors0) {
+  typedef double real_t;
+  real_t Jx = 1.3, Jy = 0.7;
+  for (auto L : {std::make_pair(3u, 4u), std::make_pair(4u, 2u)}) {
+    unsigned Lx = L.first, Ly = L.second;
+    unsigned N = Lx * Ly;
+    for (auto t : {1.0, 2.0, 5.0}) {
+      auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+      auto fs = square::finite_sectors(Lx, Ly, Jx, Jy, beta);
+      auto fi = square::finite_interfaces(Lx, Ly, Jx, Jy, beta);
+      EXPECT_NEAR(free_energy(square::finite(Lx, Ly, Jx, Jy, beta), beta),
+                  free_energy(fs[0], beta), 1e-12);
+      real_t Z0 = 0;
+      for (int s = 0; s < 4; ++s) {
+        // bonds across the seams are flipped for antiperiodic directions
+        real_t sy = (s & 1) ? -1 : 1;
+        real_t sx = (s & 2) ? -1 : 1;
+        real_t Z = 0;
+        for (unsigned c = 0; c < (1u << N); ++c) {
+          real_t energy = 0;
+          for (unsigned x = 0; x < Lx; ++x) {
+            for (unsigned y = 0; y < Ly; ++y) {
+              auto spin = [&](unsigned x, unsigned y) {
+                return 2 * real_t((c >> (x % Lx + Lx * (y % Ly))) & 1) - 1;
+              };
+              energy -= ((x == Lx - 1) ? sx : 1) * Jx * spin(x, y) *
+                        spin(x + 1, y);
+              energy -= ((y == Ly - 1) ? sy : 1) * Jy * spin(x, y) *
+                        spin(x, y + 1);
+            }
+          }
+          Z += std::exp(-energy / t);
+        }
+        EXPECT_NEAR(-t * std::log(Z) / N, free_energy(fs[s], beta), 1e-12);
+        if (s == 0) {
+          Z0 = Z;
+        } else {
+          real_t fb = -t * std::log(Z / Z0);
+          EXPECT_NEAR(fb, fi[s - 1].derivative(0), 1e-10);
+        }
+      }
+    }
+  }
+}
+
+TEST(IsingFreeEnergy, SquareFiniteInterfaces0) {
+  // above Tc the interface free energies are far below the precision of
+  // N (F_s - F_0); compare with 50 digits
+  typedef double real_t;
+  typedef mp_wrapper<cpp_dec_float_50> mp_t;
+  unsigned long Lx = 48, Ly = 64;
+  for (auto t : {"4", "6"}) {
+    real_t td = convert<real_t>(t);
+    mp_t tm = convert<mp_t>(t);
+    auto fd = square::finite_interfaces(Lx, Ly, real_t(1.5), real_t(1), 1 / td);
+    auto fm = square::finite_interfaces(Lx, Ly, mp_t(1.5), mp_t(1), 1 / tm);
+    for (int s = 0; s < 3; ++s) {
+      EXPECT_GT(fd[s], 0);
+      EXPECT_TRUE(abs(fm[s] / fd[s] - 1) < 1e-10);
+    }
+  }
+  // below Tc they are of order one or larger, where N (F_s - F_0) agrees
+  real_t N = real_t(Lx) * Ly;
+  auto fs = square::finite_sectors(Lx, Ly, real_t(1.5), real_t(1), 1 / 2.8);
+  auto fi = square::finite_interfaces(Lx, Ly, real_t(1.5), real_t(1), 1 / 2.8);
+  for (int s = 0; s < 3; ++s)
+    EXPECT_NEAR(N * (fs[s + 1] - fs[0]), fi[s], 1e-9 * fi[s]);
+}
+
+TEST(IsingFreeEnergy, SquareFiniteBonds0) {
+  typedef double real_t;
+  unsigned Lx = 6;
+  unsigned Ly = 6;
+  real_t Jx = 1.5, Jy = 2.5;
+  for (real_t t : {1.0, 3.0, 4.5, 10.0}) {
+    auto vars = boost::math::differentiation::make_ftuple<real_t, 2, 1, 1>(
+        1 / t, Jx, Jy);
+    auto& beta = std::get<0>(vars);
+    auto& jx = std::get<1>(vars);
+    auto& jy = std::get<2>(vars);
+    auto f = square::finite(Lx, Ly, jx, jy, beta);
+    auto b = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+    auto g = square::finite(Lx, Ly, Jx, Jy, b);
+    EXPECT_NEAR(free_energy(g, b), free_energy(f, beta, jx, jy), 1e-12);
+    EXPECT_NEAR(energy(g, b), energy(f, beta, jx, jy), 1e-12);
+    EXPECT_NEAR(specific_heat(g, b), specific_heat(f, beta, jx, jy), 1e-10);
+    EXPECT_NEAR(energy(g, b),
+                energy_x(f, beta, jx, jy) + energy_y(f, beta, jx, jy), 1e-12);
+    // x and y exchange roles on a square lattice
+    auto vars2 = boost::math::differentiation::make_ftuple<real_t, 2, 1, 1>(
+        1 / t, Jy, Jx);
+    auto f2 = square::finite(Lx, Ly, std::get<1>(vars2), std::get<2>(vars2),
+                             std::get<0>(vars2));
+    EXPECT_NEAR(energy_x(f, beta, jx, jy),
+                energy_y(f2, std::get<0>(vars2), std::get<1>(vars2),
+                         std::get<2>(vars2)),
+                1e-12);
+  }
+}
+
+TEST(IsingFreeEnergy, SquareFiniteCritical0) {
+  // gamma_0 vanishes exactly at Tc in double precision, but not in 50 digits
+  typedef double real_t;
+  typedef mp_wrapper<cpp_dec_float_50> mp_t;
+  for (unsigned long L : {4, 16}) {
+    real_t J = 1;
+    auto beta = boost::math::differentiation::make_fvar<real_t, 2>(
+        1 / ising::tc::square(J, J));
+    auto f = square::finite(L, L, J, J, beta);
+    mp_t Jm = 1;
+    auto bm = boost::math::differentiation::make_fvar<mp_t, 2>(
+        1 / ising::tc::square(Jm, Jm));
+    auto g = square::finite(L, L, Jm, Jm, bm);
+    EXPECT_TRUE(abs(free_energy(g, bm) - free_energy(f, beta)) < 1e-12);
+    EXPECT_TRUE(abs(energy(g, bm) - energy(f, beta)) < 1e-12);
+    EXPECT_TRUE(abs(specific_heat(g, bm) - specific_heat(f, beta)) < 1e-10);
+  }
+}
@@ -19,6 +19,7 @@
 #include <boost/math/differentiation/autodiff.hpp>
 #include <boost/multiprecision/cpp_dec_float.hpp>
 #include "ising/mp_wrapper.hpp"
+#include "ising/tc/square.hpp"
 #include "ising/free_energy/common.hpp"
 #include "ising/free_energy/square.hpp"
 
@@ -37,3 +38,76 @@ TEST(IsingFreeEnergy, Square0) {
   EXPECT_DOUBLE_EQ(-3.9941706779898838, energy(f, beta));
   EXPECT_DOUBLE_EQ(0.024138928587813167, specific_heat(f, beta));
 }
+
+TEST(IsingFreeEnergy, SquareClosed0) {
+  typedef double real_t;
+  real_t J = 1;
+  for (auto t : {0.5, 1.5, 2.2, 2.3, 3.0, 10.0}) {
+    auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+    auto f = square::infinite(J, J, beta);
+    auto g = square::infinite_closed(J, J, beta);
+    EXPECT_NEAR(free_energy(f, beta), free_energy(g, beta), 1e-12);
+    EXPECT_NEAR(energy(f, beta), energy(g, beta), 1e-12);
+    EXPECT_NEAR(specific_heat(f, beta), specific_heat(g, beta), 1e-10);
+  }
+  EXPECT_THROW(square::infinite_closed(1.0, 2.0, 1.0), std::invalid_argument);
+}
+
+TEST(IsingFreeEnergy, SquareClosed1) {
+  typedef mp_wrapper<cpp_dec_float_50> real_t;
+  real_t J = 1;
+  real_t t = 2;
+  auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+  auto g = square::infinite_closed(J, J, beta);
+  auto bd = boost::math::differentiation::make_fvar<double, 2>(0.5);
+  auto gd = square::infinite_closed(1.0, 1.0, bd);
+  EXPECT_TRUE(abs(free_energy(g, beta) - free_energy(gd, bd)) < 1e-13);
+  EXPECT_TRUE(abs(energy(g, beta) - energy(gd, bd)) < 1e-13);
+  EXPECT_TRUE(abs(specific_heat(g, beta) - specific_heat(gd, bd)) < 1e-12);
+}
+
+TEST(IsingFreeEnergy, SquareBonds0) {
+  typedef double real_t;
+  real_t Jx = 1.5, Jy = 2.5, t = 2;
+  auto vars =
+      boost::math::differentiation::make_ftuple<real_t, 2, 1, 1>(1 / t, Jx, Jy);
+  auto& beta = std::get<0>(vars);
+  auto& jx = std::get<1>(vars);
+  auto& jy = std::get<2>(vars);
+  auto f = square::infinite(jx, jy, beta);
+  auto b = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+  auto g = square::infinite(Jx, Jy, b);
+  EXPECT_NEAR(free_energy(g, b), free_energy(f, beta, jx, jy), 1e-12);
+  EXPECT_NEAR(energy(g, b), energy(f, beta, jx, jy), 1e-12);
+  EXPECT_NEAR(specific_heat(g, b), specific_heat(f, beta, jx, jy), 1e-10);
+  EXPECT_NEAR(energy(g, b),
+              energy_x(f, beta, jx, jy) + energy_y(f, beta, jx, jy), 1e-12);
+  // central difference in Jx
+  real_t h = 1e-5;
+  real_t ex = Jx *
+              (square::infinite(Jx + h, Jy, 1 / t) -
+               square::infinite(Jx - h, Jy, 1 / t)) /
+              (2 * h);
+  EXPECT_NEAR(ex, energy_x(f, beta, jx, jy), 1e-8);
+}
+
+TEST(IsingFreeEnergy, SquareBonds1) {
+  // the derivatives of the integrand diverge at the critical point
+  typedef double real_t;
+  real_t Jx = 1, Jy = 2;
+  real_t t = ising::tc::square(Jx, Jy);
+  auto vars =
+      boost::math::differentiation::make_ftuple<real_t, 2, 1, 1>(1 / t, Jx, Jy);
+  auto& beta = std::get<0>(vars);
+  auto& jx = std::get<1>(vars);
+  auto& jy = std::get<2>(vars);
+  auto f = square::infinite(jx, jy, beta);
+  auto b = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+  auto g = square::infinite(Jx, Jy, b);
+  EXPECT_TRUE(std::isfinite(energy(f, beta, jx, jy)));
+  EXPECT_NEAR(free_energy(g, b), free_energy(f, beta, jx, jy), 1e-12);
+  EXPECT_NEAR(energy(g, b), energy(f, beta, jx, jy), 1e-12);
+  EXPECT_NEAR(energy(g, b),
+              energy_x(f, beta, jx, jy) + energy_y(f, beta, jx, jy), 1e-12);
+  EXPECT_GT(specific_heat(f, beta, jx, jy), 1e100);
+}
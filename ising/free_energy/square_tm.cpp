@@ -24,6 +24,7 @@
 #include "common.hpp"
 #include "options.hpp"
 #include "square_tm.hpp"
+#include "sweep.hpp"
 
 using namespace ising::free_energy;
 
@@ -52,23 +53,27 @@ void calc(const options2f& opt) {
             << "# precision: " << std::numeric_limits<real_t>::digits10
             << std::endl
             << "# Lx Ly Jx Jy T 1/T F/N E/N C/N M2/N2\n";
-  for (auto t = Tmin; t < Tmax + 1e-4 * dT; t += dT) {
-    real_t h = 0;
-    auto f =
-        square::transfer_matrix<real_t>::calc(opt.Lx, opt.Ly, Jx, Jy, 1 / t, h);
-    typename square::transfer_matrix<real_t>::result_t beta;
-    beta.set(0, 1 / t);
-    std::cout << opt.Lx << ' ' << opt.Ly << ' ' << Jx << ' ' << Jy << ' ' << t
-              << ' ' << (1 / t) << ' ' << free_energy(f, beta, h) << ' '
-              << energy(f, beta, h) << ' ' << specific_heat(f, beta, h) << ' '
-              << magnetization2(f, beta, h) << std::endl;
-  }
+  sweep(
+      temperatures(Tmin, Tmax, dT),
+      [&](real_t t, std::ostream& os) {
+        real_t h = 0;
+        auto f = square::transfer_matrix<real_t>::calc(opt.Lx, opt.Ly, Jx, Jy,
+                                                       1 / t, h);
+        typename square::transfer_matrix<real_t>::result_t beta;
+        beta.set(0, 1 / t);
+        os << opt.Lx << ' ' << opt.Ly << ' ' << Jx << ' ' << Jy << ' ' << t
+           << ' ' << (1 / t) << ' ' << free_energy(f, beta, h) << ' '
+           << energy(f, beta, h) << ' ' << specific_heat(f, beta, h) << ' '
+           << magnetization2(f, beta, h) << std::endl;
+      },
+      std::cout, opt.threads);
 }
 
 int main(int argc, char** argv) {
   options2f opt(argc, argv);
   if (!opt.valid)
     return 127;
+  exact::parallel::set_num_threads(opt.threads);
   if (opt.prec <= std::numeric_limits<float>::digits10) {
     calc<float>(opt);
   } else if (opt.prec <= std::numeric_limits<double>::digits10) {
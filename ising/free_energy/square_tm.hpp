@@ -19,10 +19,15 @@
 
 #pragma once
 
+#include <algorithm>
 #include <boost/array.hpp>
 #include <cmath>
+#include <functional>
 #include <standards/exp_number.hpp>
 #include <stdexcept>
+#include <vector>
+#include "exact/butterfly.hpp"
+#include "exact/parallel.hpp"
 
 namespace ising {
 namespace free_energy {
@@ -52,45 +57,31 @@ struct transfer_matrix {
     real_t derivatives_[3][3];
   };
 
+  // The element of configuration c and its derivatives are stored together
+  // as v[n_comp * c + k], k = 0 (value), 1, 2 (first and second derivatives
+  // in beta), 3, 4 (in h), so that D and U update all of them in a single
+  // pass over memory.
+  static const uint_t n_comp = 5;
+
   static void fill_D(uint_t Ly, real_t Jy, real_t beta, real_t h,
-                     std::vector<real_t> &diag, std::vector<real_t> &diag_10,
-                     std::vector<real_t> &diag_20, std::vector<real_t> &diag_01,
-                     std::vector<real_t> &diag_02) {
+                     std::vector<real_t> &diag) {
     uint_t dim = 1 << Ly;
-    diag.resize(dim);
-    diag_10.resize(dim);
-    diag_20.resize(dim);
-    diag_01.resize(dim);
-    diag_02.resize(dim);
-    for (uint_t c = 0; c < dim; ++c) {
-      diag[c] = 1;
-      diag_10[c] = 1;
-      diag_20[c] = 1;
-      diag_01[c] = 1;
-      diag_02[c] = 1;
-    }
-    boost::array<real_t, 2> weight;
-    weight[0] = std::exp(beta * Jy);
-    weight[1] = std::exp(-beta * Jy);
+    diag.resize(n_comp * dim);
+    boost::array<real_t, 2> weight_y, weight_h;
+    weight_y[0] = std::exp(beta * Jy);
+    weight_y[1] = std::exp(-beta * Jy);
+    weight_h[0] = std::exp(beta * h);
+    weight_h[1] = std::exp(-beta * h);
     for (uint_t c = 0; c < dim; ++c) {
-      real_t elem = diag[c];
+      real_t elem = 1;
       for (uint_t b = 0; b < Ly; ++b) {
         uint_t s0 = b;
         uint_t s1 = (b + 1) % Ly;
-        elem *= weight[((c >> s0) & 1) ^ ((c >> s1) & 1)];
+        elem *= weight_y[((c >> s0) & 1) ^ ((c >> s1) & 1)];
       }
-      diag[c] = elem;
-    }
-    weight[0] = std::exp(beta * h);
-    weight[1] = std::exp(-beta * h);
-    for (uint_t c = 0; c < dim; ++c) {
-      real_t elem = diag[c];
       for (uint_t s = 0; s < Ly; ++s) {
-        elem *= weight[((c >> s) & 1)];
+        elem *= weight_h[((c >> s) & 1)];
       }
-      diag[c] = elem;
-    }
-    for (uint_t c = 0; c < dim; ++c) {
       real_t factor = 0;
       for (uint_t b = 0; b < Ly; ++b) {
         uint_t s0 = b;
@@ -101,148 +92,329 @@ struct transfer_matrix {
       for (uint_t s = 0; s < Ly; ++s) {
         factor += h * (-2.0 * ((c >> s) & 1) + 1);
       }
-      diag_10[c] = diag[c] * factor;
-      diag_20[c] = diag[c] * factor * factor;
-    }
-    for (uint_t c = 0; c < dim; ++c) {
-      real_t factor = 0;
+      real_t factor_h = 0;
       for (uint_t s = 0; s < Ly; ++s) {
-        factor += beta * (-2.0 * ((c >> s) & 1) + 1);
+        factor_h += beta * (-2.0 * ((c >> s) & 1) + 1);
       }
-      diag_01[c] = diag[c] * factor;
-      diag_02[c] = diag[c] * factor * factor;
+      real_t *d = &diag[n_comp * c];
+      d[0] = elem;
+      d[1] = elem * factor;
+      d[2] = elem * factor * factor;
+      d[3] = elem * factor_h;
+      d[4] = elem * factor_h * factor_h;
     }
   }
 
-  static exp_number product_D(
-      std::vector<real_t> const &diag, std::vector<real_t> const &diag_10,
-      std::vector<real_t> const &diag_20, std::vector<real_t> const &diag_01,
-      std::vector<real_t> const &diag_02, exp_number factor,
-      std::vector<real_t> &v, std::vector<real_t> &v_10,
-      std::vector<real_t> &v_20, std::vector<real_t> &v_01,
-      std::vector<real_t> &v_02) {
-    uint_t dim = diag.size();
-    real_t norm2 = 0;
-    for (uint_t c = 0; c < dim; ++c) {
-      v_20[c] =
-          diag_20[c] * v[c] + 2 * diag_10[c] * v_10[c] + diag[c] * v_20[c];
-      v_10[c] = diag_10[c] * v[c] + diag[c] * v_10[c];
-      v_02[c] =
-          diag_02[c] * v[c] + 2 * diag_01[c] * v_01[c] + diag[c] * v_02[c];
-      v_01[c] = diag_01[c] * v[c] + diag[c] * v_01[c];
-      v[c] = diag[c] * v[c];
-      norm2 += v[c] * v[c];
-    }
-    auto norm_inv = 1 / std::sqrt(norm2);
-    for (uint_t c = 0; c < dim; ++c) {
-      v_20[c] *= norm_inv;
-      v_10[c] *= norm_inv;
-      v_02[c] *= norm_inv;
-      v_01[c] *= norm_inv;
-      v[c] *= norm_inv;
-    }
-    return factor / norm_inv;
+  // The passes over a vector are split into blocks of 2^block_bits
+  // configurations that run in parallel when calc traces the panels one at
+  // a time; the norm is summed blockwise in a fixed order, so that it does
+  // not depend on the number of threads.
+  static const uint_t block_bits = 12;
+
+  // Number of starting vectors propagated together by calc, as a panel of
+  // 2^Ly x panel_width elements (per component) stored lane-innermost,
+  // v[(n_comp * c + k) * B + b].  Each diagonal weight and butterfly pair
+  // loaded from memory is then applied to all the lanes.  calc may narrow
+  // the panels (see workspace_limit()).
+  static uint_t &panel_width() {
+    static uint_t width = 8;
+    return width;
+  }
+
+  // Above this Ly a single vector no longer fits in the caches, and a panel
+  // only multiplies the memory of each worker; calc then uses B = 1.
+  static const uint_t panel_max_bits = 16;
+
+  // Upper bound in bytes of the panel workspaces of calc summed over the
+  // workers, n_comp 2^Ly B real_t each.  calc narrows the panels and then
+  // runs fewer workers to stay within it.
+  static std::size_t &workspace_limit() {
+    static std::size_t bytes = std::size_t(1) << 30;
+    return bytes;
+  }
+
+  static uint_t num_blocks(uint_t dim) {
+    return dim > (uint_t(1) << block_bits) ? (dim >> block_bits) : 1;
+  }
+
+  static exp_number product_D(std::vector<real_t> const &diag,
+                              exp_number factor, std::vector<real_t> &v) {
+    product_D<1>(diag, &factor, v);
+    return factor;
   }
 
   static exp_number product_U(uint_t Ly, real_t Jx, real_t beta,
-                              exp_number factor, std::vector<real_t> &v,
-                              std::vector<real_t> &v_10,
-                              std::vector<real_t> &v_20,
-                              std::vector<real_t> &v_01,
-                              std::vector<real_t> &v_02,
-                              std::vector<real_t> &vt) {
+                              exp_number factor, std::vector<real_t> &v) {
+    product_U<1>(Ly, Jx, beta, &factor, v);
+    return factor;
+  }
+
+  template <std::size_t B>
+  static void product_D(std::vector<real_t> const &diag, exp_number *factor,
+                        std::vector<real_t> &v) {
+    uint_t dim = diag.size() / n_comp;
+    uint_t nb = num_blocks(dim), bs = dim / nb;
+    boost::array<real_t, B> zero;
+    zero.fill(real_t(0));
+    auto norm2 = exact::parallel::reduce(
+        nb, zero,
+        [&](std::size_t k) {
+          boost::array<real_t, B> sum = zero;
+          for (uint_t c = k * bs; c < (k + 1) * bs; ++c) {
+            const real_t d0 = diag[n_comp * c], d1 = diag[n_comp * c + 1],
+                         d2 = diag[n_comp * c + 2], d3 = diag[n_comp * c + 3],
+                         d4 = diag[n_comp * c + 4];
+            real_t *w = &v[n_comp * c * B];
+            for (std::size_t b = 0; b < B; ++b) {
+              real_t w0 = w[b], w1 = w[B + b], w3 = w[3 * B + b];
+              w[2 * B + b] = d2 * w0 + 2 * d1 * w1 + d0 * w[2 * B + b];
+              w[B + b] = d1 * w0 + d0 * w1;
+              w[4 * B + b] = d4 * w0 + 2 * d3 * w3 + d0 * w[4 * B + b];
+              w[3 * B + b] = d3 * w0 + d0 * w3;
+              w[b] = d0 * w0;
+              sum[b] += w[b] * w[b];
+            }
+          }
+          return sum;
+        },
+        add<B>);
+    normalize<B>(norm2, factor, v);
+  }
+
+  // Butterflies on the pairs c0, c1 = c0 ^ (1 << s), updated in place on the
+  // cache-blocked schedule of exact::butterfly
+  template <std::size_t B>
+  static void product_U(uint_t Ly, real_t Jx, real_t beta, exp_number *factor,
+                        std::vector<real_t> &v) {
     uint_t dim = 1 << Ly;
     boost::array<double, 2> weight;
     weight[0] = std::exp(beta * Jx);
     weight[1] = std::exp(-beta * Jx);
-    for (uint_t s = 0; s < Ly; ++s) {
-      for (uint_t c0 = 0; c0 < dim; ++c0) {
-        uint_t c1 = c0 ^ (1 << s);
-        vt[c0] = Jx * Jx * (weight[0] * v[c0] + weight[1] * v[c1]) +
-                 2 * Jx * (weight[0] * v_10[c0] - weight[1] * v_10[c1]) +
-                 (weight[0] * v_20[c0] + weight[1] * v_20[c1]);
-      }
-      std::swap(v_20, vt);
-      for (uint_t c0 = 0; c0 < dim; ++c0) {
-        uint_t c1 = c0 ^ (1 << s);
-        vt[c0] = Jx * (weight[0] * v[c0] - weight[1] * v[c1]) +
-                 (weight[0] * v_10[c0] + weight[1] * v_10[c1]);
-      }
-      std::swap(v_10, vt);
-      for (uint_t c0 = 0; c0 < dim; ++c0) {
-        uint_t c1 = c0 ^ (1 << s);
-        vt[c0] = (weight[0] * v_02[c0] + weight[1] * v_02[c1]);
-      }
-      std::swap(v_02, vt);
-      for (uint_t c0 = 0; c0 < dim; ++c0) {
-        uint_t c1 = c0 ^ (1 << s);
-        vt[c0] = (weight[0] * v_01[c0] + weight[1] * v_01[c1]);
-      }
-      std::swap(v_01, vt);
-      for (uint_t c0 = 0; c0 < dim; ++c0) {
-        uint_t c1 = c0 ^ (1 << s);
-        vt[c0] = weight[0] * v[c0] + weight[1] * v[c1];
-      }
-      std::swap(v, vt);
+    exact::butterfly::apply(
+        Ly,
+        [&](std::size_t s, std::size_t c, std::size_t n) {
+          // local copies, which the stores into v cannot alias
+          const double w0 = weight[0], w1 = weight[1];
+          const real_t J = Jx;
+          real_t *p = v.data();
+          uint_t bit = uint_t(1) << s;
+          for (uint_t c0 = c; c0 < c + n; ++c0) {
+            real_t *pa = p + n_comp * c0 * B;
+            real_t *pb = p + n_comp * (c0 + bit) * B;
+            for (std::size_t l = 0; l < B; ++l) {
+              real_t *a = pa + l;
+              real_t *b = pb + l;
+              real_t a0 = a[0], a1 = a[B], a2 = a[2 * B], a3 = a[3 * B], a4 = a[4 * B];
+              real_t b0 = b[0], b1 = b[B], b2 = b[2 * B], b3 = b[3 * B], b4 = b[4 * B];
+              a[2 * B] = J * J * (w0 * a0 + w1 * b0) +
+                         2 * J * (w0 * a1 - w1 * b1) +
+                         (w0 * a2 + w1 * b2);
+              b[2 * B] = J * J * (w0 * b0 + w1 * a0) +
+                         2 * J * (w0 * b1 - w1 * a1) +
+                         (w0 * b2 + w1 * a2);
+              a[B] = J * (w0 * a0 - w1 * b0) + (w0 * a1 + w1 * b1);
+              b[B] = J * (w0 * b0 - w1 * a0) + (w0 * b1 + w1 * a1);
+              a[4 * B] = w0 * a4 + w1 * b4;
+              b[4 * B] = w0 * b4 + w1 * a4;
+              a[3 * B] = w0 * a3 + w1 * b3;
+              b[3 * B] = w0 * b3 + w1 * a3;
+              a[0] = w0 * a0 + w1 * b0;
+              b[0] = w0 * b0 + w1 * a0;
+            }
+          }
+        },
+        exact::butterfly::tile_bits(n_comp * B * sizeof(real_t)));
+    uint_t nb = num_blocks(dim), bs = dim / nb;
+    boost::array<real_t, B> zero;
+    zero.fill(real_t(0));
+    auto norm2 = exact::parallel::reduce(
+        nb, zero,
+        [&](std::size_t k) {
+          boost::array<real_t, B> sum = zero;
+          for (uint_t c = k * bs; c < (k + 1) * bs; ++c)
+            for (std::size_t b = 0; b < B; ++b)
+              sum[b] += v[n_comp * c * B + b] * v[n_comp * c * B + b];
+          return sum;
+        },
+        add<B>);
+    normalize<B>(norm2, factor, v);
+  }
+
+  template <std::size_t B>
+  static boost::array<real_t, B> add(boost::array<real_t, B> a,
+                                     boost::array<real_t, B> const &b) {
+    for (std::size_t l = 0; l < B; ++l) a[l] += b[l];
+    return a;
+  }
+
+  template <std::size_t B>
+  static void normalize(boost::array<real_t, B> const &norm2,
+                        exp_number *factor, std::vector<real_t> &v) {
+    boost::array<real_t, B> norm_inv;
+    for (std::size_t b = 0; b < B; ++b) {
+      norm_inv[b] = 1 / std::sqrt(norm2[b]);
+      factor[b] = factor[b] / norm_inv[b];
     }
-    real_t norm2 = 0;
+    uint_t nb = num_blocks(v.size() / (n_comp * B)), bs = v.size() / (n_comp * B) / nb;
+    exact::parallel::for_each(nb, [&](std::size_t k) {
+      for (uint_t c = k * bs; c < (k + 1) * bs; ++c)
+        for (uint_t j = 0; j < n_comp; ++j)
+          for (std::size_t b = 0; b < B; ++b) v[(n_comp * c + j) * B + b] *= norm_inv[b];
+    });
+  }
+
+  // Whether calc traces only one starting vector per symmetry orbit
+  static bool &use_symmetry() {
+    static bool flag = true;
+    return flag;
+  }
+
+  // Starting vectors of the trace and the multiplicities of their
+  // components.  T commutes with the cyclic translations and the reflection
+  // of a column, and for h = 0 with the spin flip, so that <c| T^Lx |c> is
+  // the same for all c in an orbit.  Only the smallest c of each orbit is
+  // traced, weighted by the size of the orbit.  The first derivative in h is
+  // odd under the flip and cancels between c and its flip.
+  static void orbits(uint_t Ly, bool flip, std::vector<uint_t> &start,
+                     std::vector<boost::array<real_t, n_comp> > &weight) {
+    uint_t dim = 1 << Ly;
+    uint_t mask = dim - 1;
+    std::vector<uint_t> image(2 * Ly);
+    start.clear();
+    weight.clear();
     for (uint_t c = 0; c < dim; ++c) {
-      norm2 += v[c] * v[c];
+      bool smallest = true, self_dual = false;
+      for (uint_t r = 0; r < Ly && smallest; ++r) {
+        uint_t t = ((c << r) | (c >> (Ly - r))) & mask;
+        uint_t u = 0;
+        for (uint_t s = 0; s < Ly; ++s) u |= ((t >> s) & 1) << (Ly - 1 - s);
+        image[2 * r] = t;
+        image[2 * r + 1] = u;
+        for (uint_t i : {t, u}) {
+          if (i < c || (flip && (i ^ mask) < c)) smallest = false;
+          if (flip && (i ^ mask) == c) self_dual = true;
+        }
+      }
+      if (!smallest) continue;
+      std::sort(image.begin(), image.end());
+      real_t w = std::unique(image.begin(), image.end()) - image.begin();
+      boost::array<real_t, n_comp> m;
+      for (uint_t j = 0; j < n_comp; ++j)
+        m[j] = (flip && !self_dual) ? ((j == 3) ? 0 : 2 * w) : w;
+      start.push_back(c);
+      weight.push_back(m);
     }
-    real_t norm_inv = 1 / std::sqrt(norm2);
-    for (uint_t c = 0; c < dim; ++c) {
-      v_20[c] *= norm_inv;
-      v_10[c] *= norm_inv;
-      v_02[c] *= norm_inv;
-      v_01[c] *= norm_inv;
-      v[c] *= norm_inv;
+  }
+
+  // Partial sums of <i| T^Lx |i> over the starting vectors i = start[first],
+  // ..., start[first + B - 1] (those beyond the end are skipped), propagated
+  // as one panel
+  template <std::size_t B>
+  static boost::array<exp_number, n_comp> trace_panel(
+      uint_t Lx, uint_t Ly, real_t Jx, real_t beta,
+      std::vector<real_t> const &diag, std::vector<uint_t> const &start,
+      std::vector<boost::array<real_t, n_comp> > const &weight, uint_t first) {
+    uint_t dim = 1 << Ly;
+    uint_t num = start.size();
+    // lanes beyond the end repeat the first starting vector and are dropped
+    boost::array<uint_t, B> lane;
+    for (std::size_t b = 0; b < B; ++b)
+      lane[b] = (first + b < num) ? first + b : first;
+    std::vector<real_t> v(n_comp * dim * B, real_t(0));
+    boost::array<exp_number, B> factor;
+    for (std::size_t b = 0; b < B; ++b) {
+      v[n_comp * start[lane[b]] * B + b] = 1;
+      factor[b] = 1;
     }
-    return factor / norm_inv;
+    for (uint_t x = 0; x < Lx; ++x) {
+      product_D<B>(diag, factor.data(), v);
+      product_U<B>(Ly, Jx, beta, factor.data(), v);
+    }
+    boost::array<exp_number, n_comp> part;
+    part.fill(exp_number(0));
+    for (std::size_t b = 0; b < B && first + b < num; ++b)
+      for (uint_t j = 0; j < n_comp; ++j)
+        part[j] += factor[b] * (weight[lane[b]][j] *
+                                v[(n_comp * start[lane[b]] + j) * B + b]);
+    return part;
   }
 
   static result_t calc(uint_t Lx, uint_t Ly, real_t Jx, real_t Jy, real_t beta,
                        real_t h) {
+    return calc(Lx, Ly, Jx, Jy, beta, h, panel_width());
+  }
+
+  static result_t calc(uint_t Lx, uint_t Ly, real_t Jx, real_t Jy, real_t beta,
+                       real_t h, uint_t panel) {
     if (Lx == 0 || Ly == 0)
       throw(std::invalid_argument("Lx and Ly should be positive"));
     if (beta <= 0)
       throw(std::invalid_argument("beta should be positive"));
+    if (panel == 0 || panel > 16 || (panel & (panel - 1)) != 0)
+      throw(std::invalid_argument("panel width should be 1, 2, 4, 8, or 16"));
     uint_t dim = 1 << Ly;
 
-    std::vector<real_t> diag(dim), diag_10(dim), diag_20(dim), diag_01(dim),
-        diag_02(dim);
-    fill_D(Ly, Jy, beta, h, diag, diag_10, diag_20, diag_01, diag_02);
+    std::vector<real_t> diag;
+    fill_D(Ly, Jy, beta, h, diag);
 
-    result_t res;
-    exp_number sum = 0;
-    exp_number sum_10 = 0;
-    exp_number sum_20 = 0;
-    exp_number sum_01 = 0;
-    exp_number sum_02 = 0;
-    std::vector<real_t> v(dim), v_10(dim), v_20(dim), v_01(dim), v_02(dim),
-        vt(dim);
-    for (uint_t i = 0; i < dim; ++i) {
-      exp_number factor = 1;
-      for (uint_t j = 0; j < dim; ++j) {
-        v[j] = 0;
-        v_10[j] = 0;
-        v_20[j] = 0;
-        v_01[j] = 0;
-        v_02[j] = 0;
-      }
-      v[i] = 1;
-      for (uint_t x = 0; x < Lx; ++x) {
-        factor = transfer_matrix<real_t>::product_D(diag, diag_10, diag_20,
-                                                    diag_01, diag_02, factor, v,
-                                                    v_10, v_20, v_01, v_02);
-        factor = transfer_matrix<real_t>::product_U(Ly, Jx, beta, factor, v,
-                                                    v_10, v_20, v_01, v_02, vt);
+    std::vector<uint_t> start;
+    std::vector<boost::array<real_t, n_comp> > weight;
+    if (use_symmetry()) {
+      orbits(Ly, h == 0, start, weight);
+    } else {
+      boost::array<real_t, n_comp> one;
+      one.fill(real_t(1));
+      for (uint_t c = 0; c < dim; ++c) {
+        start.push_back(c);
+        weight.push_back(one);
       }
-      sum += factor * v[i];
-      sum_10 += factor * v_10[i];
-      sum_20 += factor * v_20[i];
-      sum_01 += factor * v_01[i];
-      sum_02 += factor * v_02[i];
     }
+
+    // The panels of starting vectors are traced on the threads of
+    // exact::parallel, each with its own workspace.  The panel width and the
+    // number of workers are chosen so that the workspaces stay within
+    // workspace_limit().  The partial sums of the panels are combined in a
+    // fixed order, independent of the number of threads.
+    //
+    // Only one level runs in parallel, as nested loops of exact::parallel
+    // run serially.  While a vector has fewer blocks of 2^block_bits
+    // configurations than there are threads, the panels are traced in
+    // parallel and the passes over each panel run serially.  From there on
+    // the panels are traced one after another, and the passes of product_D,
+    // product_U, and normalize run on all the threads.
+    std::size_t lane_bytes = n_comp * dim * sizeof(real_t);
+    if (Ly > panel_max_bits) panel = 1;
+    while (panel > 1 && panel * lane_bytes > workspace_limit()) panel /= 2;
+    unsigned threads = exact::parallel::num_threads();
+    unsigned workers = std::max<std::size_t>(
+        1, std::min<std::size_t>(threads, workspace_limit() / (panel * lane_bytes)));
+    if (num_blocks(dim) >= threads) workers = 1;
+    typedef boost::array<exp_number, n_comp> sums_t;
+    uint_t num_panels = (start.size() + panel - 1) / panel;
+    auto trace = [&](std::size_t k) -> sums_t {
+      switch (panel) {
+      case 1: return trace_panel<1>(Lx, Ly, Jx, beta, diag, start, weight, k * panel);
+      case 2: return trace_panel<2>(Lx, Ly, Jx, beta, diag, start, weight, k * panel);
+      case 4: return trace_panel<4>(Lx, Ly, Jx, beta, diag, start, weight, k * panel);
+      case 8: return trace_panel<8>(Lx, Ly, Jx, beta, diag, start, weight, k * panel);
+      default: return trace_panel<16>(Lx, Ly, Jx, beta, diag, start, weight, k * panel);
+      }
+    };
+    sums_t zero;
+    zero.fill(exp_number(0));
+    sums_t sums = exact::parallel::reduce(
+        num_panels, zero, trace,
+        [](sums_t a, sums_t const &b) {
+          for (uint_t j = 0; j < n_comp; ++j) a[j] += b[j];
+          return a;
+        },
+        workers);
+    exp_number sum = sums[0];
+    exp_number sum_10 = sums[1];
+    exp_number sum_20 = sums[2];
+    exp_number sum_01 = sums[3];
+    exp_number sum_02 = sums[4];
+    result_t res;
     res.set(0, 0, -log(sum) / (Lx * Ly * beta));
     res.set(1, 0, ((log(sum) / beta) - (sum_10 / sum)) / (Lx * Ly * beta));
     res.set(2, 0,
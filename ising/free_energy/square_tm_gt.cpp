@@ -36,3 +36,107 @@ TEST(IsingFreeEnergy, SquareCount0) {
   EXPECT_NEAR(2.452622208849045e-02, specific_heat(f, beta, h), 1e-10);
   EXPECT_NEAR(1.597700713244840e+01, magnetization2(f, beta, h), 1e-10);
 }
+
+TEST(IsingFreeEnergy, SquareTMField) {
+  unsigned Lx = 3;
+  unsigned Ly = 4;
+  unsigned n = Lx * Ly;
+  double Jx = 1.2;
+  double Jy = 0.7;
+  double t = 1.5;
+  double h = 0.3;
+  double z = 0, e = 0, m = 0, m2 = 0;
+  for (unsigned c = 0; c < (1u << n); ++c) {
+    double energy = 0, mag = 0;
+    for (unsigned x = 0; x < Lx; ++x) {
+      for (unsigned y = 0; y < Ly; ++y) {
+        double s = 1 - 2.0 * ((c >> (y + Ly * x)) & 1);
+        double sx = 1 - 2.0 * ((c >> (y + Ly * ((x + 1) % Lx))) & 1);
+        double sy = 1 - 2.0 * ((c >> ((y + 1) % Ly + Ly * x)) & 1);
+        energy -= Jx * s * sx + Jy * s * sy + h * s;
+        mag += s;
+      }
+    }
+    double w = std::exp(-energy / t);
+    z += w;
+    e += w * energy;
+    m += w * mag;
+    m2 += w * mag * mag;
+  }
+  square::transfer_matrix<double>::result_t beta;
+  beta.set(0, 0, 1 / t);
+  auto f = square::transfer_matrix<double>::calc(Lx, Ly, Jx, Jy, 1 / t, h);
+  EXPECT_NEAR(-t * std::log(z) / n, free_energy(f, beta, h), 1e-12);
+  EXPECT_NEAR(e / z / n, energy(f, beta, h), 1e-12);
+  EXPECT_NEAR(m / z / n, -f.derivative(0, 1), 1e-12);
+  EXPECT_NEAR(m2 / z / n, magnetization2(f, beta, h), 1e-12);
+}
+
+TEST(IsingFreeEnergy, SquareTMPanel) {
+  // panels wider than the number of starting vectors (2^Ly = 8) included
+  unsigned Lx = 5;
+  unsigned Ly = 3;
+  double Jx = 0.9;
+  double Jy = 1.3;
+  double beta = 0.6;
+  double h = 0.2;
+  typedef square::transfer_matrix<double> tm;
+  auto f1 = tm::calc(Lx, Ly, Jx, Jy, beta, h, 1);
+  for (unsigned panel : {2, 4, 8, 16}) {
+    auto f = tm::calc(Lx, Ly, Jx, Jy, beta, h, panel);
+    // the second derivative in beta is a difference of large sums
+    for (unsigned i = 0; i < 3; ++i)
+      EXPECT_NEAR(f1.derivative(i, 0), f.derivative(i, 0), (i < 2) ? 1e-12 : 1e-10);
+    for (unsigned j = 1; j < 3; ++j)
+      EXPECT_NEAR(f1.derivative(0, j), f.derivative(0, j), 1e-12);
+  }
+  EXPECT_THROW(tm::calc(Lx, Ly, Jx, Jy, beta, h, 3), std::invalid_argument);
+  EXPECT_THROW(tm::calc(Lx, Ly, Jx, Jy, beta, h, 32), std::invalid_argument);
+}
+
+TEST(IsingFreeEnergy, SquareTMWorkspace) {
+  unsigned Lx = 5;
+  unsigned Ly = 3;
+  double Jx = 0.9;
+  double Jy = 1.3;
+  double beta = 0.6;
+  double h = 0.2;
+  typedef square::transfer_matrix<double> tm;
+  auto f1 = tm::calc(Lx, Ly, Jx, Jy, beta, h, 1);
+  // room for two lanes of 2^Ly configurations: panels of 16 are narrowed to
+  // 2 and traced by a single worker
+  std::size_t limit = tm::workspace_limit();
+  tm::workspace_limit() = 2 * tm::n_comp * (1 << Ly) * sizeof(double);
+  auto f = tm::calc(Lx, Ly, Jx, Jy, beta, h, 16);
+  tm::workspace_limit() = limit;
+  for (unsigned i = 0; i < 3; ++i)
+    EXPECT_NEAR(f1.derivative(i, 0), f.derivative(i, 0), (i < 2) ? 1e-12 : 1e-10);
+  for (unsigned j = 1; j < 3; ++j)
+    EXPECT_NEAR(f1.derivative(0, j), f.derivative(0, j), 1e-12);
+}
+
+TEST(IsingFreeEnergy, SquareTMSymmetry) {
+  typedef square::transfer_matrix<double> tm;
+  for (unsigned Ly = 1; Ly <= 7; ++Ly) {
+    for (bool flip : {false, true}) {
+      std::vector<tm::uint_t> start;
+      std::vector<boost::array<double, tm::n_comp> > weight;
+      tm::orbits(Ly, flip, start, weight);
+      double total = 0;
+      for (auto const& w : weight) total += w[0];
+      EXPECT_EQ(1u << Ly, total);
+    }
+  }
+  for (double h : {0.0, 0.3}) {
+    for (unsigned Ly = 1; Ly <= 6; ++Ly) {
+      tm::use_symmetry() = false;
+      auto f0 = tm::calc(3, Ly, 0.9, 1.3, 0.6, h);
+      tm::use_symmetry() = true;
+      auto f1 = tm::calc(3, Ly, 0.9, 1.3, 0.6, h);
+      for (unsigned i = 0; i < 3; ++i)
+        EXPECT_NEAR(f0.derivative(i, 0), f1.derivative(i, 0), (i < 2) ? 1e-12 : 1e-10);
+      for (unsigned j = 1; j < 3; ++j)
+        EXPECT_NEAR(f0.derivative(0, j), f1.derivative(0, j), 1e-12);
+    }
+  }
+}
@@ -0,0 +1,91 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Temperature sweep evaluated in parallel with rows printed in order
+
+#pragma once
+
+#include <algorithm>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "exact/parallel.hpp"
+
+namespace ising {
+namespace free_energy {
+
+template <typename T>
+inline std::vector<T> temperatures(T Tmin, T Tmax, T dT) {
+  std::vector<T> ts;
+  for (auto t = Tmin; t < Tmax + 1e-4 * dT; t += dT)
+    ts.push_back(t);
+  return ts;
+}
+
+// evaluate(first, last, os) writes the rows for the temperatures in [first,
+// last) to os.  Blocks of temperatures are distributed over the threads, and
+// each finished block is flushed to out as soon as all preceding blocks are.
+template <typename T, typename F>
+inline void sweep_blocks(std::vector<T> const& ts, std::size_t block,
+                         F evaluate, std::ostream& out,
+                         unsigned threads = 0) {
+  typedef typename std::vector<T>::const_iterator iterator;
+  if (block == 0)
+    block = 1;
+  std::size_t n = (ts.size() + block - 1) / block;
+  std::vector<std::string> rows(n);
+  std::vector<bool> done(n, false);
+  std::size_t next = 0;
+  std::mutex mutex;
+  exact::parallel::for_each(
+      n,
+      [&](std::size_t i) {
+        std::ostringstream os;
+        os.copyfmt(out);
+        iterator first = ts.begin() + i * block;
+        iterator last = ts.begin() + std::min((i + 1) * block, ts.size());
+        evaluate(first, last, os);
+        std::lock_guard<std::mutex> lock(mutex);
+        rows[i] = os.str();
+        done[i] = true;
+        while (next < n && done[next]) {
+          out << rows[next];
+          rows[next].clear();
+          ++next;
+        }
+        out << std::flush;
+      },
+      threads);
+}
+
+// evaluate(t, os) writes the row for temperature t to os
+template <typename T, typename F>
+inline void sweep(std::vector<T> const& ts, F evaluate, std::ostream& out,
+                  unsigned threads = 0) {
+  typedef typename std::vector<T>::const_iterator iterator;
+  sweep_blocks(
+      ts, 1,
+      [&](iterator first, iterator last, std::ostream& os) {
+        for (; first != last; ++first)
+          evaluate(*first, os);
+      },
+      out, threads);
+}
+
+}  // end namespace free_energy
+}  // end namespace ising
@@ -0,0 +1,46 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <iomanip>
+#include <sstream>
+#include <gtest/gtest.h>
+#include <boost/math/differentiation/autodiff.hpp>
+#include "ising/free_energy/common.hpp"
+#include "ising/free_energy/square.hpp"
+#include "ising/free_energy/sweep.hpp"
+
+using namespace ising::free_energy;
+
+TEST(IsingFreeEnergy, Sweep0) {
+  typedef double real_t;
+  real_t Jx = 1.5;
+  real_t Jy = 2.5;
+  auto ts = temperatures<real_t>(1, 5, 0.25);
+  EXPECT_EQ(17, ts.size());
+  auto row = [&](real_t t, std::ostream& os) {
+    auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+    auto f = square::finite(4, 6, Jx, Jy, beta);
+    os << t << ' ' << free_energy(f, beta) << ' ' << energy(f, beta) << ' '
+       << specific_heat(f, beta) << std::endl;
+  };
+  std::ostringstream serial, parallel;
+  serial << std::scientific << std::setprecision(15);
+  parallel << std::scientific << std::setprecision(15);
+  for (auto t : ts)
+    row(t, serial);
+  sweep(ts, row, parallel, 4);
+  EXPECT_EQ(serial.str(), parallel.str());
+}
@@ -21,14 +21,16 @@
 #include <boost/math/differentiation/autodiff.hpp>
 #include <boost/multiprecision/cpp_dec_float.hpp>
 #include "ising/mp_wrapper.hpp"
+#include "sweep.hpp"
 #include "triangular.hpp"
 
 struct options {
   unsigned int prec;
+  unsigned int threads;
   std::string Ja, Jb, Jc, Tmin, Tmax, dT;
   bool valid;
   options(unsigned int argc, char *argv[])
-      : prec(15), Ja("1"), Jb("1"), Jc("1"), valid(true) {
+      : prec(15), threads(0), Ja("1"), Jb("1"), Jc("1"), valid(true) {
     if (argc == 1) {
       valid = false;
       return;
@@ -44,6 +46,13 @@ struct options {
               }
               prec = std::atoi(argv[i]);
               break;
+            case 'n':
+              if (++i == argc) {
+                valid = false;
+                return;
+              }
+              threads = std::atoi(argv[i]);
+              break;
             default:
               valid = false;
               return;
@@ -102,23 +111,27 @@ void calc(const options &opt) {
             << "# precision: " << std::numeric_limits<real_t>::digits10
             << std::endl
             << "# Lx Ly Ja Jb Jc T 1/T F/N E/N C/N\n";
-  for (auto t = Tmin; t < Tmax + 1e-4 * dT; t += dT) {
-    auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
-    auto f = triangular::infinite(Ja, Jb, Jc, beta);
-    std::cout << "inf inf " << Ja << ' ' << Jb << ' ' << Jc << ' ' << t << ' '
-              << (1 / t) << ' ' << free_energy(f, beta) << ' '
-              << energy(f, beta) << ' ' << specific_heat(f, beta) << std::endl;
-  }
+  sweep(
+      temperatures(Tmin, Tmax, dT),
+      [&](real_t t, std::ostream &os) {
+        auto beta = boost::math::differentiation::make_fvar<real_t, 2>(1 / t);
+        auto f = triangular::infinite(Ja, Jb, Jc, beta);
+        os << "inf inf " << Ja << ' ' << Jb << ' ' << Jc << ' ' << t << ' '
+           << (1 / t) << ' ' << free_energy(f, beta) << ' ' << energy(f, beta)
+           << ' ' << specific_heat(f, beta) << std::endl;
+      },
+      std::cout, opt.threads);
 }
 
 int main(int argc, char **argv) {
   using namespace boost::multiprecision;
   options opt(argc, argv);
   if (!opt.valid) {
-    std::cerr << "Usage: " << argv[0] << " [-p prec] T\n"
-              << "       " << argv[0] << " [-p prec] J T\n"
-              << "       " << argv[0] << " [-p prec] Ja Jb Jc T\n"
-              << "       " << argv[0] << " [-p prec] Ja Jb Jc Tmin Tmax dT\n";
+    std::cerr << "Usage: " << argv[0] << " [-p prec] [-n threads] T\n"
+              << "       " << argv[0] << " [-p prec] [-n threads] J T\n"
+              << "       " << argv[0] << " [-p prec] [-n threads] Ja Jb Jc T\n"
+              << "       " << argv[0]
+              << " [-p prec] [-n threads] Ja Jb Jc Tmin Tmax dT\n";
     return 127;
   }
   if (opt.prec <= std::numeric_limits<float>::digits10) {
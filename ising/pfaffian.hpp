@@ -0,0 +1,356 @@
+/*
+   Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Calculating free energy of zero-field Ising model on square lattice with
+// arbitrary couplings by Pfaffians
+
+// reference: H. S. Green and C. A. Hurst, Order-Disorder Phenomena
+// (Interscience, 1964); the torus by the four-Pfaffian combination as in
+// ising/free_energy/square.hpp (finite)
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <boost/math/differentiation/autodiff.hpp>
+#include "exact/parallel.hpp"
+
+namespace ising {
+
+struct pfaffian {
+public:
+  // Lx and Ly if the sites are numbered x + Lx y on a periodic Lx x Ly lattice
+  // (Lx, Ly >= 2) with one bond to (x + 1, y) and one to (x, y + 1) from each
+  // site; bx[s] and by[s] are then the indices of these bonds.  Open
+  // boundaries are given by zero couplings on the wrapping bonds.  Returns
+  // false otherwise.
+  template<typename LATTICE>
+  static bool square_geometry(LATTICE const& lat, unsigned& Lx, unsigned& Ly,
+                              std::vector<std::size_t>& bx, std::vector<std::size_t>& by) {
+    std::size_t n = lat.num_sites();
+    if (lat.num_bonds() != 2 * n) return false;
+    for (Lx = 2; Lx <= n / 2; ++Lx) {
+      if (n % Lx) continue;
+      Ly = n / Lx;
+      auto tx = [&](std::size_t s) { return (s / Lx) * Lx + (s + 1) % Lx; };
+      auto ty = [&](std::size_t s) { return (s + Lx) % n; };
+      bx.assign(n, lat.num_bonds());
+      by.assign(n, lat.num_bonds());
+      bool ok = true;
+      for (std::size_t b = 0; ok && b < lat.num_bonds(); ++b) {
+        std::size_t i = lat.source(b), j = lat.target(b);
+        if (j == tx(i) && bx[i] == lat.num_bonds()) bx[i] = b;
+        else if (i == tx(j) && bx[j] == lat.num_bonds()) bx[j] = b;
+        else if (j == ty(i) && by[i] == lat.num_bonds()) by[i] = b;
+        else if (i == ty(j) && by[j] == lat.num_bonds()) by[j] = b;
+        else ok = false;
+      }
+      if (ok) return true;
+    }
+    return false;
+  }
+
+  // log Z for couplings inter[b] and inverse temperature beta of type U,
+  // which may be a multiprecision type or carry derivatives (autodiff fvar).
+  // Z = 2^N prod_b cosh(beta J_b) Z_even, Z_even being the sum over the even
+  // subgraphs of prod_b tanh(beta J_b).  On the torus, Z_even = (P(-,-) +
+  // P(-,+) + P(+,-) - P(+,+)) / 2, P(ex, ey) being the Pfaffian with
+  // (anti)periodic wrapping bonds in x and y, of the 4N x 4N matrix that
+  // replaces each site by a K4 of unit weights, one terminal per bond.  The
+  // Pfaffians are evaluated row by row on a dense front of O(Lx + Ly) nodes
+  // (see sector()), at a cost of O(Lx (Lx + Ly)^2) per row, and accumulated
+  // as sign and log|P|.  For frustrated couplings, Z_even is a sum of terms
+  // of both signs that cancels to about exp(-2 beta |J|) per unsatisfied
+  // bond, both in the elimination and in the combination of the four
+  // Pfaffians; at low temperatures this needs a multiprecision U.  The
+  // rounding error is estimated from the growth of the eliminated entries
+  // relative to the pivots and from the cancellation of the combination, and
+  // a loss of more than half of the digits of U is reported as runtime_error.
+  template<typename U, typename LATTICE>
+  static U log_partition_function(U const& beta, LATTICE const& lat,
+                                  std::vector<double> const& inter) {
+    using std::abs; using std::exp; using std::log; using std::tanh;
+    unsigned Lx, Ly;
+    std::vector<std::size_t> bx, by;
+    if (!square_geometry(lat, Lx, Ly, bx, by))
+      throw(std::invalid_argument("pfaffian needs a periodic square lattice"));
+    if (inter.size() != lat.num_bonds())
+      throw(std::invalid_argument("inconsitent table size of interaction"));
+    std::size_t n = lat.num_sites();
+    U logz = U(0);
+    std::vector<U> tx(n), ty(n);
+    for (std::size_t s = 0; s < n; ++s) {
+      U kx = beta * inter[bx[s]], ky = beta * inter[by[s]];
+      tx[s] = tanh(kx);
+      ty[s] = tanh(ky);
+      // log(2 cosh(k)) = |k| + log(1 + exp(-2 |k|)), twice per site
+      logz += abs(kx) + log(1.0 + exp(-2.0 * abs(kx))) + abs(ky) +
+              log(1.0 + exp(-2.0 * abs(ky)));
+    }
+    logz -= double(n) * log(U(2));
+    std::array<int, 4> sign;
+    std::array<U, 4> logp, error;
+    exact::parallel::for_each(4, [&](std::size_t i) {
+      sector(Lx, Ly, tx, ty, (i & 1) ? 1 : -1, (i & 2) ? 1 : -1, sign[i], logp[i],
+             error[i]);
+    });
+    // coefficients of P(-,-), P(+,-), P(-,+), P(+,+)
+    const int coef[4] = {1, 1, 1, -1};
+    std::size_t imax = 4;
+    for (std::size_t i = 0; i < 4; ++i)
+      if (sign[i] != 0 && (imax == 4 || logp[i] > logp[imax])) imax = i;
+    if (imax == 4)
+      throw(std::runtime_error("vanishing partition function"));
+    U sum = U(0), err = U(0);
+    for (std::size_t i = 0; i < 4; ++i) {
+      if (sign[i] == 0) continue;
+      U p = exp(logp[i] - logp[imax]);
+      sum += double(coef[i] * sign[i]) * p;
+      err += (1 + error[i]) * p;
+    }
+    typedef typename boost::math::differentiation::detail::get_root_type<U>::type real_t;
+    real_t eps = std::numeric_limits<real_t>::epsilon();
+    if (!(sum > 0) || !(err * eps < sqrt(eps) * sum))
+      throw(std::runtime_error("loss of precision in the Pfaffian combination; use a wider type"));
+    return logz + logp[imax] + log(sum / 2.0);
+  }
+
+  template<typename T, typename LATTICE>
+  static T free_energy(T const& beta, LATTICE const& lat, std::vector<double> const& inter,
+                       std::vector<double> const& field = std::vector<double>(0)) {
+    if (!(beta > 0))
+      throw(std::invalid_argument("beta should be positive"));
+    if (field.size() > 0 && field.size() != lat.num_sites())
+      throw(std::invalid_argument("inconsitent table size of external field"));
+    for (auto h : field)
+      if (h != 0) throw(std::invalid_argument("pfaffian needs zero external field"));
+    return -log_partition_function(beta, lat, inter) / beta;
+  }
+
+  template<typename T, typename LATTICE>
+  static T free_energy_density(T const& beta, LATTICE const& lat, std::vector<double> const& inter,
+                               std::vector<double> const& field = std::vector<double>(0)) {
+    return free_energy(beta, lat, inter, field) / lat.num_sites();
+  }
+
+  // free energy, energy, and specific heat per site
+  template<typename T, typename LATTICE>
+  static std::tuple<T, T, T> thermodynamics(T const& beta, LATTICE const& lat,
+                                            std::vector<double> const& inter) {
+    using namespace boost::math::differentiation;
+    if (!(beta > 0))
+      throw(std::invalid_argument("beta should be positive"));
+    auto b = make_fvar<T, 2>(beta);
+    auto logz = log_partition_function(b, lat, inter);
+    T n = T(lat.num_sites());
+    return std::make_tuple(-logz.derivative(0) / beta / n, -logz.derivative(1) / n,
+                           beta * beta * logz.derivative(2) / n);
+  }
+
+private:
+  // Pfaffian P(ex, ey) as sign and log|P|.  Node 4 s + d is the terminal of
+  // site s toward +x, +y, -x, -y for d = 0, 1, 2, 3.  The rows of the lattice
+  // enter a dense front in the order 0, Ly - 1, 1, 2, ..., Ly - 2, an even
+  // permutation of the rows, and the terminals of a site are eliminated once
+  // the rows above and below it are in.  The eliminated nodes then always
+  // form whole sites, whose Pfaffian is the even-subgraph sum of the region
+  // they cover.  On a region closed around the torus in a periodic sector
+  // (ex or ey = 1), this sum carries signs that alternate with the number of
+  // winding loops and cancels strongly at low temperatures or on long
+  // cylinders, so the sites on the seam (the column x = Lx - 1 for ex = 1,
+  // the row y = 0 for ey = 1) are kept in the front until the end.  error is
+  // the estimated relative rounding error of P in units of epsilon (see
+  // front::eliminate()).
+  template<typename U>
+  static void sector(unsigned Lx, unsigned Ly, std::vector<U> const& tx,
+                     std::vector<U> const& ty, int ex, int ey, int& sign, U& logp,
+                     U& error) {
+    front<U> f(16 * Lx + 4 * Ly, 4 * Lx * Ly);
+    std::vector<bool> entered(Ly, false);
+    sign = 1;
+    logp = U(0);
+    auto wx = [&](unsigned x, unsigned y) {
+      return (x == Lx - 1) ? double(ex) * tx[x + Lx * y] : tx[x + Lx * y];
+    };
+    auto wy = [&](unsigned x, unsigned y) {
+      return (y == Ly - 1) ? double(ey) * ty[x + Lx * y] : ty[x + Lx * y];
+    };
+    auto enter = [&](unsigned y) {
+      f.reserve(f.size() + 4 * Lx);
+      for (std::size_t v = 4 * Lx * y; v < 4 * Lx * (y + 1); ++v) f.push_back(v);
+      entered[y] = true;
+      unsigned yu = (y + 1) % Ly, yd = (y + Ly - 1) % Ly;
+      for (unsigned x = 0; x < Lx; ++x) {
+        std::size_t v = 4 * (x + Lx * y);
+        for (unsigned d = 0; d < 4; ++d)
+          for (unsigned e = d + 1; e < 4; ++e) f.add(v + d, v + e, U(1));
+        f.add(v, 4 * ((x + 1) % Lx + Lx * y) + 2, wx(x, y));
+        if (entered[yu]) f.add(v + 1, 4 * (x + Lx * yu) + 3, wy(x, y));
+        if (entered[yd]) f.add(4 * (x + Lx * yd) + 1, v + 3, wy(x, yd));
+      }
+    };
+    bool hold = true;
+    auto ready = [&](std::size_t v) {
+      unsigned x = (v / 4) % Lx, y = v / 4 / Lx;
+      if (hold && ((ex == 1 && x == Lx - 1) || (ey == 1 && y == 0))) return false;
+      return entered[(y + 1) % Ly] && entered[(y + Ly - 1) % Ly];
+    };
+    enter(0);
+    enter(Ly - 1);
+    f.eliminate(ready, sign, logp);
+    for (unsigned y = 1; sign != 0 && y + 1 < Ly; ++y) {
+      enter(y);
+      f.eliminate(ready, sign, logp);
+    }
+    hold = false;
+    if (sign != 0) f.eliminate(ready, sign, logp);
+    if (f.size() > 0) sign = 0;
+    error = f.error();
+  }
+
+  // Skew-symmetric matrix over the nodes in the front, stored as upper
+  // triangle with row stride stride_
+  template<typename U>
+  class front {
+  public:
+    front(std::size_t capacity, std::size_t num_nodes)
+      : stride_(capacity), a_(capacity * capacity, U(0)),
+        pos_(num_nodes, std::size_t(-1)), growth_(1), error_(0) {}
+    std::size_t size() const { return node_.size(); }
+    // estimated relative rounding error of the Pfaffian of the eliminated
+    // nodes, in units of epsilon
+    U const& error() const { return error_; }
+    void reserve(std::size_t n) {
+      if (n <= stride_) return;
+      std::vector<U> b(n * n, U(0));
+      for (std::size_t i = 0; i < size(); ++i)
+        for (std::size_t j = i + 1; j < size(); ++j) b[i * n + j] = a_[i * stride_ + j];
+      std::swap(a_, b);
+      stride_ = n;
+    }
+    void push_back(std::size_t v) {
+      pos_[v] = node_.size();
+      node_.push_back(v);
+    }
+    // M[v][w] += c, M[w][v] -= c
+    void add(std::size_t v, std::size_t w, U const& c) {
+      std::size_t i = pos_[v], j = pos_[w];
+      if (i < j) a_[i * stride_ + j] += c;
+      else a_[j * stride_ + i] -= c;
+    }
+    // Eliminates pairs of ready nodes, each time the pair with the largest
+    // entry, and multiplies their Pfaffian into (sign, logp); the Schur
+    // complement of the remaining nodes is left in the front.
+    template<typename READY>
+    void eliminate(READY ready, int& sign, U& logp) {
+      using std::abs; using std::log;
+      std::size_t n = size(), k = 0;
+      std::vector<std::size_t> cand;
+      while (true) {
+        cand.clear();
+        for (std::size_t i = k; i < n; ++i)
+          if (ready(node_[i])) cand.push_back(i);
+        if (cand.size() < 2) break;
+        std::size_t p = cand[0], q = cand[1];
+        U best = abs(at(p, q));
+        for (std::size_t ii = 0; ii < cand.size(); ++ii)
+          for (std::size_t jj = ii + 1; jj < cand.size(); ++jj) {
+            U v = abs(at(cand[ii], cand[jj]));
+            if (v > best) { best = v; p = cand[ii]; q = cand[jj]; }
+          }
+        if (best == 0) break;
+        // bring the pair to positions k and k + 1
+        if (p != k) {
+          exchange(k, k, p);
+          sign = -sign;
+          if (q == k) q = p;
+        }
+        if (q != k + 1) {
+          exchange(k, k + 1, q);
+          sign = -sign;
+        }
+        U piv = a_[k * stride_ + k + 1];
+        if (piv < 0) sign = -sign;
+        logp += log(abs(piv));
+        U const* rk = &a_[k * stride_];
+        U const* rl = &a_[(k + 1) * stride_];
+        // the pivot carries the rounding errors of the earlier updates, which
+        // are bounded by their largest term growth_
+        error_ += growth_ / abs(piv);
+        U mr = U(0), mc = U(0);
+        for (std::size_t i = k + 2; i < n; ++i) {
+          mr = std::max<U>(mr, std::max<U>(abs(rk[i]), abs(rl[i])));
+          mc = std::max<U>(mc, abs(rk[i]) + abs(rl[i]));
+        }
+        growth_ = std::max<U>(growth_, mr * mc / abs(piv));
+        for (std::size_t i = k + 2; i < n; ++i) {
+          if (rk[i] == 0 && rl[i] == 0) continue;
+          U ci = rl[i] / piv, di = rk[i] / piv;
+          U* ri = &a_[i * stride_];
+          for (std::size_t j = i + 1; j < n; ++j) ri[j] += ci * rk[j] - di * rl[j];
+        }
+        k += 2;
+      }
+      // drop the eliminated nodes
+      for (std::size_t i = 0; i < k; ++i) pos_[node_[i]] = std::size_t(-1);
+      for (std::size_t i = k; i < n; ++i) {
+        for (std::size_t j = i + 1; j < n; ++j)
+          a_[(i - k) * stride_ + j - k] = a_[i * stride_ + j];
+        pos_[node_[i]] = i - k;
+      }
+      node_.erase(node_.begin(), node_.begin() + k);
+      for (std::size_t i = 0; i < n; ++i)
+        for (std::size_t j = std::max(i + 1, n - k); j < n; ++j) a_[i * stride_ + j] = U(0);
+    }
+
+  private:
+    U at(std::size_t i, std::size_t j) const {
+      return (i < j) ? a_[i * stride_ + j] : -a_[j * stride_ + i];
+    }
+    // exchanges positions p < q, for the rows from k on
+    void exchange(std::size_t k, std::size_t p, std::size_t q) {
+      using std::swap;
+      std::size_t n = size();
+      for (std::size_t c = k; c < p; ++c) swap(a_[c * stride_ + p], a_[c * stride_ + q]);
+      for (std::size_t c = p + 1; c < q; ++c) {
+        U t = a_[p * stride_ + c];
+        a_[p * stride_ + c] = -a_[c * stride_ + q];
+        a_[c * stride_ + q] = -t;
+      }
+      for (std::size_t c = q + 1; c < n; ++c) swap(a_[p * stride_ + c], a_[q * stride_ + c]);
+      a_[p * stride_ + q] = -a_[p * stride_ + q];
+      swap(node_[p], node_[q]);
+      pos_[node_[p]] = p;
+      pos_[node_[q]] = q;
+    }
+
+    std::size_t stride_;
+    std::vector<U> a_;
+    std::vector<std::size_t> node_;
+    std::vector<std::size_t> pos_;
+    U growth_;
+    U error_;
+  };
+};
+
+} // end namespace ising
@@ -9,10 +9,16 @@
 
 // Calculating free energy density of square lattice Ising model by the transfer matrix method
 
+#include <algorithm>
 #include <cmath>
+#include <stdexcept>
+#include <tuple>
 #include <vector>
 #include <boost/array.hpp>
 #include <standards/exp_number.hpp>
+#include "exact/butterfly.hpp"
+#include "exact/log_sum_exp.hpp"
+#include "exact/parallel.hpp"
 
 #ifndef ISING_SQUARE_TRANSFER_MATRIX_HPP
 #define ISING_SQUARE_TRANSFER_MATRIX_HPP
@@ -70,55 +76,203 @@ public:
   template<typename VEC>
   static exp_double product_U(double beta, std::vector<double> const& inter_y, VEC& v) {
     int width = inter_y.size();
-    int dim = 1 << width;
     exp_double normal = 1;
-    boost::array<double, 2> weight;
+    std::vector<boost::array<double, 2> > weight(width);
     for (int s = 0; s < width; ++s) {
       double offset = std::abs(beta * inter_y[s]);
       normal *= standards::exp_number<double>(offset);
-      weight[0] = std::exp(beta * inter_y[s] - offset);
-      weight[1] = std::exp(-beta * inter_y[s] - offset);
-      for (int c0 = 0; c0 < dim; ++c0) {
-        if (((c0 >> s) & 1) == 0) {
-          int c1 = c0 ^ (1 << s);
-          double v0 = v[c0];
-          double v1 = v[c1];
-          v[c0] = weight[0] * v0 + weight[1] * v1;
-          v[c1] = weight[0] * v1 + weight[1] * v0;
-        }
-      }
+      weight[s][0] = std::exp(beta * inter_y[s] - offset);
+      weight[s][1] = std::exp(-beta * inter_y[s] - offset);
     }
+    exact::butterfly::apply(width, [&](std::size_t s, std::size_t c, std::size_t n) {
+      const double w0 = weight[s][0], w1 = weight[s][1];
+      std::size_t bit = std::size_t(1) << s;
+      for (std::size_t c0 = c; c0 < c + n; ++c0) {
+        double v0 = v[c0];
+        double v1 = v[c0 + bit];
+        v[c0] = w0 * v0 + w1 * v1;
+        v[c0 + bit] = w0 * v1 + w1 * v0;
+      }
+    }, exact::butterfly::tile_bits(sizeof(double)));
     return normal;
   }
 
-  static double free_energy(double beta, int Lx, int Ly,
-                            std::vector<double> const& inter,
-                            std::vector<double> const& field = std::vector<double>(0)) {
-    std::vector<double> inter_x(Lx), inter_y(Lx), field_x(field.size() > 0 ? Lx : 0);
-    int dim = 1 << Lx;
-    std::vector<double> v(dim);
-    exp_double sum = 0;
-    for (int i = 0; i < dim; ++i) {
-      exp_double weight = 1;
-      for (int j = 0; j < dim; ++j) v[j] = 0;
-      v[i] = 1;
+  // Number of realizations propagated together by free_energy_batch
+  static const std::size_t lanes = 8;
+
+  // log Z of LANES realizations inter[k], field[k] (field[k] may be empty).
+  // The diagonal of each row's D and the mixing weights of its U are
+  // tabulated once per realization; the vectors are stored lane-innermost,
+  // so the loops over realizations have a fixed length and vectorize.  Each
+  // row rescales the vectors by their largest element, which is accumulated
+  // in the logarithm.
+  template<std::size_t LANES>
+  static void log_partition(double beta, int Lx, int Ly, std::vector<double> const* const* inter,
+                            std::vector<double> const* const* field, double* logz) {
+    const std::size_t K = LANES;
+    std::size_t dim = std::size_t(1) << Lx;
+    std::vector<double> diag(Ly * dim * K), mix(Ly * Lx * 2 * K);
+    std::vector<double> normal(K, 0);
+    for (std::size_t k = 0; k < K; ++k) {
+      std::vector<double> const& J = *inter[k];
+      std::vector<double> const& h = *field[k];
+      std::vector<boost::array<double, 2> > weight(Lx), weight_h(Lx);
       for (int y = 0; y < Ly; ++y) {
         for (int x = 0; x < Lx; ++x) {
-          inter_x[x] = inter[2 * (Lx * y + x)];
-          inter_y[x] = inter[2 * (Lx * y + x) + 1];
+          double offset = std::abs(beta * J[2 * (Lx * y + x)]);
+          normal[k] += offset;
+          weight[x][0] = std::exp(beta * J[2 * (Lx * y + x)] - offset);
+          weight[x][1] = std::exp(-beta * J[2 * (Lx * y + x)] - offset);
+          offset = h.size() ? std::abs(beta * h[Lx * y + x]) : 0;
+          normal[k] += offset;
+          weight_h[x][0] = h.size() ? std::exp(beta * h[Lx * y + x] - offset) : 1;
+          weight_h[x][1] = h.size() ? std::exp(-beta * h[Lx * y + x] - offset) : 1;
+          offset = std::abs(beta * J[2 * (Lx * y + x) + 1]);
+          normal[k] += offset;
+          mix[((y * Lx + x) * 2 + 0) * K + k] = std::exp(beta * J[2 * (Lx * y + x) + 1] - offset);
+          mix[((y * Lx + x) * 2 + 1) * K + k] = std::exp(-beta * J[2 * (Lx * y + x) + 1] - offset);
         }
-        if (field_x.size()) {
+        for (std::size_t c = 0; c < dim; ++c) {
+          double elem = 1;
           for (int x = 0; x < Lx; ++x) {
-            field_x[x] = field[Lx * y + x];
+            elem *= weight[x][((c >> x) & 1) ^ ((c >> ((x + 1) % Lx)) & 1)];
+            elem *= weight_h[x][(c >> x) & 1];
           }
+          diag[(y * dim + c) * K + k] = elem;
         }
-        weight *= ising::square::transfer_matrix::product_D(beta, inter_x, field_x, v);
-        weight *= ising::square::transfer_matrix::product_U(beta, inter_y, v);
       }
-      weight *= v[i];
-      sum += weight;
     }
-    return -log(sum) / beta;
+    std::vector<double> v(dim * K);
+    std::vector<exact::log_sum_exp<double> > trace(K);
+    // passes over the vector run in parallel blocks of 2^12 states
+    std::size_t nb = (dim >> 12) ? (dim >> 12) : 1, bs = dim / nb;
+    std::size_t tile = exact::butterfly::tile_bits(K * sizeof(double));
+    for (std::size_t i = 0; i < dim; ++i) {
+      double scale[K];
+      for (std::size_t k = 0; k < K; ++k) scale[k] = 0;
+      std::fill(v.begin(), v.end(), 0.0);
+      for (std::size_t k = 0; k < K; ++k) v[i * K + k] = 1;
+      for (int y = 0; y < Ly; ++y) {
+        double const* d = &diag[y * dim * K];
+        exact::parallel::for_each(nb, [&](std::size_t b) {
+          for (std::size_t j = b * bs * K; j < (b + 1) * bs * K; ++j) v[j] *= d[j];
+        });
+        double const* w = &mix[y * Lx * 2 * K];
+        exact::butterfly::apply(Lx, [&](std::size_t x, std::size_t c, std::size_t n) {
+          // local copies, which the stores into v cannot alias
+          double w0[K], w1[K];
+          for (std::size_t k = 0; k < K; ++k) {
+            w0[k] = w[(x * 2 + 0) * K + k];
+            w1[k] = w[(x * 2 + 1) * K + k];
+          }
+          double* p = v.data();
+          for (std::size_t c0 = c; c0 < c + n; ++c0) {
+            double* v0 = p + c0 * K;
+            double* v1 = p + (c0 + (std::size_t(1) << x)) * K;
+            for (std::size_t k = 0; k < K; ++k) {
+              double a = v0[k], b = v1[k];
+              v0[k] = w0[k] * a + w1[k] * b;
+              v1[k] = w0[k] * b + w1[k] * a;
+            }
+          }
+        }, tile);
+        std::vector<double> vmax = exact::parallel::reduce(
+            nb, std::vector<double>(K, 0),
+            [&](std::size_t b) {
+              std::vector<double> m(K, 0);
+              for (std::size_t c = b * bs; c < (b + 1) * bs; ++c)
+                for (std::size_t k = 0; k < K; ++k) m[k] = std::max(m[k], v[c * K + k]);
+              return m;
+            },
+            [](std::vector<double> a, std::vector<double> const& b) {
+              for (std::size_t k = 0; k < a.size(); ++k) a[k] = std::max(a[k], b[k]);
+              return a;
+            });
+        for (std::size_t k = 0; k < K; ++k) {
+          if (vmax[k] == 0) {
+            vmax[k] = 1;
+          } else {
+            scale[k] += std::log(vmax[k]);
+            vmax[k] = 1 / vmax[k];
+          }
+        }
+        exact::parallel::for_each(nb, [&](std::size_t b) {
+          for (std::size_t c = b * bs; c < (b + 1) * bs; ++c)
+            for (std::size_t k = 0; k < K; ++k) v[c * K + k] *= vmax[k];
+        });
+      }
+      for (std::size_t k = 0; k < K; ++k) trace[k].add(scale[k], v[i * K + k]);
+    }
+    for (std::size_t k = 0; k < K; ++k) logz[k] = log(trace[k]) + normal[k];
+  }
+
+  static double free_energy(double beta, int Lx, int Ly,
+                            std::vector<double> const& inter,
+                            std::vector<double> const& field = std::vector<double>(0)) {
+    if (inter.size() != std::size_t(2 * Lx * Ly))
+      throw(std::invalid_argument("inconsitent table size of interaction"));
+    if (field.size() > 0 && field.size() != std::size_t(Lx * Ly))
+      throw(std::invalid_argument("inconsitent table size of external field"));
+    std::vector<double> const* pi = &inter;
+    std::vector<double> const* pf = &field;
+    double logz;
+    log_partition<1>(beta, Lx, Ly, &pi, &pf, &logz);
+    return -logz / beta;
+  }
+
+  // Free energies of the realizations inter[k], field[k] (fields may be empty
+  // for no field), lanes realizations at a time, the batches being
+  // distributed over threads
+  static std::vector<double> free_energy_batch(double beta, int Lx, int Ly,
+                                               std::vector<std::vector<double> > const& inter,
+                                               std::vector<std::vector<double> > const& field =
+                                               std::vector<std::vector<double> >(0)) {
+    if (field.size() > 0 && field.size() != inter.size())
+      throw(std::invalid_argument("inconsitent number of realizations"));
+    std::vector<double> const empty(0);
+    for (std::size_t k = 0; k < inter.size(); ++k) {
+      if (inter[k].size() != std::size_t(2 * Lx * Ly))
+        throw(std::invalid_argument("inconsitent table size of interaction"));
+      if (field.size() > 0 && field[k].size() > 0 && field[k].size() != std::size_t(Lx * Ly))
+        throw(std::invalid_argument("inconsitent table size of external field"));
+    }
+    std::size_t num = inter.size();
+    std::vector<double> res(num);
+    exact::parallel::for_each((num + lanes - 1) / lanes, [&](std::size_t batch) {
+      // the last batch is padded with copies of its first realization
+      std::vector<double> const* pi[lanes];
+      std::vector<double> const* pf[lanes];
+      for (std::size_t k = 0; k < lanes; ++k) {
+        std::size_t r = batch * lanes + k;
+        if (r >= num) r = batch * lanes;
+        pi[k] = &inter[r];
+        pf[k] = field.size() ? &field[r] : &empty;
+      }
+      double logz[lanes];
+      log_partition<lanes>(beta, Lx, Ly, pi, pf, logz);
+      for (std::size_t k = 0; k < lanes && batch * lanes + k < num; ++k)
+        res[batch * lanes + k] = -logz[k] / beta;
+    });
+    return res;
+  }
+
+  // Disorder average of the free energy density over the realizations and its
+  // standard error (0 for a single realization)
+  static std::tuple<double, double>
+  disorder_average(double beta, int Lx, int Ly, std::vector<std::vector<double> > const& inter,
+                   std::vector<std::vector<double> > const& field =
+                   std::vector<std::vector<double> >(0)) {
+    if (inter.size() == 0)
+      throw(std::invalid_argument("no realization"));
+    std::vector<double> f = free_energy_batch(beta, Lx, Ly, inter, field);
+    std::size_t num = f.size();
+    double mean = 0;
+    for (auto x : f) mean += x / (Lx * Ly);
+    mean /= num;
+    double var = 0;
+    for (auto x : f) var += (x / (Lx * Ly) - mean) * (x / (Lx * Ly) - mean);
+    double error = (num > 1) ? std::sqrt(var / (num - 1) / num) : 0;
+    return std::make_tuple(mean, error);
   }
 
   static double free_energy(double beta, int Lx, int Ly, double J, double H = 0.0) {
@@ -0,0 +1,211 @@
+/*****************************************************************************
+*
+* Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+*
+* Distributed under the Boost Software License, Version 1.0. (See accompanying
+* file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+*
+*****************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <utility>
+#include <vector>
+#include <gtest/gtest.h>
+#include <lattice/graph.hpp>
+#include "ising/counting.hpp"
+
+// periodic Lx x Ly lattice with couplings kx and ky on the x and y bonds
+std::vector<int> directional_couplings(lattice::graph const& lat, unsigned Lx, int kx, int ky) {
+  std::vector<int> k(lat.num_bonds());
+  for (std::size_t b = 0; b < lat.num_bonds(); ++b) {
+    unsigned i = lat.source(b), j = lat.target(b);
+    bool xbond = (j / Lx == i / Lx) && (j % Lx == (i + 1) % Lx || i % Lx == (j + 1) % Lx);
+    k[b] = xbond ? kx : ky;
+  }
+  return k;
+}
+
+TEST(CountingTest, Orbits) {
+  typedef ising::counting::histogram histogram;
+  for (auto L : {std::make_pair(4u, 4u), std::make_pair(4u, 5u)}) {
+    unsigned Lx = L.first, Ly = L.second;
+    auto lat = lattice::graph(lattice::basis::simple(2), lattice::unitcell::simple(2),
+                              lattice::extent(Lx, Ly));
+    auto k = directional_couplings(lat, Lx, 1, 2);
+    histogram orbits(lat, k);
+    EXPECT_EQ(Lx, orbits.length_x());
+    EXPECT_EQ(Ly, orbits.length_y());
+    histogram::use_symmetry() = false;
+    histogram gray(lat, k);
+    histogram::use_symmetry() = true;
+    EXPECT_EQ(0u, gray.length_x());
+    for (double beta : {0.1, 0.5, 2.0}) {
+      for (double H : {0.0, 0.3}) {
+        double f = gray.free_energy(beta, 1.0, H);
+        EXPECT_NEAR(f, orbits.free_energy(beta, 1.0, H), 1e-12 * std::abs(f));
+        for (unsigned n = 1; n <= 4; ++n) {
+          double m = gray.magnetization(beta, 1.0, H, n);
+          EXPECT_NEAR(m, orbits.magnetization(beta, 1.0, H, n), 1e-12 * std::abs(m) + 1e-12);
+        }
+      }
+    }
+  }
+}
+
+// Lx x Ly lattice with open boundaries, sites x + Lx y
+struct open_square {
+  open_square(unsigned Lx, unsigned Ly) : num_sites_(Lx * Ly) {
+    for (unsigned s = 0; s < num_sites_; ++s) {
+      if (s % Lx + 1 < Lx) bonds_.emplace_back(s, s + 1);
+      if (s / Lx + 1 < Ly) bonds_.emplace_back(s, s + Lx);
+    }
+  }
+  std::size_t num_sites() const { return num_sites_; }
+  std::size_t num_bonds() const { return bonds_.size(); }
+  std::size_t source(std::size_t b) const { return bonds_[b].first; }
+  std::size_t target(std::size_t b) const { return bonds_[b].second; }
+  unsigned num_sites_;
+  std::vector<std::pair<unsigned, unsigned>> bonds_;
+};
+
+// counting_kernel against the generic walk, which gives the same histogram
+template<typename LATTICE>
+void check_kernel(LATTICE const& lat, std::vector<int> const& k) {
+  typedef ising::counting::histogram histogram;
+  unsigned Lx, Ly;
+  int kx, ky;
+  ising::boundary bc;
+  EXPECT_TRUE(histogram::square_grid(lat, k, Lx, Ly, bc, kx, ky));
+  histogram kernel(lat, k);
+  histogram::use_kernels() = false;
+  histogram gray(lat, k);
+  histogram::use_kernels() = true;
+  for (double beta : {0.1, 0.5, 2.0}) {
+    for (double H : {0.0, 0.3}) {
+      EXPECT_EQ(gray.free_energy(beta, 1.0, H), kernel.free_energy(beta, 1.0, H));
+      for (unsigned n = 1; n <= 4; ++n)
+        EXPECT_EQ(gray.magnetization(beta, 1.0, H, n), kernel.magnetization(beta, 1.0, H, n));
+    }
+  }
+}
+
+TEST(CountingTest, Kernel) {
+  ising::counting::histogram::use_symmetry() = false;
+  for (auto L : {std::make_pair(2u, 2u), std::make_pair(2u, 3u), std::make_pair(4u, 4u),
+                 std::make_pair(3u, 5u), std::make_pair(6u, 2u)}) {
+    unsigned Lx = L.first, Ly = L.second;
+    auto lat = lattice::graph(lattice::basis::simple(2), lattice::unitcell::simple(2),
+                              lattice::extent(Lx, Ly));
+    check_kernel(lat, directional_couplings(lat, Lx, 1, -2));
+    open_square open(Lx, Ly);
+    std::vector<int> k(open.num_bonds());
+    for (std::size_t b = 0; b < k.size(); ++b)
+      k[b] = (open.target(b) == open.source(b) + 1) ? 2 : 1;
+    check_kernel(open, k);
+  }
+  ising::counting::histogram::use_symmetry() = true;
+}
+
+// brute-force free energy and magnetization moments <M^n>, n = 1, ..., 4
+template<typename LATTICE>
+std::vector<double> brute_force(double beta, LATTICE const& lat, std::vector<double> const& inter,
+                                double H) {
+  unsigned n = lat.num_sites();
+  std::vector<double> expo(1 << n);
+  for (unsigned c = 0; c < expo.size(); ++c) {
+    double x = 0;
+    for (std::size_t b = 0; b < lat.num_bonds(); ++b)
+      x += inter[b] * (1 - 2 * int(((c >> lat.source(b)) ^ (c >> lat.target(b))) & 1));
+    for (unsigned s = 0; s < n; ++s) x += H * (1 - 2 * int((c >> s) & 1));
+    expo[c] = beta * x;
+  }
+  double xmax = *std::max_element(expo.begin(), expo.end());
+  std::vector<double> sum(5, 0);
+  for (unsigned c = 0; c < expo.size(); ++c) {
+    double w = std::exp(expo[c] - xmax), m = n - 2.0 * __builtin_popcount(c);
+    for (unsigned p = 0; p < 5; ++p, w *= m) sum[p] += w;
+  }
+  std::vector<double> res(5);
+  res[0] = -(std::log(sum[0]) + xmax) / beta;
+  for (unsigned p = 1; p < 5; ++p) res[p] = sum[p] / sum[0];
+  return res;
+}
+
+TEST(CountingTest, Histogram) {
+  typedef ising::counting counting;
+  auto lat = lattice::graph(lattice::basis::simple(2), lattice::unitcell::simple(2),
+                            lattice::extent(3, 4));
+  std::mt19937 eng(13);
+  std::uniform_int_distribution<int> dist(-3, 3);
+  std::vector<int> k(lat.num_bonds());
+  for (auto& kb : k) kb = dist(eng);
+  k[0] = 1;  // counting::free_energy takes |inter[0]| as the unit
+  const double unit = 0.7;
+  std::vector<double> inter(k.size());
+  for (std::size_t b = 0; b < k.size(); ++b) inter[b] = unit * k[b];
+  counting::histogram hist(lat, k);
+  EXPECT_EQ(0u, hist.length_x());
+  for (double beta : {0.1, 0.5, 2.0}) {
+    for (double H : {0.0, -0.4}) {
+      auto exact = brute_force(beta, lat, inter, H);
+      std::vector<double> field(lat.num_sites(), H);
+      EXPECT_NEAR(exact[0], hist.free_energy(beta, unit, H), 1e-12 * std::abs(exact[0]));
+      EXPECT_NEAR(exact[0], counting::free_energy(beta, lat, inter, field),
+                  1e-12 * std::abs(exact[0]));
+      for (unsigned n = 1; n <= 4; ++n)
+        EXPECT_NEAR(exact[n], hist.magnetization(beta, unit, H, n),
+                    1e-12 * std::abs(exact[n]) + 1e-12);
+      double m1, m2, m3, m4;
+      std::tie(m1, m2, m3, m4) = counting::magnetization(beta, lat, inter, field);
+      EXPECT_NEAR(exact[1], m1, 1e-12 * std::abs(exact[1]) + 1e-12);
+      EXPECT_NEAR(exact[2], m2, 1e-12 * std::abs(exact[2]));
+      EXPECT_NEAR(exact[3], m3, 1e-12 * std::abs(exact[3]) + 1e-12);
+      EXPECT_NEAR(exact[4], m4, 1e-12 * std::abs(exact[4]));
+    }
+  }
+}
+
+TEST(CountingTest, Correlations) {
+  typedef ising::counting counting;
+  auto lat = lattice::graph(lattice::basis::simple(2), lattice::unitcell::simple(2),
+                            lattice::extent(3, 4));
+  unsigned n = lat.num_sites();
+  std::mt19937 eng(17);
+  std::uniform_real_distribution<double> dist(-1, 1);
+  std::vector<double> inter(lat.num_bonds()), field(n);
+  for (auto& J : inter) J = dist(eng);
+  for (auto& h : field) h = 0.3 * dist(eng);
+  // beta = 50 overflows exp without the running rescale
+  for (double beta : {0.2, 1.0, 50.0}) {
+    auto res = counting::correlations(beta, lat, inter, field);
+    std::vector<double> expo(1 << n), ene(1 << n);
+    for (unsigned c = 0; c < expo.size(); ++c) {
+      double v = 0, x = 0;
+      for (std::size_t b = 0; b < lat.num_bonds(); ++b)
+        v += inter[b] * (1 - 2 * int(((c >> lat.source(b)) ^ (c >> lat.target(b))) & 1));
+      for (unsigned s = 0; s < n; ++s) x += field[s] * (1 - 2 * int((c >> s) & 1));
+      expo[c] = beta * (v + x);
+      ene[c] = -v;
+    }
+    double xmax = *std::max_element(expo.begin(), expo.end());
+    double z = 0;
+    std::vector<double> em(5, 0);
+    std::vector<std::vector<double>> spin(n, std::vector<double>(n, 0));
+    for (unsigned c = 0; c < expo.size(); ++c) {
+      double w = std::exp(expo[c] - xmax), m = n - 2.0 * __builtin_popcount(c);
+      z += w;
+      double t = w * ene[c];
+      for (unsigned p = 0; p < 5; ++p, t *= m) em[p] += t;
+      for (unsigned i = 0; i < n; ++i)
+        for (unsigned j = 0; j < n; ++j)
+          spin[i][j] += w * (1 - 2 * int(((c >> i) ^ (c >> j)) & 1));
+    }
+    for (unsigned p = 0; p < 5; ++p)
+      EXPECT_NEAR(em[p] / z, res.energy_magnetization[p], 1e-10 * std::abs(em[p] / z) + 1e-10);
+    for (unsigned i = 0; i < n; ++i)
+      for (unsigned j = 0; j < n; ++j)
+        EXPECT_NEAR(spin[i][j] / z, res.spin[i][j], 1e-10);
+  }
+}
@@ -0,0 +1,51 @@
+/*****************************************************************************
+*
+* Copyright (C) 2015-2021 by Synge Todo <wistaria@phys.s.u-tokyo.ac.jp>
+*
+* Distributed under the Boost Software License, Version 1.0. (See accompanying
+* file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+*
+*****************************************************************************/
+
+#include <random>
+#include <stdexcept>
+#include <gtest/gtest.h>
+#include <boost/multiprecision/cpp_bin_float.hpp>
+#include <lattice/graph.hpp>
+#include "ising/pfaffian.hpp"
+
+typedef boost::multiprecision::cpp_bin_float_50 mp_t;
+
+// +-J couplings on a 16 x 16 torus
+std::vector<double> pm_couplings(lattice::graph const& lat) {
+  std::mt19937 engine(7u);
+  std::bernoulli_distribution bernoulli(0.5);
+  std::vector<double> inter(lat.num_bonds());
+  for (auto& j : inter) j = bernoulli(engine) ? 1 : -1;
+  return inter;
+}
+
+TEST(PfaffianTest, PMJLowT) {
+  auto lat = lattice::graph(lattice::basis::simple(2), lattice::unitcell::simple(2),
+                            lattice::extent(16, 16));
+  auto inter = pm_couplings(lat);
+  // double loses all digits at T = 0.2 and must not return a result
+  EXPECT_THROW(ising::pfaffian::thermodynamics(1 / 0.2, lat, inter), std::runtime_error);
+  auto r = ising::pfaffian::thermodynamics(1 / mp_t("0.2"), lat, inter);
+  mp_t f = std::get<0>(r), e = std::get<1>(r), c = std::get<2>(r);
+  EXPECT_LT(f, e);
+  EXPECT_GT(f, e - mp_t("0.2") * log(mp_t(2)));
+  EXPECT_GT(c, 0);
+  EXPECT_LT(c, 1e-4);
+}
+
+TEST(PfaffianTest, PMJ) {
+  auto lat = lattice::graph(lattice::basis::simple(2), lattice::unitcell::simple(2),
+                            lattice::extent(16, 16));
+  auto inter = pm_couplings(lat);
+  auto rd = ising::pfaffian::thermodynamics(1 / 0.5, lat, inter);
+  auto rm = ising::pfaffian::thermodynamics(1 / mp_t("0.5"), lat, inter);
+  EXPECT_NEAR(std::get<0>(rd), static_cast<double>(std::get<0>(rm)), 1e-10);
+  EXPECT_NEAR(std::get<1>(rd), static_cast<double>(std::get<1>(rm)), 1e-10);
+  EXPECT_NEAR(std::get<2>(rd), static_cast<double>(std::get<2>(rm)), 1e-8);
+}
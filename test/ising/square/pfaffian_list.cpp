@@ -0,0 +1,36 @@
+/*****************************************************************************
+*
+* Copyright (C) 2011-2017 by Synge Todo <wistaria@phy.s.u-tokyo.ac.jp>
+*
+* Distributed under the Boost Software License, Version 1.0. (See accompanying
+* file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+*
+*****************************************************************************/
+
+// Calculating free energy, energy, and specific heat of square lattice Ising
+// model with random coupling by Pfaffians
+
+#include <iomanip>
+#include <iostream>
+#include <lattice/graph.hpp>
+#include "ising/pfaffian.hpp"
+
+int main() {
+  int Lx, Ly; // system size
+  std::vector<double> inter;
+  double t_min, t_max, t_step;
+
+  std::cin >> Lx >> Ly;
+  auto lat = lattice::graph(lattice::basis::simple(2), lattice::unitcell::simple(2), lattice::extent(Lx, Ly));
+  inter.resize(lat.num_bonds());
+  for (std::size_t b = 0; b < lat.num_bonds(); ++b) std::cin >> inter[b];
+  std::cin >> t_min >> t_max >> t_step;
+
+  std::cout << "# Lx = " << Lx <<std::endl << "# Ly = " << Ly <<std::endl;
+  std::cout << std::scientific << std::setprecision(11);
+  for (double t = t_min; t <= t_max; t += t_step) {
+    double beta = 1 / t;
+    auto res = ising::pfaffian::thermodynamics(beta, lat, inter);
+    std::cout << t << ' ' << std::get<0>(res) << ' ' << std::get<1>(res) << ' ' << std::get<2>(res) << std::endl;
+  }
+}
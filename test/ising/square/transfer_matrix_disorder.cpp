@@ -0,0 +1,54 @@
+/*****************************************************************************
+*
+* Copyright (C) 2011-2017 by Synge Todo <wistaria@phy.s.u-tokyo.ac.jp>
+*
+* Distributed under the Boost Software License, Version 1.0. (See accompanying
+* file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+*
+*****************************************************************************/
+
+// Disorder-averaged free energy density of square lattice +-J Ising model
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <tuple>
+#include <vector>
+#include "ising/square/transfer_matrix.hpp"
+
+int main(int argc, char **argv) {
+  int Lx, Ly; // system size
+  int num_samples;
+  unsigned seed;
+  double t_min, t_max, t_step;
+  if (argc >= 8) {
+    Lx = std::stoi(argv[1]);
+    Ly = std::stoi(argv[2]);
+    num_samples = std::stoi(argv[3]);
+    seed = std::stoul(argv[4]);
+    t_min = std::stod(argv[5]);
+    t_max = std::stod(argv[6]);
+    t_step = std::stod(argv[7]);
+  } else {
+    std::cin >> Lx >> Ly >> num_samples >> seed >> t_min >> t_max >> t_step;
+  }
+  std::cout << "# Lx = " << Lx << std::endl
+            << "# Ly = " << Ly << std::endl
+            << "# samples = " << num_samples << std::endl
+            << "# seed = " << seed << std::endl
+            << "# T [f] error" << std::endl;
+
+  // couplings +1 or -1 with equal probability
+  std::mt19937 engine(seed);
+  std::vector<std::vector<double> > inter(num_samples, std::vector<double>(2 * Lx * Ly));
+  for (auto& realization : inter)
+    for (auto& J : realization) J = (engine() & 1) ? 1.0 : -1.0;
+
+  std::cout << std::scientific << std::setprecision(11);
+  for (double t = t_min; t <= t_max; t += t_step) {
+    double beta = 1 / t;
+    double f, error;
+    std::tie(f, error) = ising::square::transfer_matrix::disorder_average(beta, Lx, Ly, inter);
+    std::cout << t << ' ' << f << ' ' << error << std::endl;
+  }
+}
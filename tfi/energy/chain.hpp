@@ -20,7 +20,7 @@
 
 #include <cmath>
 #include <boost/math/constants/constants.hpp>
-#include <boost/math/quadrature/tanh_sinh.hpp>
+#include "exact/tanh_sinh_cache.hpp"
 
 namespace tfi {
 namespace energy {
@@ -50,7 +50,7 @@ inline T infinite(T J, T Gamma) {
   typedef T real_t;
   if (abs(J)> 0) {
     auto pi = boost::math::constants::pi<real_t>();
-    boost::math::quadrature::tanh_sinh<real_t> integrator;
+    auto& integrator = exact::tanh_sinh_cache::shared<real_t>();
     return -integrator.integrate(func(J, Gamma), 0, pi) / (2 * pi);
   } else {
     return -abs(Gamma);
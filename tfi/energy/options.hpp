@@ -17,6 +17,7 @@
 #pragma once
 
 #include <iostream>
+#include <limits>
 #include <string>
 
 struct options {
@@ -57,6 +58,9 @@ struct options {
       "Usage: " + prog + " [-p prec] Gamma\n" +
       "       " + prog + " [-p prec] J Gamma\n" +
       "       " + prog + " [-p prec] J GammaMin GammaMax dGamma\n" +
-      "Note: Gamma can be specified as \"GammaC\" instead of real numbers\n";
+      "Note: Gamma can be specified as \"GammaC\" instead of real numbers\n" +
+      "      EXACT_TANH_SINH_CACHE=dir keeps the quadrature tables for\n" +
+      "      prec > " + std::to_string(std::numeric_limits<long double>::digits10) +
+      " in dir across runs\n";
   }
 };